@@ -0,0 +1,277 @@
+//
+//  Raytracing.cpp
+//  Raytracing
+//
+//  Implementation of the C interface on top of HittableList and Renderer.
+//  Ray queries and baking trace a BVH over the spheres, built on first use
+//  after the scene changed.
+//
+
+#include "Raytracing.h"
+
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+#include "../Math/Material.h"
+#include "../Math/Hittablelist.h"
+#include "../Shape/Sphere.h"
+#include "../Accel/HittableBVH.h"
+#include "../Camera/Camera.h"
+#include "../Render/Renderer.h"
+#include "../Render/RayQuery.h"
+#include "../Render/Baker.h"
+
+struct RTScene
+{
+    RTScene() : m_renderer(&m_threadPool), m_tracer(&m_threadPool), m_baker(&m_threadPool), m_bRendering(false) {}
+    
+    const Hittable& GetTraceWorld()
+    {
+        if (!m_bvh)
+        {
+            m_bvh.reset(new HittableBVH(m_world.GetObjects()));
+        }
+        return *m_bvh;
+    }
+    
+    HittableList                            m_world;
+    std::vector<shared_ptr<Material>>       m_materials;
+    std::unordered_map<const Material*, int> m_materialIds;
+    std::unique_ptr<HittableBVH>            m_bvh;
+    CameraSettings                          m_camera;
+    ThreadPool                              m_threadPool;
+    Renderer                                m_renderer;
+    BatchTracer                             m_tracer;
+    Baker                                   m_baker;
+    std::vector<RayQuery>                   m_queries;
+    std::vector<RayQueryHit>                m_hits;
+    CancelToken                             m_cancelToken;
+    std::atomic_bool                        m_bRendering;   // also set while tracing, baking or editing
+};
+
+static Vector3 ToVector3(const float value[3])
+{
+    return Vector3(value[0], value[1], value[2]);
+}
+
+static int AddMaterial(RTScene* scene, shared_ptr<Material> material)
+{
+    scene->m_materials.push_back(material);
+    scene->m_materialIds[material.get()] = int(scene->m_materials.size()) - 1;
+    return int(scene->m_materials.size()) - 1;
+}
+
+RTScene* RTCreateScene(void)
+{
+    return new RTScene();
+}
+
+void RTDestroyScene(RTScene* scene)
+{
+    delete scene;
+}
+
+// Edits claim the scene the same way RTRender does, so a render cannot start
+// between the check and the change.
+int RTAddLambertian(RTScene* scene, float r, float g, float b)
+{
+    if (!scene)                             return RT_ERROR_INVALID_ARGUMENT;
+    if (scene->m_bRendering.exchange(true)) return RT_ERROR_BUSY;
+    int material = AddMaterial(scene, scene->m_world.Create<Lambertian>(Vector3(r, g, b)));
+    scene->m_bRendering = false;
+    return material;
+}
+
+int RTAddMetal(RTScene* scene, float r, float g, float b, float fuzz)
+{
+    if (!scene || fuzz < 0)                 return RT_ERROR_INVALID_ARGUMENT;
+    if (scene->m_bRendering.exchange(true)) return RT_ERROR_BUSY;
+    int material = AddMaterial(scene, scene->m_world.Create<Metal>(Vector3(r, g, b), fuzz));
+    scene->m_bRendering = false;
+    return material;
+}
+
+int RTAddDielectric(RTScene* scene, float refractiveIndex)
+{
+    if (!scene || refractiveIndex <= 0)     return RT_ERROR_INVALID_ARGUMENT;
+    if (scene->m_bRendering.exchange(true)) return RT_ERROR_BUSY;
+    int material = AddMaterial(scene, scene->m_world.Create<Dielectric>(refractiveIndex));
+    scene->m_bRendering = false;
+    return material;
+}
+
+int RTAddSphere(RTScene* scene, float x, float y, float z, float radius, int material)
+{
+    if (!scene)
+    {
+        return RT_ERROR_INVALID_ARGUMENT;
+    }
+    if (scene->m_bRendering.exchange(true))
+    {
+        return RT_ERROR_BUSY;
+    }
+    if (material < 0 || material >= int(scene->m_materials.size()))
+    {
+        scene->m_bRendering = false;
+        return RT_ERROR_INVALID_ARGUMENT;
+    }
+    
+    scene->m_world.AddHittable(scene->m_world.Create<Sphere>(Vector3(x, y, z), radius, scene->m_materials[material]));
+    scene->m_bvh.reset();
+    int sphere = int(scene->m_world.Size()) - 1;
+    scene->m_bRendering = false;
+    return sphere;
+}
+
+RTResult RTSetCamera(RTScene* scene, const RTCamera* camera)
+{
+    if (!scene || !camera)                  return RT_ERROR_INVALID_ARGUMENT;
+    if (scene->m_bRendering.exchange(true)) return RT_ERROR_BUSY;
+    
+    scene->m_camera.m_lookFrom = ToVector3(camera->lookFrom);
+    scene->m_camera.m_lookAt = ToVector3(camera->lookAt);
+    scene->m_camera.m_vup = ToVector3(camera->up);
+    scene->m_camera.m_vfov = camera->verticalFov;
+    scene->m_camera.m_aperture = camera->aperture;
+    scene->m_camera.m_focusDistance = camera->focusDistance;
+    scene->m_bRendering = false;
+    return RT_SUCCESS;
+}
+
+RTResult RTRender(RTScene* scene, const RTRenderSettings* settings, float* pixels, size_t rowStride)
+{
+    if (!scene || !settings || !pixels || settings->width <= 0 || settings->height <= 0 ||
+        settings->samplesPerPixel <= 0 || settings->maxDepth < 0)
+    {
+        return RT_ERROR_INVALID_ARGUMENT;
+    }
+    if (rowStride == 0)
+    {
+        rowStride = 3 * sizeof(float) * settings->width;
+    }
+    else if (rowStride < 3 * sizeof(float) * settings->width)
+    {
+        return RT_ERROR_INVALID_ARGUMENT;
+    }
+    if (scene->m_bRendering.exchange(true))
+    {
+        return RT_ERROR_BUSY;
+    }
+    
+    RenderSettings renderSettings;
+    renderSettings.m_samplesPerPixel = settings->samplesPerPixel;
+    renderSettings.m_maxDepth = settings->maxDepth;
+    Camera camera = scene->m_camera.Build(double(settings->width) / settings->height);
+    
+    // The frame buffer writes each pixel's average straight into the
+    // caller's memory when its tile is flushed; nothing is copied afterwards.
+    FrameBuffer frameBuffer;
+    scene->m_renderer.AllocateFrameBuffer(frameBuffer, settings->width, settings->height, renderSettings.m_tileSize);
+    frameBuffer.SetOutput(pixels, rowStride);
+    bool bFinished = scene->m_renderer.RenderPass(scene->m_world, camera, renderSettings, frameBuffer, &scene->m_cancelToken);
+    
+    scene->m_bRendering = false;
+    return bFinished ? RT_SUCCESS : RT_ERROR_CANCELLED;
+}
+
+RTResult RTTraceRays(RTScene* scene, const RTRay* rays, RTHit* hits, size_t count)
+{
+    if (!scene || (count > 0 && (!rays || !hits)))
+    {
+        return RT_ERROR_INVALID_ARGUMENT;
+    }
+    if (scene->m_bRendering.exchange(true))
+    {
+        return RT_ERROR_BUSY;
+    }
+    
+    // Converted and traced in slices so the internal buffers stay bounded.
+    const Hittable& world = scene->GetTraceWorld();
+    const size_t sliceSize = size_t(1) << 20;
+    for (size_t first = 0; first < count; first += sliceSize)
+    {
+        const int sliceCount = int(std::min(sliceSize, count - first));
+        scene->m_queries.resize(sliceCount);
+        scene->m_hits.resize(sliceCount);
+        for (int k = 0; k < sliceCount; ++k)
+        {
+            const RTRay& ray = rays[first + k];
+            scene->m_queries[k] = RayQuery{ ToVector3(ray.origin), ToVector3(ray.direction), ray.tMin, ray.tMax };
+        }
+        
+        scene->m_tracer.Trace(world, scene->m_queries.data(), sliceCount, scene->m_hits.data());
+        for (int k = 0; k < sliceCount; ++k)
+        {
+            const RayQueryHit& hit = scene->m_hits[k];
+            RTHit& result = hits[first + k];
+            result.t = hit.m_t;
+            result.normal[0] = hit.m_normal.X();
+            result.normal[1] = hit.m_normal.Y();
+            result.normal[2] = hit.m_normal.Z();
+            result.material = hit.m_material ? scene->m_materialIds[hit.m_material] : -1;
+        }
+    }
+    
+    scene->m_bRendering = false;
+    return RT_SUCCESS;
+}
+
+RTResult RTBakeSphere(RTScene* scene, int sphere, const RTBakeSettings* settings,
+                      float* ambientOcclusion, float* irradiance)
+{
+    if (!scene || !settings || sphere < 0 || sphere >= int(scene->m_world.Size()) ||
+        settings->width <= 0 || settings->height <= 0 || settings->samplesPerTexel <= 0)
+    {
+        return RT_ERROR_INVALID_ARGUMENT;
+    }
+    if (scene->m_bRendering.exchange(true))
+    {
+        return RT_ERROR_BUSY;
+    }
+    
+    // Every object added through this interface is a Sphere.
+    const Sphere& target = static_cast<const Sphere&>(*scene->m_world.GetObjects()[sphere]);
+    BakeSettings bakeSettings;
+    bakeSettings.m_width = settings->width;
+    bakeSettings.m_height = settings->height;
+    bakeSettings.m_samplesPerTexel = settings->samplesPerTexel;
+    bakeSettings.m_occlusionDistance = settings->occlusionDistance;
+    FrameBuffer occlusionMap, irradianceMap;
+    scene->m_baker.BakeSphere(scene->GetTraceWorld(), target.GetCenter(), target.GetRadius(), bakeSettings,
+                              occlusionMap, irradianceMap);
+    
+    for (int j = 0; j < settings->height; ++j)
+    {
+        for (int i = 0; i < settings->width; ++i)
+        {
+            const int texel = j * settings->width + i;
+            if (ambientOcclusion)
+            {
+                ambientOcclusion[texel] = occlusionMap.GetColorSum(i, j).X();
+            }
+            if (irradiance)
+            {
+                Vector3 value = irradianceMap.GetColorSum(i, j);
+                irradiance[3 * texel + 0] = value.X();
+                irradiance[3 * texel + 1] = value.Y();
+                irradiance[3 * texel + 2] = value.Z();
+            }
+        }
+    }
+    
+    scene->m_bRendering = false;
+    return RT_SUCCESS;
+}
+
+float RTGetProgress(const RTScene* scene)
+{
+    return scene ? scene->m_renderer.GetProgress() : 0.0f;
+}
+
+void RTCancel(RTScene* scene)
+{
+    if (scene)
+    {
+        scene->m_cancelToken.Cancel();
+    }
+}
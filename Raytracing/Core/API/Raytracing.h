@@ -0,0 +1,121 @@
+//
+//  Raytracing.h
+//  Raytracing
+//
+//  C interface to the renderer, for embedding it in other programs. Scenes
+//  are opaque handles; all functions are safe to call from C or C++.
+//
+
+#ifndef Raytracing_h
+#define Raytracing_h
+
+#include <stddef.h>
+
+// The core library reads streamed scenes and textures with POSIX file I/O
+// and is built for POSIX systems only, so there is no dllexport/dllimport
+// variant. RT_BUILDING_CORE is defined by the library's own build to export
+// these functions from its otherwise hidden symbols; consumers see plain
+// declarations.
+#if defined(RT_BUILDING_CORE) && defined(__GNUC__)
+#define RT_API __attribute__((visibility("default")))
+#else
+#define RT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct RTScene RTScene;
+
+typedef enum RTResult
+{
+    RT_SUCCESS = 0,
+    RT_ERROR_INVALID_ARGUMENT = -1,
+    RT_ERROR_CANCELLED = -2,
+    RT_ERROR_BUSY = -3          // the scene is being rendered or traced
+} RTResult;
+
+typedef struct RTCamera
+{
+    float lookFrom[3];
+    float lookAt[3];
+    float up[3];
+    float verticalFov;          // degrees
+    float aperture;             // 0 for a pinhole camera
+    float focusDistance;
+} RTCamera;
+
+typedef struct RTRenderSettings
+{
+    int width;
+    int height;
+    int samplesPerPixel;
+    int maxDepth;
+} RTRenderSettings;
+
+typedef struct RTRay
+{
+    float origin[3];
+    float direction[3];         // need not be unit length; distances are in its units
+    float tMin;
+    float tMax;
+} RTRay;
+
+typedef struct RTHit
+{
+    float t;                    // INFINITY on a miss
+    float normal[3];            // outward unit normal, zero on a miss
+    int material;               // index from RTAdd*, -1 on a miss
+} RTHit;
+
+typedef struct RTBakeSettings
+{
+    int width;                  // texels along u
+    int height;                 // texels along v
+    int samplesPerTexel;
+    float occlusionDistance;    // hits further away do not occlude
+} RTBakeSettings;
+
+// A scene starts empty, with the default camera and its own worker threads.
+RT_API RTScene* RTCreateScene(void);
+RT_API void RTDestroyScene(RTScene* scene);
+
+// Materials and spheres return their non-negative index, or an RTResult.
+RT_API int RTAddLambertian(RTScene* scene, float r, float g, float b);
+RT_API int RTAddMetal(RTScene* scene, float r, float g, float b, float fuzz);
+RT_API int RTAddDielectric(RTScene* scene, float refractiveIndex);
+RT_API int RTAddSphere(RTScene* scene, float x, float y, float z, float radius, int material);
+
+RT_API RTResult RTSetCamera(RTScene* scene, const RTCamera* camera);
+
+// Renders the scene into caller memory and returns when done or cancelled.
+// pixels receives width * height linear RGB floats, top row first, with
+// rowStride bytes between rows (0 for 3 * width floats). Pixels are written
+// as their tiles finish, so the buffer can be read while rendering.
+RT_API RTResult RTRender(RTScene* scene, const RTRenderSettings* settings, float* pixels, size_t rowStride);
+
+// Closest hits of count caller-made rays, traced on the scene's worker
+// threads. Like RTRender, fails with RT_ERROR_BUSY while the scene is in use.
+RT_API RTResult RTTraceRays(RTScene* scene, const RTRay* rays, RTHit* hits, size_t count);
+
+// Bakes a sphere's ambient occlusion and irradiance over its longitude and
+// latitude mapping, u around the vertical axis and v from the bottom pole
+// up. Texel (i, j) is element j * width + i; ambientOcclusion receives one
+// float per texel (1 for open), irradiance three linear RGB floats from the
+// sky and emitters in direct view. Either output may be NULL.
+RT_API RTResult RTBakeSphere(RTScene* scene, int sphere, const RTBakeSettings* settings,
+                             float* ambientOcclusion, float* irradiance);
+
+// Fraction of the current or last render that has finished, in [0, 1].
+// May be called from any thread.
+RT_API float RTGetProgress(const RTScene* scene);
+
+// Stops a running RTRender, which then returns RT_ERROR_CANCELLED.
+RT_API void RTCancel(RTScene* scene);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Raytracing_h */
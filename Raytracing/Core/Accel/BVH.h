@@ -0,0 +1,247 @@
+//
+//  BVH.h
+//  Raytracing
+//
+//  Flat bounding volume hierarchy over arbitrary primitive bounds. Nodes are
+//  stored depth-first: the left child follows its parent, the right child
+//  index is stored in the node.
+//
+
+#ifndef BVH_h
+#define BVH_h
+
+#include <algorithm>
+#include <vector>
+#include "../Math/AABB.h"
+
+struct BVHNode
+{
+    AABB    m_bounds;
+    int     m_rightOrFirst;     // right child for inner nodes, first primitive for leaves
+    int     m_count;            // 0 for inner nodes
+};
+
+class BVH
+{
+public:
+    BVH() {}
+    
+    void Build(const std::vector<AABB>& primitiveBounds, int maxLeafSize = 4)
+    {
+        m_nodes.clear();
+        m_primitives.resize(primitiveBounds.size());
+        for (size_t i = 0; i < m_primitives.size(); ++i)
+        {
+            m_primitives[i] = int(i);
+        }
+        if (!m_primitives.empty())
+        {
+            BuildRecursive(primitiveBounds, 0, int(m_primitives.size()), maxLeafSize);
+        }
+    }
+    
+    bool IsEmpty() const { return m_nodes.empty(); }
+    const std::vector<BVHNode>& GetNodes() const { return m_nodes; }
+    const std::vector<int>& GetPrimitives() const { return m_primitives; }
+    
+    // Calls visit(primitive, t_entry) for every primitive whose leaf box the
+    // ray enters before t_max. visit may return a smaller t_max to prune.
+    template<typename Visitor>
+    void Traverse(const Ray& r, float t_min, float t_max, Visitor&& visit) const
+    {
+        if (m_nodes.empty())
+        {
+            return;
+        }
+        
+        Vector3 origin = r.GetOrigin();
+        Vector3 direction = r.GetDirection();
+        Vector3 invDirection(1.0f / direction.X(), 1.0f / direction.Y(), 1.0f / direction.Z());
+        
+        int stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = m_nodes[stack[--stackSize]];
+            float t_entry;
+            if (!node.m_bounds.Hit(origin, invDirection, t_min, t_max, t_entry))
+            {
+                continue;
+            }
+            
+            if (node.m_count > 0)
+            {
+                for (int p = node.m_rightOrFirst; p < node.m_rightOrFirst + node.m_count; ++p)
+                {
+                    t_max = visit(m_primitives[p], t_entry, t_max);
+                }
+                continue;
+            }
+            
+            int self = int(&node - m_nodes.data());
+            stack[stackSize++] = node.m_rightOrFirst;
+            stack[stackSize++] = self + 1;
+        }
+    }
+    
+    static const int s_kMaxInterleavedLanes = 16;
+    
+    // Traverse() for many rays, keeping up to laneCount of them in flight.
+    // Lanes advance one node or leaf at a time, round robin, and each step
+    // prefetches what its lane reads next, so a cache miss overlaps with
+    // the other lanes' work instead of stalling the core. visit(ray,
+    // primitive, t_entry, t_max) works as in Traverse() with the index of
+    // the ray added; prefetch(primitive) should prefetch the primitive's
+    // data. t_max holds one bound per ray and is narrowed in place. Every
+    // ray visits the same primitives in the same order as with Traverse().
+    template<typename Visitor, typename Prefetcher>
+    void TraverseInterleaved(const Ray* rays, int count, float t_min, float* t_max, int laneCount,
+                             Visitor&& visit, Prefetcher&& prefetch) const
+    {
+        if (m_nodes.empty())
+        {
+            return;
+        }
+        
+        struct Lane
+        {
+            int     m_ray;
+            Vector3 m_origin;
+            Vector3 m_invDirection;
+            int     m_leaf;         // leaf whose primitives this lane visits next, -1 if none
+            float   m_leafEntry;
+            int     m_stackSize;
+            int     m_stack[64];
+        };
+        
+        Lane lanes[s_kMaxInterleavedLanes];
+        int nextRay = 0;
+        auto start = [&](Lane& lane)
+        {
+            if (nextRay >= count)
+            {
+                return false;
+            }
+            
+            lane.m_ray = nextRay++;
+            lane.m_origin = rays[lane.m_ray].GetOrigin();
+            Vector3 direction = rays[lane.m_ray].GetDirection();
+            lane.m_invDirection = Vector3(1.0f / direction.X(), 1.0f / direction.Y(), 1.0f / direction.Z());
+            lane.m_leaf = -1;
+            lane.m_stackSize = 1;
+            lane.m_stack[0] = 0;
+            return true;
+        };
+        
+        laneCount = std::max(1, std::min(laneCount, s_kMaxInterleavedLanes));
+        int active = 0;
+        while (active < laneCount && start(lanes[active]))
+        {
+            active++;
+        }
+        
+        // A lane's turn ends as soon as it has issued a prefetch. Boxes it
+        // misses on the way were prefetched on an earlier turn and cost
+        // little, so it keeps popping through them.
+        int current = 0;
+        while (active > 0)
+        {
+            Lane& lane = lanes[current];
+            if (lane.m_leaf >= 0)
+            {
+                const BVHNode& leaf = m_nodes[lane.m_leaf];
+                float& closest = t_max[lane.m_ray];
+                for (int p = leaf.m_rightOrFirst; p < leaf.m_rightOrFirst + leaf.m_count; ++p)
+                {
+                    closest = visit(lane.m_ray, m_primitives[p], lane.m_leafEntry, closest);
+                }
+                lane.m_leaf = -1;
+            }
+            
+            while (lane.m_stackSize > 0)
+            {
+                const int self = lane.m_stack[--lane.m_stackSize];
+                const BVHNode& node = m_nodes[self];
+                float t_entry;
+                if (!node.m_bounds.Hit(lane.m_origin, lane.m_invDirection, t_min, t_max[lane.m_ray], t_entry))
+                {
+                    continue;
+                }
+                
+                if (node.m_count > 0)
+                {
+                    for (int p = node.m_rightOrFirst; p < node.m_rightOrFirst + node.m_count; ++p)
+                    {
+                        prefetch(m_primitives[p]);
+                    }
+                    lane.m_leaf = self;
+                    lane.m_leafEntry = t_entry;
+                }
+                else
+                {
+                    Prefetch(&m_nodes[node.m_rightOrFirst]);
+                    Prefetch(&m_nodes[self + 1]);
+                    lane.m_stack[lane.m_stackSize++] = node.m_rightOrFirst;
+                    lane.m_stack[lane.m_stackSize++] = self + 1;
+                }
+                break;
+            }
+            
+            // A finished lane takes the next ray, or the last lane's place.
+            if (lane.m_leaf < 0 && lane.m_stackSize == 0 && !start(lane))
+            {
+                lane = lanes[--active];
+                if (current < active)
+                {
+                    continue;
+                }
+            }
+            current = current + 1 < active ? current + 1 : 0;
+        }
+    }
+    
+private:
+    int BuildRecursive(const std::vector<AABB>& primitiveBounds, int first, int count, int maxLeafSize)
+    {
+        int nodeIndex = int(m_nodes.size());
+        m_nodes.push_back(BVHNode());
+        
+        AABB bounds;
+        AABB centroidBounds;
+        for (int p = first; p < first + count; ++p)
+        {
+            const AABB& box = primitiveBounds[m_primitives[p]];
+            bounds.Grow(box);
+            centroidBounds.Grow(AABB(box.Center(), box.Center()));
+        }
+        m_nodes[nodeIndex].m_bounds = bounds;
+        
+        if (count <= maxLeafSize)
+        {
+            m_nodes[nodeIndex].m_rightOrFirst = first;
+            m_nodes[nodeIndex].m_count = count;
+            return nodeIndex;
+        }
+        
+        // Median split along the axis with the widest centroid spread.
+        int axis = centroidBounds.LongestAxis();
+        int middle = first + count / 2;
+        std::nth_element(m_primitives.begin() + first, m_primitives.begin() + middle, m_primitives.begin() + first + count,
+                         [&](int a, int b)
+                         {
+                             return primitiveBounds[a].Center().m_value[axis] < primitiveBounds[b].Center().m_value[axis];
+                         });
+        
+        BuildRecursive(primitiveBounds, first, middle - first, maxLeafSize);
+        int right = BuildRecursive(primitiveBounds, middle, first + count - middle, maxLeafSize);
+        m_nodes[nodeIndex].m_rightOrFirst = right;
+        m_nodes[nodeIndex].m_count = 0;
+        return nodeIndex;
+    }
+    
+    std::vector<BVHNode>    m_nodes;
+    std::vector<int>        m_primitives;
+};
+
+#endif /* BVH_h */
@@ -0,0 +1,141 @@
+//
+//  HittableBVH.h
+//  Raytracing
+//
+//  A Hittable over a BVH of other hittables, for scenes too large to test
+//  object by object. Objects without bounds are kept aside and tested
+//  against every ray.
+//
+
+#ifndef HittableBVH_h
+#define HittableBVH_h
+
+#include <vector>
+#include "BVH.h"
+#include "../Math/Hittable.h"
+
+class HittableBVH : public Hittable
+{
+public:
+    HittableBVH(const std::vector<shared_ptr<Hittable>>& objects)
+    {
+        std::vector<AABB> bounds;
+        for (const auto& object : objects)
+        {
+            AABB box;
+            if (object->boundingBox(box))
+            {
+                m_objects.push_back(object.get());
+                bounds.push_back(box);
+            }
+            else
+            {
+                m_unbounded.push_back(object.get());
+            }
+        }
+        m_bvh.Build(bounds);
+    }
+    
+    virtual bool hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+    {
+        bool bHit = false;
+        for (const Hittable* object : m_unbounded)
+        {
+            if (object->hit(r, t_min, t_max, rec))
+            {
+                bHit = true;
+                t_max = rec.m_t;
+            }
+        }
+        
+        m_bvh.Traverse(r, t_min, t_max, [&](int primitive, float t_entry, float closest)
+        {
+            if (m_objects[primitive]->hit(r, t_min, closest, rec))
+            {
+                bHit = true;
+                return rec.m_t;
+            }
+            return closest;
+        });
+        return bHit;
+    }
+    
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const
+    {
+        for (const Hittable* object : m_unbounded)
+        {
+            if (object->occluded(r, t_min, t_max))
+            {
+                return true;
+            }
+        }
+        
+        // Collapse t_max on the first hit so traversal stops visiting boxes.
+        bool bOccluded = false;
+        m_bvh.Traverse(r, t_min, t_max, [&](int primitive, float t_entry, float closest)
+        {
+            if (!bOccluded && m_objects[primitive]->occluded(r, t_min, closest))
+            {
+                bOccluded = true;
+                return t_min;
+            }
+            return closest;
+        });
+        return bOccluded;
+    }
+    
+    // Interleaves the traversals of up to m_interleavedLanes rays, see
+    // BVH::TraverseInterleaved(). Pays off once the scene no longer fits in
+    // the last level cache.
+    virtual void hitBatch(const Ray* rays, int count, float t_min, float* t, const Hittable** objects) const
+    {
+        HitRecord rec;
+        for (const Hittable* object : m_unbounded)
+        {
+            for (int k = 0; k < count; ++k)
+            {
+                if (object->hit(rays[k], t_min, t[k], rec))
+                {
+                    t[k] = rec.m_t;
+                    objects[k] = object;
+                }
+            }
+        }
+        
+        m_bvh.TraverseInterleaved(rays, count, t_min, t, m_interleavedLanes,
+            [&](int ray, int primitive, float t_entry, float closest)
+            {
+                if (m_objects[primitive]->hit(rays[ray], t_min, closest, rec))
+                {
+                    objects[ray] = m_objects[primitive];
+                    return rec.m_t;
+                }
+                return closest;
+            },
+            [&](int primitive)
+            {
+                Prefetch(m_objects[primitive]);
+            });
+    }
+    
+    void SetInterleavedLanes(int laneCount) { m_interleavedLanes = laneCount; }
+    
+    virtual bool boundingBox(AABB& box_out) const
+    {
+        if (!m_unbounded.empty() || m_bvh.IsEmpty())
+        {
+            return false;
+        }
+        box_out = m_bvh.GetNodes()[0].m_bounds;
+        return true;
+    }
+    
+private:
+    // Non-owning; the scene the objects came from keeps them alive.
+    std::vector<const Hittable*>    m_objects;
+    std::vector<const Hittable*>    m_unbounded;
+    BVH                             m_bvh;
+    int                             m_interleavedLanes = 8;
+};
+
+#endif /* HittableBVH_h */
@@ -0,0 +1,383 @@
+//
+//  LightTree.h
+//  Raytracing
+//
+//  Bounding hierarchy over emissive spheres for many-light sampling, after
+//  "Importance Sampling of Many Lights with Adaptive Tree Splitting" (Conty
+//  Estevez and Kulla). Every node bounds the position, total power and
+//  emission directions of its lights; a light is picked by walking down
+//  and choosing each child in proportion to its estimated contribution at
+//  the shading point, so a sample costs O(log n) however many lights exist.
+//
+
+#ifndef LightTree_h
+#define LightTree_h
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "../Math/AABB.h"
+#include "../Math/Material.h"
+#include "../Math/ONB.h"
+#include "../Shape/Sphere.h"
+
+struct SphereLight
+{
+    Vector3         m_center;
+    float           m_radius;
+    Vector3         m_radiance;
+    const Hittable* m_object;
+};
+
+// Directions a set of lights emits into: within m_thetaO of m_axis, plus up
+// to m_thetaE beyond that for the falloff of each emitter.
+struct EmissionCone
+{
+    Vector3 m_axis;
+    float   m_thetaO;
+    float   m_thetaE;
+    
+    // Spheres emit from every point of their surface in all directions.
+    static EmissionCone Sphere() { return EmissionCone{ Vector3(0, 0, 1), float(s_kPI), float(s_kPI / 2) }; }
+    
+    static EmissionCone Union(EmissionCone a, EmissionCone b)
+    {
+        if (b.m_thetaO > a.m_thetaO)
+        {
+            std::swap(a, b);
+        }
+        
+        float thetaE = std::max(a.m_thetaE, b.m_thetaE);
+        float thetaD = acos(Clamp(dot(a.m_axis, b.m_axis), -1, 1));
+        if (std::min(thetaD + b.m_thetaO, float(s_kPI)) <= a.m_thetaO)
+        {
+            return EmissionCone{ a.m_axis, a.m_thetaO, thetaE };
+        }
+        
+        float thetaO = (a.m_thetaO + thetaD + b.m_thetaO) / 2;
+        if (thetaO >= s_kPI)
+        {
+            return EmissionCone{ a.m_axis, float(s_kPI), thetaE };
+        }
+        
+        // Rotate a's axis towards b's by the growth of the cone.
+        float thetaR = thetaO - a.m_thetaO;
+        Vector3 axis = unit_vector(a.m_axis * sin(thetaD - thetaR) + b.m_axis * sin(thetaR));
+        return EmissionCone{ axis, thetaO, thetaE };
+    }
+};
+
+class LightTree
+{
+public:
+    LightTree() : m_bUniform(false) {}
+    
+    // Collects every sphere with an emissive material.
+    static std::vector<SphereLight> GatherLights(const std::vector<shared_ptr<Hittable>>& objects)
+    {
+        std::vector<SphereLight> lights;
+        for (const auto& object : objects)
+        {
+            const Sphere* sphere = dynamic_cast<const Sphere*>(object.get());
+            const DiffuseLight* light = sphere ? dynamic_cast<const DiffuseLight*>(sphere->GetMaterial()) : nullptr;
+            if (light)
+            {
+                lights.push_back(SphereLight{ sphere->GetCenter(), fabs(sphere->GetRadius()), light->GetRadiance(), sphere });
+            }
+        }
+        return lights;
+    }
+    
+    void Build(const std::vector<SphereLight>& lights)
+    {
+        m_lights = lights;
+        m_nodes.clear();
+        m_trails.assign(lights.size(), 0);
+        m_lightIndices.clear();
+        m_powerCdf.resize(lights.size());
+        
+        std::vector<int> order(lights.size());
+        double totalPower = 0;
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            order[i] = int(i);
+            m_lightIndices[lights[i].m_object] = int(i);
+            totalPower += GetPower(lights[i]);
+            m_powerCdf[i] = totalPower;
+        }
+        if (!lights.empty())
+        {
+            BuildRecursive(order, 0, int(order.size()), 0, 0);
+        }
+    }
+    
+    // Picks lights uniformly instead of by importance, for comparisons.
+    void SetUniform(bool bUniform) { m_bUniform = bUniform; }
+    
+    bool IsEmpty() const { return m_lights.empty(); }
+    size_t GetLightCount() const { return m_lights.size(); }
+    const SphereLight& GetLight(int index) const { return m_lights[index]; }
+    
+    // Index of the light for a hit object, or -1.
+    int FindLight(const Hittable* object) const
+    {
+        auto found = m_lightIndices.find(object);
+        return found == m_lightIndices.end() ? -1 : found->second;
+    }
+    
+    // Chooses a light for shading at point with the given normal. Returns
+    // false when no light can contribute there.
+    bool Sample(const Vector3& point, const Vector3& normal, double u, int& light_out, double& pmf_out) const
+    {
+        if (m_lights.empty())
+        {
+            return false;
+        }
+        if (m_bUniform)
+        {
+            light_out = std::min(int(u * m_lights.size()), int(m_lights.size()) - 1);
+            pmf_out = 1.0 / m_lights.size();
+            return true;
+        }
+        
+        int node = 0;
+        pmf_out = 1.0;
+        while (!m_nodes[node].m_bLeaf)
+        {
+            int left = node + 1;
+            int right = m_nodes[node].m_rightOrLight;
+            double leftImportance = Importance(m_nodes[left], point, normal);
+            double rightImportance = Importance(m_nodes[right], point, normal);
+            double total = leftImportance + rightImportance;
+            if (total <= 0)
+            {
+                return false;
+            }
+            
+            double leftProbability = leftImportance / total;
+            if (u < leftProbability)
+            {
+                u = ffmin(u / leftProbability, 0.99999999);
+                pmf_out *= leftProbability;
+                node = left;
+            }
+            else
+            {
+                u = ffmin((u - leftProbability) / (1 - leftProbability), 0.99999999);
+                pmf_out *= 1 - leftProbability;
+                node = right;
+            }
+        }
+        light_out = m_nodes[node].m_rightOrLight;
+        return true;
+    }
+    
+    // Picks a light in proportion to its power alone, for paths that start
+    // on a light instead of at a shading point.
+    bool SampleByPower(double u, int& light_out, double& pmf_out) const
+    {
+        if (m_lights.empty() || m_powerCdf.back() <= 0)
+        {
+            return false;
+        }
+        auto found = std::upper_bound(m_powerCdf.begin(), m_powerCdf.end(), u * m_powerCdf.back());
+        light_out = std::min(int(found - m_powerCdf.begin()), int(m_lights.size()) - 1);
+        pmf_out = PowerPmf(light_out);
+        return pmf_out > 0;
+    }
+    
+    double PowerPmf(int light) const
+    {
+        double previous = light > 0 ? m_powerCdf[light - 1] : 0.0;
+        return (m_powerCdf[light] - previous) / m_powerCdf.back();
+    }
+    
+    // Probability that Sample() picks the given light at point.
+    double Pmf(const Vector3& point, const Vector3& normal, int light) const
+    {
+        if (m_bUniform)
+        {
+            return 1.0 / m_lights.size();
+        }
+        
+        uint64_t trail = m_trails[light];
+        int node = 0;
+        double pmf = 1.0;
+        while (!m_nodes[node].m_bLeaf)
+        {
+            int left = node + 1;
+            int right = m_nodes[node].m_rightOrLight;
+            double leftImportance = Importance(m_nodes[left], point, normal);
+            double rightImportance = Importance(m_nodes[right], point, normal);
+            double total = leftImportance + rightImportance;
+            if (total <= 0)
+            {
+                return 0.0;
+            }
+            
+            bool bRight = trail & 1;
+            pmf *= (bRight ? rightImportance : leftImportance) / total;
+            node = bRight ? right : left;
+            trail >>= 1;
+        }
+        return pmf;
+    }
+    
+    // Uniformly samples the cone of directions from point to the light. Fills
+    // the direction, its solid angle pdf and the distance to the surface.
+    static bool SampleSphere(const Vector3& point, const SphereLight& light,
+                             Vector3& direction_out, double& pdf_out, float& distance_out)
+    {
+        Vector3 toCenter = light.m_center - point;
+        double distance2 = toCenter.SquaredLength();
+        double radius2 = light.m_radius * light.m_radius;
+        if (distance2 <= radius2)
+        {
+            return false;
+        }
+        
+        double sin2ThetaMax = radius2 / distance2;
+        double cosThetaMax = sqrt(ffmax(0, 1 - sin2ThetaMax));
+        double oneMinusCosThetaMax = sin2ThetaMax / (1 + cosThetaMax);
+        double cosTheta = 1 - RandomDouble() * oneMinusCosThetaMax;
+        double sinTheta = sqrt(ffmax(0, 1 - cosTheta * cosTheta));
+        double phi = 2 * s_kPI * RandomDouble();
+        ONB uvw(toCenter);
+        direction_out = unit_vector(uvw.Local(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta));
+        pdf_out = 1 / (2 * s_kPI * oneMinusCosThetaMax);
+        
+        // Nearest intersection with the sphere along the sampled direction.
+        double b = dot(toCenter, direction_out);
+        double discriminant = ffmax(0, b * b - (distance2 - radius2));
+        distance_out = float(b - sqrt(discriminant));
+        return true;
+    }
+    
+    static double SpherePdf(const Vector3& point, const SphereLight& light)
+    {
+        double distance2 = (light.m_center - point).SquaredLength();
+        double radius2 = light.m_radius * light.m_radius;
+        if (distance2 <= radius2)
+        {
+            return 0.0;
+        }
+        double sin2ThetaMax = radius2 / distance2;
+        double cosThetaMax = sqrt(ffmax(0, 1 - sin2ThetaMax));
+        return 1 / (2 * s_kPI * sin2ThetaMax / (1 + cosThetaMax));
+    }
+
+private:
+    static float GetPower(const SphereLight& light)
+    {
+        return Luminance(light.m_radiance) * 4 * s_kPI * light.m_radius * light.m_radius * s_kPI;
+    }
+    
+    struct Node
+    {
+        AABB            m_bounds;
+        EmissionCone    m_cone;
+        float           m_power;
+        int             m_rightOrLight;     // right child, or the light of a leaf
+        bool            m_bLeaf;
+    };
+    
+    // Estimated contribution of a node's lights at a shading point: power
+    // over squared distance, scaled by the best case of the receiver's
+    // cosine and of the emitters' orientation over the node's bounds.
+    // The distance to the center, clamped to the bounds' radius, cannot
+    // tell apart a large node around the point from its neighbour, so it is
+    // averaged (geometrically) with the distance to the nearest point of the
+    // bounds. Without that the first levels are coin flips and the noise
+    // grows with the number of lights.
+    static double Importance(const Node& node, const Vector3& point, const Vector3& normal)
+    {
+        Vector3 toCenter = node.m_bounds.Center() - point;
+        double distance2 = toCenter.SquaredLength();
+        double boundRadius = 0.5 * node.m_bounds.Extent().Length();
+        double boundRadius2 = boundRadius * boundRadius;
+        
+        // Angle subtended by the node's bounding sphere; everything is
+        // possible from inside it.
+        double thetaU = s_kPI;
+        if (distance2 > boundRadius2)
+        {
+            thetaU = asin(sqrt(boundRadius2 / distance2));
+        }
+        Vector3 direction = distance2 > 0 ? toCenter / sqrt(distance2) : normal;
+        
+        double thetaI = acos(Clamp(dot(normal, direction), -1, 1));
+        double thetaIPrime = ffmax(0, thetaI - thetaU);
+        if (thetaIPrime >= s_kPI / 2)
+        {
+            return 0.0;
+        }
+        
+        double theta = acos(Clamp(dot(node.m_cone.m_axis, -direction), -1, 1));
+        double thetaPrime = ffmax(0, theta - node.m_cone.m_thetaO - thetaU);
+        if (thetaPrime >= node.m_cone.m_thetaE)
+        {
+            return 0.0;
+        }
+        
+        Vector3 toBounds = Vector3::GetZero();
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            toBounds.m_value[axis] = Clamp(point.m_value[axis], node.m_bounds.Min().m_value[axis], node.m_bounds.Max().m_value[axis]) - point.m_value[axis];
+        }
+        double nearest2 = ffmax(toBounds.SquaredLength(), 1e-2 * boundRadius2);
+        return node.m_power * cos(thetaIPrime) * cos(thetaPrime) / sqrt(nearest2 * ffmax(distance2, boundRadius2));
+    }
+    
+    int BuildRecursive(std::vector<int>& order, int first, int count, int depth, uint64_t trail)
+    {
+        int nodeIndex = int(m_nodes.size());
+        m_nodes.push_back(Node());
+        
+        AABB bounds;
+        AABB centroidBounds;
+        float power = 0;
+        for (int i = first; i < first + count; ++i)
+        {
+            const SphereLight& light = m_lights[order[i]];
+            bounds.Grow(AABB::FromSphere(light.m_center, light.m_radius));
+            centroidBounds.Grow(AABB(light.m_center, light.m_center));
+            power += GetPower(light);
+        }
+        m_nodes[nodeIndex].m_bounds = bounds;
+        // Spheres emit in every direction, so every node's cone is the full
+        // sphere; EmissionCone::Union() is for one-sided emitters.
+        m_nodes[nodeIndex].m_cone = EmissionCone::Sphere();
+        m_nodes[nodeIndex].m_power = power;
+        
+        // Median splits keep the depth near log2(count), well inside the 64
+        // turns a trail can record.
+        if (count == 1)
+        {
+            m_nodes[nodeIndex].m_rightOrLight = order[first];
+            m_nodes[nodeIndex].m_bLeaf = true;
+            m_trails[order[first]] = trail;
+            return nodeIndex;
+        }
+        
+        // Median split along the widest spread of light positions.
+        int axis = centroidBounds.LongestAxis();
+        int middle = first + count / 2;
+        std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + first + count,
+                         [&](int a, int b) { return m_lights[a].m_center.m_value[axis] < m_lights[b].m_center.m_value[axis]; });
+        
+        BuildRecursive(order, first, middle - first, depth + 1, trail);
+        int right = BuildRecursive(order, middle, first + count - middle, depth + 1, trail | (uint64_t(1) << depth));
+        m_nodes[nodeIndex].m_rightOrLight = right;
+        m_nodes[nodeIndex].m_bLeaf = false;
+        return nodeIndex;
+    }
+    
+    std::vector<SphereLight>                        m_lights;
+    std::vector<Node>                               m_nodes;
+    std::vector<uint64_t>                           m_trails;   // path from the root to each light's leaf
+    std::vector<double>                             m_powerCdf;
+    std::unordered_map<const Hittable*, int>        m_lightIndices;
+    bool                                            m_bUniform;
+};
+
+#endif /* LightTree_h */
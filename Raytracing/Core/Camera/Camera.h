@@ -24,9 +24,11 @@ public:
     {
         m_origin = lookfrom;
         m_lensRadius = aperture / 2;
+        m_focusDistance = focusDistance;
         
         auto theta = DegreesToRadian(vfov);
         auto half_height = tan(theta/2);
+        m_verticalExtent = 2 * half_height;
         auto half_width = aspect * half_height;
         
         m_w = unit_vector(lookfrom - lookat);
@@ -42,22 +44,95 @@ public:
     
     Camera()
     {
+            m_lensRadius = 0.0;
+            m_focusDistance = 1.0;
+            m_verticalExtent = 2.0;
             m_origin = Vector3(0.0, 0.0, 0.0);
             m_lowerLeftCorner = Vector3(-2.0, -1.0, -1.0);
             m_horizontal = Vector3(4.0, 0.0, 0.0);
             m_vertical = Vector3(0.0, 2.0, 0.0);
+            m_u = Vector3(1.0, 0.0, 0.0);
+            m_v = Vector3(0.0, 1.0, 0.0);
+            m_w = Vector3(0.0, 0.0, 1.0);
     }
 
-    Ray GetRay(double u, double v)
+    Ray GetRay(double u, double v) const
     {
+        return HasLens() ? GetRay<true>(u, v) : GetRay<false>(u, v);
+    }
+    
+    // Specialized ray generation. The pinhole variant skips the lens sample.
+    template<bool kThinLens>
+    Ray GetRay(double u, double v) const
+    {
+        Vector3 target = m_lowerLeftCorner + u * m_horizontal + v * m_vertical;
+        if (!kThinLens)
+        {
+            return Ray(m_origin, target - m_origin);
+        }
+        
         Vector3 randomPointInDisk = m_lensRadius * Vector3::RandomInUnitDisk();
         Vector3 offset = m_u * randomPointInDisk.X() + m_v * randomPointInDisk.Y();
         
-        return Ray(m_origin + offset, m_lowerLeftCorner + u * m_horizontal + v * m_vertical - m_origin - offset);
+        return Ray(m_origin + offset, target - m_origin - offset);
+    }
+    
+    bool HasLens() const { return m_lensRadius > 0; }
+    double GetLensRadius() const { return m_lensRadius; }
+    double GetFocusDistance() const { return m_focusDistance; }
+    
+    // Angle covered by one pixel row, the spread of primary ray cones.
+    float GetPixelSpread(int imageHeight) const { return m_verticalExtent / imageHeight; }
+
+    Vector3 GetForward() const { return -m_w; }
+    
+    // Uniform point on the lens, the origin of a thin lens ray.
+    Vector3 SampleLensPoint() const
+    {
+        if (!HasLens())
+        {
+            return m_origin;
+        }
+        Vector3 randomPointInDisk = m_lensRadius * Vector3::RandomInUnitDisk();
+        return m_origin + m_u * randomPointInDisk.X() + m_v * randomPointInDisk.Y();
+    }
+    
+    // Image coordinates, as passed to GetRay, of the ray from lensPoint
+    // through point. False when it misses the image.
+    bool Project(const Vector3& point, const Vector3& lensPoint, double& u_out, double& v_out) const
+    {
+        Vector3 direction = point - lensPoint;
+        double along = dot(direction, -m_w);
+        if (along <= 0)
+        {
+            return false;
+        }
+        
+        Vector3 focusPoint = lensPoint + direction * (m_focusDistance / along) - m_lowerLeftCorner;
+        u_out = dot(focusPoint, m_horizontal) / m_horizontal.SquaredLength();
+        v_out = dot(focusPoint, m_vertical) / m_vertical.SquaredLength();
+        return u_out >= 0 && u_out < 1 && v_out >= 0 && v_out < 1;
+    }
+    
+    // Solid angle density of the direction of a ray leaving lensPoint when
+    // (u, v) is uniform over the image: 1 / (A cos^3), with A the image area
+    // at unit distance.
+    double GetDirectionPdf(const Vector3& lensPoint, const Vector3& direction) const
+    {
+        double u, v;
+        if (!Project(lensPoint + direction, lensPoint, u, v))
+        {
+            return 0.0;
+        }
+        double cosine = dot(unit_vector(direction), -m_w);
+        double area = m_horizontal.Length() * m_vertical.Length() / (m_focusDistance * m_focusDistance);
+        return 1 / (area * cosine * cosine * cosine);
     }
 
 private:
         double m_lensRadius;
+        double m_focusDistance;
+        double m_verticalExtent;
         Vector3 m_origin;
         Vector3 m_lowerLeftCorner;
         Vector3 m_horizontal;
@@ -66,4 +141,21 @@ private:
         Vector3 m_v;
         Vector3 m_w;
 };
+
+// Plain description of a camera that can be edited at runtime and turned
+// into a Camera once the image aspect ratio is known.
+struct CameraSettings
+{
+    Vector3 m_lookFrom = Vector3(13, 2, 3);
+    Vector3 m_lookAt = Vector3(0, 0, 0);
+    Vector3 m_vup = Vector3(0, 1, 0);
+    double m_vfov = 20;
+    double m_aperture = 0.1;
+    double m_focusDistance = 10.0;
+    
+    Camera Build(double aspect) const
+    {
+        return Camera(m_lookFrom, m_lookAt, m_vup, m_vfov, aspect, m_aperture, m_focusDistance);
+    }
+};
 #endif
@@ -0,0 +1,79 @@
+//
+//  AABB.h
+//  Raytracing
+//
+//  Axis-aligned bounding box with a slab test returning the entry distance.
+//
+
+#ifndef AABB_h
+#define AABB_h
+
+#include "Ray.h"
+#include "Utils.h"
+
+class AABB
+{
+public:
+    AABB() : m_min(s_kInfinity, s_kInfinity, s_kInfinity), m_max(-s_kInfinity, -s_kInfinity, -s_kInfinity) {}
+    AABB(const Vector3& minimum, const Vector3& maximum) : m_min(minimum), m_max(maximum) {}
+    
+    static AABB FromSphere(const Vector3& center, float radius)
+    {
+        float r = fabs(radius);
+        return AABB(center - Vector3(r, r, r), center + Vector3(r, r, r));
+    }
+    
+    const Vector3& Min() const { return m_min; }
+    const Vector3& Max() const { return m_max; }
+    Vector3 Center() const { return 0.5f * (m_min + m_max); }
+    Vector3 Extent() const { return m_max - m_min; }
+    
+    void Grow(const AABB& other)
+    {
+        m_min = Vector3(ffmin(m_min.X(), other.m_min.X()), ffmin(m_min.Y(), other.m_min.Y()), ffmin(m_min.Z(), other.m_min.Z()));
+        m_max = Vector3(ffmax(m_max.X(), other.m_max.X()), ffmax(m_max.Y(), other.m_max.Y()), ffmax(m_max.Z(), other.m_max.Z()));
+    }
+    
+    int LongestAxis() const
+    {
+        Vector3 extent = Extent();
+        if (extent.X() > extent.Y() && extent.X() > extent.Z()) return 0;
+        return extent.Y() > extent.Z() ? 1 : 2;
+    }
+    
+    // Slab test against precomputed reciprocal directions. On a hit t_entry
+    // is the distance where the ray enters the box, clamped to t_min.
+    bool Hit(const Vector3& origin, const Vector3& invDirection, float t_min, float t_max, float& t_entry) const
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float t0 = (m_min.m_value[axis] - origin.m_value[axis]) * invDirection.m_value[axis];
+            float t1 = (m_max.m_value[axis] - origin.m_value[axis]) * invDirection.m_value[axis];
+            if (invDirection.m_value[axis] < 0)
+            {
+                std::swap(t0, t1);
+            }
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+            {
+                return false;
+            }
+        }
+        t_entry = t_min;
+        return true;
+    }
+    
+    bool Hit(const Ray& r, float t_min, float t_max, float& t_entry) const
+    {
+        Vector3 direction = r.GetDirection();
+        Vector3 invDirection(1.0f / direction.X(), 1.0f / direction.Y(), 1.0f / direction.Z());
+        return Hit(r.GetOrigin(), invDirection, t_min, t_max, t_entry);
+    }
+    
+private:
+    Vector3 m_min;
+    Vector3 m_max;
+};
+
+#endif /* AABB_h */
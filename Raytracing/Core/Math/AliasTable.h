@@ -0,0 +1,107 @@
+//
+//  AliasTable.h
+//  Raytracing
+//
+//  Walker's alias method, built with Vose's algorithm: a discrete
+//  distribution over n outcomes sampled in constant time from a single
+//  uniform number, whatever the shape of the weights.
+//
+
+#ifndef AliasTable_h
+#define AliasTable_h
+
+#include <algorithm>
+#include <vector>
+
+class AliasTable
+{
+public:
+    // Weights must be non-negative; a table whose weights sum to zero stays
+    // empty and never samples.
+    void Build(const std::vector<float>& weights)
+    {
+        const int count = int(weights.size());
+        double total = 0;
+        for (float weight : weights)
+        {
+            total += weight;
+        }
+        
+        m_bins.assign(total > 0 ? count : 0, Bin{ 1.0f, 0, 0.0f });
+        if (total <= 0)
+        {
+            return;
+        }
+        
+        // Scaled so the average bin holds exactly 1. Bins below 1 are topped
+        // up from bins above it, each donation filling one bin completely.
+        std::vector<double> scaled(count);
+        std::vector<int> small, large;
+        for (int i = 0; i < count; ++i)
+        {
+            m_bins[i].m_pmf = float(weights[i] / total);
+            scaled[i] = weights[i] / total * count;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        
+        while (!small.empty() && !large.empty())
+        {
+            int below = small.back();
+            small.pop_back();
+            int above = large.back();
+            m_bins[below].m_probability = float(scaled[below]);
+            m_bins[below].m_alias = above;
+            scaled[above] -= 1 - scaled[below];
+            if (scaled[above] < 1)
+            {
+                large.pop_back();
+                small.push_back(above);
+            }
+        }
+        
+        // Whatever is left is 1 up to rounding.
+        for (int i : small)
+        {
+            m_bins[i].m_probability = 1.0f;
+        }
+        for (int i : large)
+        {
+            m_bins[i].m_probability = 1.0f;
+        }
+    }
+    
+    bool IsEmpty() const { return m_bins.empty(); }
+    int Size() const { return int(m_bins.size()); }
+    double Pmf(int index) const { return m_bins[index].m_pmf; }
+    
+    // Outcome for u in [0, 1). The fraction of u left after picking a bin
+    // decides between the bin and its alias, and is returned in
+    // remainder_out, again uniform in [0, 1), for further sampling.
+    int Sample(double u, double& remainder_out) const
+    {
+        const int count = int(m_bins.size());
+        double scaled = u * count;
+        int bin = std::min(int(scaled), count - 1);
+        double fraction = std::min(scaled - bin, 0.99999999);
+        const Bin& entry = m_bins[bin];
+        if (fraction < entry.m_probability)
+        {
+            remainder_out = fraction / entry.m_probability;
+            return bin;
+        }
+        remainder_out = std::min((fraction - entry.m_probability) / (1 - entry.m_probability), 0.99999999);
+        return entry.m_alias;
+    }
+
+private:
+    struct Bin
+    {
+        float   m_probability;  // of keeping the bin rather than taking its alias
+        int     m_alias;
+        float   m_pmf;
+    };
+    
+    std::vector<Bin> m_bins;
+};
+
+#endif /* AliasTable_h */
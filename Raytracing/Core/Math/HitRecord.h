@@ -5,6 +5,7 @@
 #include "Vector.h"
 
 class Material;
+class Hittable;
 
 struct HitRecord
 {
@@ -12,14 +13,34 @@ struct HitRecord
     float    m_t;
     Vector3  m_point;
     Vector3  m_normal;
+    Vector3  m_surfacePoint;   // unit position on the hit sphere, see GetUV()
+    float    m_footprint;      // world-space width of the ray cone at the hit
+    float    m_uvFootprint;    // the same width in texture space
     
-    shared_ptr<Material> m_material;
+    // Non-owning, the hit object keeps the material alive. Avoids refcount
+    // traffic every time a record is copied.
+    const Material* m_material;
+    
+    // The primitive that was hit, when known. Lets emitters be matched to
+    // their entry in the light tree.
+    const Hittable* m_object;
     
     inline void SetFaceNormal(const Ray& r, const Vector3& outward_normal)
     {
         m_frontFace = dot(r.GetDirection(), outward_normal) < 0;
         m_normal = m_frontFace ? outward_normal : -outward_normal;
     }
+    
+    // Longitude/latitude mapping, v = 0 at the bottom pole. Only textured
+    // materials need it, so it is worked out on request rather than for
+    // every hit.
+    inline void GetUV(float& u_out, float& v_out) const
+    {
+        double theta = acos(Clamp(-m_surfacePoint.Y(), -1, 1));
+        double phi = atan2(-m_surfacePoint.Z(), m_surfacePoint.X()) + s_kPI;
+        u_out = phi / (2 * s_kPI);
+        v_out = theta / s_kPI;
+    }
 };
 
 #endif
\ No newline at end of file
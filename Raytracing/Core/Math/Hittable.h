@@ -12,12 +12,55 @@
 #include "Utils.h"
 #include "Ray.h"
 #include "HitRecord.h"
+#include "RayPacket.h"
+#include "AABB.h"
 
 
 class Hittable
 {
     public:
     virtual bool hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const = 0;
+    
+    // Any-hit query for shadow and visibility rays. Returns on the first
+    // intersection inside (t_min, t_max) and never builds a HitRecord.
+    virtual bool occluded(const Ray& r, float t_min, float t_max) const = 0;
+    
+    // World-space bounds, or false for shapes that cannot be bounded.
+    virtual bool boundingBox(AABB& box_out) const { return false; }
+    
+    // Closest-hit query for a packet of rays. Narrows hits.m_t and records the
+    // hit object per lane; callers rebuild the HitRecord with hit() on that
+    // object. When a frustum is given every lane lies inside it and objects
+    // outside it may skip the whole packet.
+    virtual void hitPacket(const RayPacket& packet, const Frustum* frustum, float t_min, PacketHits& hits) const
+    {
+        HitRecord rec;
+        for (int k = 0; k < packet.m_count; ++k)
+        {
+            if (hit(packet.Get(k), t_min, hits.m_t[k], rec))
+            {
+                hits.m_t[k] = rec.m_t;
+                hits.m_object[k] = this;
+            }
+        }
+    }
+    
+    // Closest-hit query for a batch of independent rays, such as one bounce
+    // of many paths. Narrows t[k] and records the hit object per ray like
+    // hitPacket(). Accelerators override it to overlap the memory accesses
+    // of different rays.
+    virtual void hitBatch(const Ray* rays, int count, float t_min, float* t, const Hittable** objects) const
+    {
+        HitRecord rec;
+        for (int k = 0; k < count; ++k)
+        {
+            if (hit(rays[k], t_min, t[k], rec))
+            {
+                t[k] = rec.m_t;
+                objects[k] = this;
+            }
+        }
+    }
 };
 
 #endif /* Hittable_h */
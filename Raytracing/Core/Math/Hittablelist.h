@@ -10,27 +10,47 @@
 #define Hittablelist_h
 
 #include "Hittable.h"
+#include "../../System/Arena.h"
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 class HittableList : public Hittable
 {
 public:
-    HittableList() {}
-    HittableList(shared_ptr<Hittable> object) { AddHittable(object); }
+    HittableList() :
+    m_geometryArena(make_shared<MemoryArena>()), m_materialArena(make_shared<MemoryArena>()) {}
+    HittableList(shared_ptr<Hittable> object) : HittableList() { AddHittable(object); }
+    
+    // Allocates a scene object from the list's arenas instead of the heap.
+    // Geometry and materials use separate arenas so traversal walks densely
+    // packed shapes. Objects must not outlive every copy of this list.
+    template<typename T, typename... Args>
+    shared_ptr<T> Create(Args&&... args)
+    {
+        MemoryArena& arena = std::is_base_of<Hittable, T>::value ? *m_geometryArena : *m_materialArena;
+        return MakeShared<T>(arena, std::forward<Args>(args)...);
+    }
     
     void ClearList() { m_hittableObjectList.clear(); }
+    size_t Size() const { return m_hittableObjectList.size(); }
+    const std::vector<shared_ptr<Hittable>>& GetObjects() const { return m_hittableObjectList; }
     void AddHittable(shared_ptr<Hittable> object)
     { m_hittableObjectList.push_back(object); }
     
     virtual bool hit(const Ray& r, float tmin, float tmax, HitRecord& rec) const;
+    virtual bool occluded(const Ray& r, float tmin, float tmax) const;
+    virtual void hitPacket(const RayPacket& packet, const Frustum* frustum, float t_min, PacketHits& hits) const;
     
 private:
+    // Declared first so they are released after the objects they hold.
+    shared_ptr<MemoryArena> m_geometryArena;
+    shared_ptr<MemoryArena> m_materialArena;
     std::vector<shared_ptr<Hittable>> m_hittableObjectList;
         
 };
 
-bool HittableList::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+inline bool HittableList::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
 {
     HitRecord hitRec;
     bool bHitAnything = false;
@@ -47,4 +67,24 @@ bool HittableList::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) c
     return bHitAnything;
 }
 
+inline bool HittableList::occluded(const Ray& r, float t_min, float t_max) const
+{
+    for (auto itr = m_hittableObjectList.begin(); itr != m_hittableObjectList.end(); ++itr)
+    {
+        if ((*itr)->occluded(r, t_min, t_max))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void HittableList::hitPacket(const RayPacket& packet, const Frustum* frustum, float t_min, PacketHits& hits) const
+{
+    for (auto itr = m_hittableObjectList.begin(); itr != m_hittableObjectList.end(); ++itr)
+    {
+        (*itr)->hitPacket(packet, frustum, t_min, hits);
+    }
+}
+
 #endif /* Hittablelist_h */
@@ -20,7 +20,7 @@ bool Lambertian::Scatter(const Ray& r_in, const HitRecord& rec, Vector3& attenua
 bool Metal::Scatter(const Ray& r_in, const HitRecord& rec, Vector3& attenuation, Ray& scattered_out) const
 {
     Vector3 reflected = Vector3::Reflect(unit_vector(r_in.GetDirection()), rec.m_normal);
-    scattered_out = Ray(rec.m_point, reflected + m_fuzz * Vector3::RandomInUnitSphere());
+    scattered_out = Ray(rec.m_point, reflected + m_fuzz * Vector3::RandomOnUnitSphere());
     attenuation = m_albedo;
     return (dot(scattered_out.GetDirection(), rec.m_normal) > 0);
 }
@@ -12,12 +12,70 @@
 #include "HitRecord.h"
 #include "Vector.h"
 #include "Ray.h"
+#include "ONB.h"
+#include "../Texture/Texture.h"
+
+// Result of sampling a BSDF. For smooth (delta) lobes m_pdf is 0 and m_value
+// already holds the path weight, otherwise m_value is the BSDF value f and
+// m_pdf the solid-angle density of m_direction.
+struct BSDFSample
+{
+    Vector3 m_direction;
+    Vector3 m_value;
+    double  m_pdf;
+    bool    m_isSpecular;
+};
 
 class Material
 {
 public:
     
-    virtual bool Scatter(const Ray& ray_in, const HitRecord& hitRec, Vector3& attenuation, Ray& scatteredRay_out) const = 0;
+    // Draws an outgoing direction for the incoming ray.
+    virtual bool Sample(const Ray& ray_in, const HitRecord& hitRec, BSDFSample& sample_out) const = 0;
+    
+    // BSDF value and pdf for a given outgoing direction. Delta lobes return zero.
+    virtual Vector3 Evaluate(const Ray& ray_in, const HitRecord& hitRec, const Vector3& direction) const
+    { return Vector3::GetZero(); }
+    virtual double Pdf(const Ray& ray_in, const HitRecord& hitRec, const Vector3& direction) const
+    { return 0.0; }
+    
+    // Radiance emitted from the hit point back along the incoming ray.
+    virtual Vector3 Emitted(const HitRecord& hitRec) const { return Vector3::GetZero(); }
+    
+    // True when every sample is a delta lobe, so Evaluate and Pdf are zero
+    // and other sampling strategies cannot be mixed in.
+    virtual bool IsSpecular() const { return false; }
+    
+    // Importance-sampled scatter: attenuation is f * cos / pdf for the sampled direction.
+    bool Scatter(const Ray& ray_in, const HitRecord& hitRec, Vector3& attenuation, Ray& scatteredRay_out) const
+    {
+        BSDFSample sample;
+        attenuation = Vector3::GetZero();
+        if (!Sample(ray_in, hitRec, sample))
+        {
+            return false;
+        }
+        
+        // Mirror-like bounces keep the incoming cone spread, rough ones blur
+        // later texture lookups.
+        scatteredRay_out = Ray(hitRec.m_point, sample.m_direction);
+        scatteredRay_out.SetCone(hitRec.m_footprint, sample.m_isSpecular ? ray_in.GetConeSpread() : s_kRoughConeSpread);
+        if (sample.m_isSpecular)
+        {
+            attenuation = sample.m_value;
+            return true;
+        }
+        
+        double cosine = fabs(dot(sample.m_direction, hitRec.m_normal));
+        if (sample.m_pdf <= 0 || cosine <= 0)
+        {
+            return false;
+        }
+        attenuation = sample.m_value * (cosine / sample.m_pdf);
+        return true;
+    }
+    
+    static constexpr float s_kRoughConeSpread = 0.1f;
     
     inline const double SchlickApproximation(double cosine, double ref_idx) const
     {
@@ -28,85 +86,237 @@ public:
 };
 
 class Lambertian : public Material {
-    public:
-        Lambertian(const Vector3& a) : m_albedo(a) {}
-
-        virtual bool Scatter
-        (
-            const Ray& r_in, const HitRecord& rec, Vector3& attenuation, Ray& scattered_out
-         ) const {
-    Vector3 scatter_direction = rec.m_normal + Vector3::GetRandomUnitVector();
-    scattered_out = Ray(rec.m_point, scatter_direction);
-    attenuation = m_albedo;
-    return true;
-}
-
-
-    private:
-        Vector3 m_albedo;
-};
-
-class Metal : public Material
-{
 public:
-    Metal(const Vector3& a, double fuzz) : m_albedo(a), m_fuzz(fuzz) {}
+    Lambertian(const Vector3& a) : m_albedo(a) {}
+    Lambertian(shared_ptr<Texture> texture) : m_albedo(1, 1, 1), m_texture(texture) {}
+    
+    virtual bool Sample(const Ray& r_in, const HitRecord& rec, BSDFSample& sample_out) const
+    {
+        ONB uvw(rec.m_normal);
+        sample_out.m_direction = uvw.Local(Vector3::RandomCosineDirection());
+        sample_out.m_value = Albedo(rec) / s_kPI;
+        sample_out.m_pdf = dot(sample_out.m_direction, uvw.W()) / s_kPI;
+        sample_out.m_isSpecular = false;
+        return sample_out.m_pdf > 0;
+    }
+    
+    virtual Vector3 Evaluate(const Ray& r_in, const HitRecord& rec, const Vector3& direction) const
+    {
+        return dot(direction, rec.m_normal) > 0 ? Albedo(rec) / s_kPI : Vector3::GetZero();
+    }
+    
+    virtual double Pdf(const Ray& r_in, const HitRecord& rec, const Vector3& direction) const
+    {
+        double cosine = dot(unit_vector(direction), rec.m_normal);
+        return cosine > 0 ? cosine / s_kPI : 0.0;
+    }
 
-    virtual bool Scatter(const Ray& r_in, const HitRecord& rec, Vector3& attenuation, Ray& scattered_out) const {
-    Vector3 reflected = Vector3::Reflect(unit_vector(r_in.GetDirection()), rec.m_normal);
-    scattered_out = Ray(rec.m_point, reflected + m_fuzz * Vector3::RandomInUnitSphere());
-    attenuation = m_albedo;
-    return (dot(scattered_out.GetDirection(), rec.m_normal) > 0);
-}
-        
 private:
+    Vector3 Albedo(const HitRecord& rec) const
+    {
+        if (!m_texture)
+        {
+            return m_albedo;
+        }
+        
+        float u, v;
+        rec.GetUV(u, v);
+        return m_albedo * m_texture->Value(u, v, rec.m_uvFootprint);
+    }
+    
     Vector3 m_albedo;
-    double m_fuzz;
+    shared_ptr<Texture> m_texture;
 };
 
-class Dielectric : public Material
+// Conductor with a GGX microfacet lobe. The fuzz factor is used as the GGX
+// roughness; a fuzz of zero is a perfect mirror.
+class Metal : public Material
 {
 public:
-    Dielectric(double ri) : m_refractiveIndex(ri) {}
-
-    virtual bool Scatter(const Ray& r_in, const HitRecord& rec, Vector3& attenuation,  Ray& scattered) const{
-    attenuation = Vector3(1.0, 1.0, 1.0);
-    double etai_over_etat;
-    if (rec.m_frontFace)
+    Metal(const Vector3& a, double fuzz) : m_albedo(a), m_fuzz(fuzz < 1 ? fuzz : 1) {}
+    Metal(shared_ptr<Texture> texture, double fuzz) : m_albedo(1, 1, 1), m_texture(texture), m_fuzz(fuzz < 1 ? fuzz : 1) {}
+    
+    virtual bool Sample(const Ray& r_in, const HitRecord& rec, BSDFSample& sample_out) const
     {
-        etai_over_etat = 1.0 / m_refractiveIndex;
+        Vector3 unit_direction = unit_vector(r_in.GetDirection());
+        if (m_fuzz <= 0)
+        {
+            sample_out.m_direction = Vector3::Reflect(unit_direction, rec.m_normal);
+            sample_out.m_value = Albedo(rec);
+            sample_out.m_pdf = 0;
+            sample_out.m_isSpecular = true;
+            return true;
+        }
+        
+        // Sample a microfacet normal proportional to D(h) * cos(theta_h).
+        double alpha = Alpha();
+        double r1 = RandomDouble();
+        double r2 = RandomDouble();
+        double tan2Theta = alpha * alpha * r1 / (1 - r1);
+        double cosTheta = 1 / sqrt(1 + tan2Theta);
+        double sinTheta = sqrt(ffmax(0, 1 - cosTheta * cosTheta));
+        double phi = 2 * s_kPI * r2;
+        ONB uvw(rec.m_normal);
+        Vector3 h = uvw.Local(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+        
+        sample_out.m_direction = Vector3::Reflect(unit_direction, h);
+        sample_out.m_isSpecular = false;
+        if (dot(sample_out.m_direction, rec.m_normal) <= 0)
+        {
+            return false;
+        }
+        sample_out.m_value = Evaluate(r_in, rec, sample_out.m_direction);
+        sample_out.m_pdf = Pdf(r_in, rec, sample_out.m_direction);
+        return sample_out.m_pdf > 0;
+    }
+    
+    virtual Vector3 Evaluate(const Ray& r_in, const HitRecord& rec, const Vector3& direction) const
+    {
+        if (m_fuzz <= 0)
+        {
+            return Vector3::GetZero();
+        }
+        
+        Vector3 v = -unit_vector(r_in.GetDirection());
+        Vector3 l = unit_vector(direction);
+        double nDotV = dot(rec.m_normal, v);
+        double nDotL = dot(rec.m_normal, l);
+        if (nDotV <= 0 || nDotL <= 0)
+        {
+            return Vector3::GetZero();
+        }
+        
+        Vector3 h = unit_vector(v + l);
+        double vDotH = dot(v, h);
+        
+        // Schlick Fresnel with the albedo as the reflectance at normal incidence.
+        double fresnelWeight = pow(1 - ffmax(0, vDotH), 5);
+        Vector3 albedo = Albedo(rec);
+        Vector3 fresnel = albedo + (Vector3(1, 1, 1) - albedo) * fresnelWeight;
+        double g = SmithG1(nDotV) * SmithG1(nDotL);
+        return fresnel * (D(dot(rec.m_normal, h)) * g / (4 * nDotV * nDotL));
+    }
+    
+    virtual double Pdf(const Ray& r_in, const HitRecord& rec, const Vector3& direction) const
+    {
+        if (m_fuzz <= 0)
+        {
+            return 0.0;
+        }
+        
+        Vector3 v = -unit_vector(r_in.GetDirection());
+        Vector3 l = unit_vector(direction);
+        if (dot(rec.m_normal, l) <= 0)
+        {
+            return 0.0;
+        }
+        Vector3 h = unit_vector(v + l);
+        double vDotH = fabs(dot(v, h));
+        double nDotH = dot(rec.m_normal, h);
+        return vDotH > 0 ? D(nDotH) * nDotH / (4 * vDotH) : 0.0;
     }
-    else
+    
+    virtual bool IsSpecular() const { return m_fuzz <= 0; }
+        
+private:
+    Vector3 Albedo(const HitRecord& rec) const
     {
-        etai_over_etat = m_refractiveIndex;
+        if (!m_texture)
+        {
+            return m_albedo;
+        }
+        
+        float u, v;
+        rec.GetUV(u, v);
+        return m_albedo * m_texture->Value(u, v, rec.m_uvFootprint);
     }
     
-    Vector3 unit_direction = unit_vector(r_in.GetDirection());
+    double Alpha() const { return ffmax(m_fuzz, 1e-3); }
     
-    double cos_theta = ffmin(dot(-unit_direction, rec.m_normal), 1.0);
-    double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
-    if (etai_over_etat * sin_theta > 1.0 )
+    // GGX normal distribution.
+    double D(double nDotH) const
     {
-        Vector3 reflected = Vector3::Reflect(unit_direction, rec.m_normal);
-        scattered = Ray(rec.m_point, reflected);
-        return true;
+        if (nDotH <= 0)
+        {
+            return 0.0;
+        }
+        double alpha2 = Alpha() * Alpha();
+        double denom = nDotH * nDotH * (alpha2 - 1) + 1;
+        return alpha2 / (s_kPI * denom * denom);
     }
     
-    double reflect_prob = SchlickApproximation(cos_theta, etai_over_etat);
-    if (RandomDouble() < reflect_prob)
+    // Smith masking term for one direction.
+    double SmithG1(double nDotW) const
     {
-        Vector3 reflected = Vector3::Reflect(unit_direction, rec.m_normal);
-        scattered = Ray(rec.m_point, reflected);
-        return true;
+        double cos2 = nDotW * nDotW;
+        double tan2 = (1 - cos2) / cos2;
+        return 2 / (1 + sqrt(1 + Alpha() * Alpha() * tan2));
     }
     
-    Vector3 refracted = Vector3::Refract(unit_direction, rec.m_normal, etai_over_etat);
-    scattered = Ray(rec.m_point, refracted);
-    return true;
-}
+    Vector3 m_albedo;
+    shared_ptr<Texture> m_texture;
+    double m_fuzz;
+};
+
+class Dielectric : public Material
+{
+public:
+    Dielectric(double ri) : m_refractiveIndex(ri) {}
+    
+    virtual bool IsSpecular() const { return true; }
+
+    virtual bool Sample(const Ray& r_in, const HitRecord& rec, BSDFSample& sample_out) const
+    {
+        sample_out.m_value = Vector3(1.0, 1.0, 1.0);
+        sample_out.m_pdf = 0;
+        sample_out.m_isSpecular = true;
+        double etai_over_etat;
+        if (rec.m_frontFace)
+        {
+            etai_over_etat = 1.0 / m_refractiveIndex;
+        }
+        else
+        {
+            etai_over_etat = m_refractiveIndex;
+        }
+        
+        Vector3 unit_direction = unit_vector(r_in.GetDirection());
+        
+        double cos_theta = ffmin(dot(-unit_direction, rec.m_normal), 1.0);
+        double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+        if (etai_over_etat * sin_theta > 1.0 )
+        {
+            sample_out.m_direction = Vector3::Reflect(unit_direction, rec.m_normal);
+            return true;
+        }
+        
+        double reflect_prob = SchlickApproximation(cos_theta, etai_over_etat);
+        if (RandomDouble() < reflect_prob)
+        {
+            sample_out.m_direction = Vector3::Reflect(unit_direction, rec.m_normal);
+            return true;
+        }
+        
+        sample_out.m_direction = Vector3::Refract(unit_direction, rec.m_normal, etai_over_etat);
+        return true;
+    }
 
 private:
-        double m_refractiveIndex;
+    double m_refractiveIndex;
 };
 
+// Emits a constant radiance from the front face and reflects nothing.
+class DiffuseLight : public Material
+{
+public:
+    DiffuseLight(const Vector3& radiance) : m_radiance(radiance) {}
+    
+    virtual bool Sample(const Ray& r_in, const HitRecord& rec, BSDFSample& sample_out) const { return false; }
+    virtual Vector3 Emitted(const HitRecord& rec) const { return rec.m_frontFace ? m_radiance : Vector3::GetZero(); }
+    const Vector3& GetRadiance() const { return m_radiance; }
+    
+private:
+    Vector3 m_radiance;
+};
 
 #endif /* Material_h */
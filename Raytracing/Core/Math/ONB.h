@@ -0,0 +1,41 @@
+//
+//  ONB.h
+//  Raytracing
+//
+//  Orthonormal basis used to move sampled directions from a local frame
+//  (+Z along the normal) into world space.
+//
+
+#ifndef ONB_h
+#define ONB_h
+
+#include "Vector.h"
+
+class ONB
+{
+public:
+    ONB() {}
+    ONB(const Vector3& normal) { BuildFromW(normal); }
+    
+    void BuildFromW(const Vector3& normal)
+    {
+        m_w = unit_vector(normal);
+        Vector3 a = (fabs(m_w.X()) > 0.9f) ? Vector3(0, 1, 0) : Vector3(1, 0, 0);
+        m_v = unit_vector(cross(m_w, a));
+        m_u = cross(m_w, m_v);
+    }
+    
+    Vector3 Local(double a, double b, double c) const { return a * m_u + b * m_v + c * m_w; }
+    Vector3 Local(const Vector3& a) const { return Local(a.X(), a.Y(), a.Z()); }
+    
+    const Vector3& U() const { return m_u; }
+    const Vector3& V() const { return m_v; }
+    const Vector3& W() const { return m_w; }
+    
+private:
+    Vector3 m_u;
+    Vector3 m_v;
+    Vector3 m_w;
+};
+
+#endif /* ONB_h */
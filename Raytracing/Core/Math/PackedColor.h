@@ -0,0 +1,203 @@
+//
+//  PackedColor.h
+//  Raytracing
+//
+//  Compact encodings of linear colors for large buffers: IEEE half floats
+//  (three per color, 6 bytes) and the shared exponent RGB9E5 format (one 32
+//  bit word, three 9 bit mantissas under a common 5 bit exponent). Colors
+//  can carry s_kColorExtensionBits more mantissa bits per channel in a 16
+//  bit word of their own. All saturate instead of overflowing to infinity.
+//
+
+#ifndef PackedColor_h
+#define PackedColor_h
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "Vector.h"
+
+struct HalfColor
+{
+    uint16_t m_rgb[3];
+};
+
+// 11 significant bits, range up to 65504.
+inline uint16_t FloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+    const uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude > 0x7f800000)
+    {
+        return sign | 0x7e00;       // NaN stays NaN
+    }
+    if (magnitude >= 0x477fe000)
+    {
+        return sign | 0x7bff;       // 65504, the largest finite half
+    }
+    if (magnitude < 0x38800000)
+    {
+        // Below 2^-14 halves are denormal, a plain multiple of 2^-24.
+        return sign | uint16_t(lrintf(fabsf(value) * 16777216.0f));
+    }
+    
+    // Rebias the exponent and round the dropped 13 mantissa bits to nearest
+    // even; a carry correctly moves into the exponent.
+    const uint32_t rounded = magnitude + 0xfff + ((magnitude >> 13) & 1) - 0x38000000;
+    return sign | uint16_t(rounded >> 13);
+}
+
+inline float HalfToFloat(uint16_t half)
+{
+    const uint32_t sign = uint32_t(half & 0x8000) << 16;
+    const uint32_t exponent = (half >> 10) & 0x1f;
+    const uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0)
+    {
+        const float denormal = mantissa / 16777216.0f;
+        return sign ? -denormal : denormal;
+    }
+    
+    uint32_t bits = sign | (mantissa << 13);
+    bits |= exponent == 0x1f ? 0x7f800000 : (exponent + 112) << 23;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// floor(value + dither) for value >= 0 and dither in [0, 1). Adding them in
+// float would round up for dithers within an ulp of 1, which near 2^16 is
+// one in a few hundred, and bias values packed again after every update.
+inline uint32_t FloorDithered(float value, float dither)
+{
+    const float whole = floorf(value);
+    return uint32_t(whole) + (dither < value - whole ? 1 : 0);
+}
+
+// Half float of |value| with kExtraBits further mantissa bits in extra_out,
+// rounded down after adding dither in [0, 1) to the value in units of the
+// last extra bit: 0.5 rounds to nearest, uniform random dithers round
+// without bias, so that a value packed again after every small update does
+// not drift. Saturates at 65504 with every extra bit set; NaN becomes 0.
+template<int kExtraBits>
+inline uint16_t FloatToHalf(float value, float dither, uint32_t& extra_out)
+{
+    const float kMax = 65504.0f + ldexpf(float((1 << kExtraBits) - 1), 5 - kExtraBits);
+    const float magnitude = fabsf(value) > 0 ? std::min(fabsf(value), kMax) : 0.0f;
+    
+    // Halves are 2^-24 apart below 2^-14 and 2^(e - 11) apart in
+    // [2^(e - 1), 2^e). A carry into the next power of two leaves the extra
+    // bits zero, which decodes the same, except at the top of the range.
+    int exponent;
+    frexpf(magnitude, &exponent);
+    const float step = ldexpf(1.0f, std::max(exponent, -13) - 11 - kExtraBits);
+    uint32_t steps = FloorDithered(magnitude / step, dither);
+    if (exponent > 15)
+    {
+        steps = std::min(steps, (2048u << kExtraBits) - 1);
+    }
+    
+    extra_out = steps & ((1u << kExtraBits) - 1);
+    const uint16_t half = FloatToHalf(ldexpf(float(steps >> kExtraBits), kExtraBits) * step);
+    return value < 0 ? half | 0x8000 : half;
+}
+
+template<int kExtraBits>
+inline float HalfToFloat(uint16_t half, uint32_t extra)
+{
+    const int exponent = (half >> 10) & 0x1f;
+    const float step = ldexpf(1.0f, std::max(exponent, 1) - 25 - kExtraBits);
+    const float magnitude = HalfToFloat(uint16_t(half & 0x7fff)) + float(extra) * step;
+    return (half & 0x8000) ? -magnitude : magnitude;
+}
+
+// Mantissa bits a color keeps beyond its 6 or 4 byte encoding, per channel,
+// all three in one 16 bit word.
+const int s_kColorExtensionBits = 5;
+
+inline HalfColor PackHalf(const Vector3& color, const float dither[3], uint16_t& extension_out)
+{
+    const float rgb[3] = { color.X(), color.Y(), color.Z() };
+    HalfColor packed;
+    uint32_t extension = 0;
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        uint32_t extra;
+        packed.m_rgb[channel] = FloatToHalf<s_kColorExtensionBits>(rgb[channel], dither[channel], extra);
+        extension |= extra << (s_kColorExtensionBits * channel);
+    }
+    extension_out = uint16_t(extension);
+    return packed;
+}
+
+inline Vector3 UnpackHalf(const HalfColor& color, uint16_t extension)
+{
+    const uint32_t kMask = (1u << s_kColorExtensionBits) - 1;
+    return Vector3(HalfToFloat<s_kColorExtensionBits>(color.m_rgb[0], extension & kMask),
+                   HalfToFloat<s_kColorExtensionBits>(color.m_rgb[1], (extension >> s_kColorExtensionBits) & kMask),
+                   HalfToFloat<s_kColorExtensionBits>(color.m_rgb[2], (extension >> (2 * s_kColorExtensionBits)) & kMask));
+}
+
+// The 9 bit mantissas and their extensions form 14 bit mantissas under the
+// shared exponent, rounded as dithered like FloatToHalf(). Channels are
+// clamped to [0, 65532]; NaN becomes 0. Precision is relative to the
+// brightest channel, so a dim channel beside a bright one keeps fewer bits
+// than in half floats.
+inline uint32_t PackRGB9E5(const Vector3& color, const float dither[3], uint16_t& extension_out)
+{
+    const int kMantissaBits = 9 + s_kColorExtensionBits;
+    const uint32_t kMaxMantissa = (1u << kMantissaBits) - 1;
+    const int kBias = 15;
+    const int kMaxExponent = 31;
+    const float kMax = ldexpf(float(kMaxMantissa), kMaxExponent - kBias - kMantissaBits);
+    
+    float rgb[3] = { color.X(), color.Y(), color.Z() };
+    for (float& value : rgb)
+    {
+        value = value > 0 ? std::min(value, kMax) : 0.0f;
+    }
+    const float brightest = std::max(rgb[0], std::max(rgb[1], rgb[2]));
+    
+    // frexp gives brightest = f * 2^e with f in [0.5, 1), so e is one above
+    // floor(log2(brightest)). Where a dither could carry the brightest
+    // mantissa past the largest one the exponent goes up by one, except at
+    // the top of the range, where the mantissa saturates instead.
+    int exponent;
+    frexpf(brightest, &exponent);
+    exponent = std::max(exponent, -kBias) + kBias;
+    if (ldexpf(brightest, kMantissaBits - exponent + kBias) >= float(kMaxMantissa) && exponent < kMaxExponent)
+    {
+        ++exponent;
+    }
+    
+    uint32_t packed = uint32_t(exponent) << 27;
+    uint32_t extension = 0;
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const uint32_t mantissa = std::min(FloorDithered(ldexpf(rgb[channel], kMantissaBits - exponent + kBias), dither[channel]),
+                                           kMaxMantissa);
+        packed |= (mantissa >> s_kColorExtensionBits) << (9 * channel);
+        extension |= (mantissa & ((1u << s_kColorExtensionBits) - 1)) << (s_kColorExtensionBits * channel);
+    }
+    extension_out = uint16_t(extension);
+    return packed;
+}
+
+inline Vector3 UnpackRGB9E5(uint32_t packed, uint16_t extension)
+{
+    const uint32_t kMask = (1u << s_kColorExtensionBits) - 1;
+    const float scale = ldexpf(1.0f, int(packed >> 27) - 15 - 9 - s_kColorExtensionBits);
+    float rgb[3];
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const uint32_t mantissa = ((packed >> (9 * channel)) & 0x1ff) << s_kColorExtensionBits |
+                                  ((extension >> (s_kColorExtensionBits * channel)) & kMask);
+        rgb[channel] = float(mantissa) * scale;
+    }
+    return Vector3(rgb[0], rgb[1], rgb[2]);
+}
+
+#endif /* PackedColor_h */
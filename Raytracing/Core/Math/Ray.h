@@ -14,17 +14,25 @@
 class Ray
 {
 public:
-        Ray() {}
-        Ray(const Vector3& origin, const Vector3& direction) { m_origin = origin; m_direction = direction; }
+        Ray() : m_coneWidth(0), m_coneSpread(0) {}
+        Ray(const Vector3& origin, const Vector3& direction) :
+        m_coneWidth(0), m_coneSpread(0) { m_origin = origin; m_direction = direction; }
         Vector3 GetOrigin() const       { return m_origin; }
         Vector3 GetDirection() const    { return m_direction; }
         Vector3 PointAtParameter(float t) const { return m_origin + t * m_direction; }
         
-        
+        // Ray cone used to estimate the footprint of a hit for texture
+        // filtering: width at the origin and growth per unit distance.
+        void SetCone(float width, float spread) { m_coneWidth = width; m_coneSpread = spread; }
+        float GetConeWidth() const      { return m_coneWidth; }
+        float GetConeSpread() const     { return m_coneSpread; }
+        float GetFootprint(float t) const { return m_coneWidth + m_coneSpread * t * m_direction.Length(); }
 
 private:
         Vector3 m_origin;
         Vector3 m_direction;
+        float   m_coneWidth;
+        float   m_coneSpread;
 };
 
 #endif /* Ray_h */
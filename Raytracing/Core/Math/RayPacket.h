@@ -0,0 +1,130 @@
+//
+//  RayPacket.h
+//  Raytracing
+//
+//  Structure-of-arrays bundle of coherent rays (an 8x8 block of primary
+//  rays) and the frustum that bounds them, used to cull whole objects for
+//  the packet with a single test.
+//
+
+#ifndef RayPacket_h
+#define RayPacket_h
+
+#include "Ray.h"
+#include "Vector.h"
+
+class Hittable;
+
+static const int s_kPacketWidth = 8;
+static const int s_kPacketSize = s_kPacketWidth * s_kPacketWidth;
+
+struct RayPacket
+{
+    int     m_count;
+    float   m_originX[s_kPacketSize];
+    float   m_originY[s_kPacketSize];
+    float   m_originZ[s_kPacketSize];
+    float   m_directionX[s_kPacketSize];
+    float   m_directionY[s_kPacketSize];
+    float   m_directionZ[s_kPacketSize];
+    
+    void Set(int index, const Ray& r)
+    {
+        Vector3 origin = r.GetOrigin();
+        Vector3 direction = r.GetDirection();
+        m_originX[index] = origin.X();
+        m_originY[index] = origin.Y();
+        m_originZ[index] = origin.Z();
+        m_directionX[index] = direction.X();
+        m_directionY[index] = direction.Y();
+        m_directionZ[index] = direction.Z();
+    }
+    
+    Ray Get(int index) const
+    {
+        return Ray(Vector3(m_originX[index], m_originY[index], m_originZ[index]),
+                   Vector3(m_directionX[index], m_directionY[index], m_directionZ[index]));
+    }
+};
+
+// Closest hit per packet lane. m_object is null for rays that missed.
+struct PacketHits
+{
+    float           m_t[s_kPacketSize];
+    const Hittable* m_object[s_kPacketSize];
+    
+    void Reset(float t_max)
+    {
+        for (int k = 0; k < s_kPacketSize; ++k)
+        {
+            m_t[k] = t_max;
+            m_object[k] = nullptr;
+        }
+    }
+};
+
+// Four sides around the rays of a camera packet. Pinhole rays all start at
+// the apex and each side is one plane through it. Thin lens rays start
+// anywhere on a lens disk around the apex and converge on the focus plane;
+// the cross section of the packet at depth z along the view axis is the
+// pinhole one dilated by lensRadius * |1 - z / focusDistance|. Each side
+// therefore bounds the rays with two planes, one through the edge of the
+// lens on the same side (in front of the focus plane) and one through the
+// opposite edge (behind it), and an object is only outside that side when it
+// is outside both.
+class Frustum
+{
+public:
+    // Corner directions in counter-clockwise order seen from the apex,
+    // forward the view axis.
+    Frustum(const Vector3& apex, const Vector3 corners[4],
+            const Vector3& forward = Vector3(0, 0, -1), double lensRadius = 0, double focusDistance = 1)
+        : m_apex(apex)
+    {
+        Vector3 center = corners[0] + corners[1] + corners[2] + corners[3];
+        for (int p = 0; p < 4; ++p)
+        {
+            Vector3 normal = unit_vector(cross(corners[p], corners[(p + 1) % 4]));
+            if (dot(normal, center) > 0)
+            {
+                normal = -normal;
+            }
+            
+            // Distance the lens reaches out of the pinhole plane, and its
+            // change per unit of depth.
+            double reach = lensRadius * (normal - dot(normal, forward) * forward).Length();
+            Vector3 tilt = (reach / focusDistance) * forward;
+            SetPlane(2 * p, normal + tilt, reach);
+            SetPlane(2 * p + 1, normal - tilt, -reach);
+        }
+    }
+    
+    bool OverlapsSphere(const Vector3& center, float radius) const
+    {
+        Vector3 offset = center - m_apex;
+        for (int p = 0; p < 4; ++p)
+        {
+            if (dot(m_normals[2 * p], offset) - m_offsets[2 * p] > radius &&
+                dot(m_normals[2 * p + 1], offset) - m_offsets[2 * p + 1] > radius)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+private:
+    // Half-space dot(normal, x - apex) <= offset, stored normalized.
+    void SetPlane(int plane, const Vector3& normal, double offset)
+    {
+        double length = normal.Length();
+        m_normals[plane] = normal / length;
+        m_offsets[plane] = float(offset / length);
+    }
+    
+    Vector3 m_apex;
+    Vector3 m_normals[8];
+    float   m_offsets[8];
+};
+
+#endif /* RayPacket_h */
@@ -9,16 +9,32 @@
 #ifndef Utils_h
 #define Utils_h
 
+#include <atomic>
 #include <functional>
 #include <random>
+#include <memory>
+#include <limits>
+
+inline std::mt19937& GetRandomGenerator()
+{
+    // Each thread owns its generator so workers neither race on the state
+    // nor draw the same sequence. The main thread always gets seed 0.
+    static std::atomic<unsigned int> s_nextSeed(0);
+    static thread_local std::mt19937 generator(s_nextSeed.fetch_add(1) * 9781u);
+    return generator;
+}
 
 inline double RandomDouble()
 {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    static std::function<double()> rand_generator =
-        std::bind(distribution, generator);
-    return rand_generator();
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(GetRandomGenerator());
+}
+
+// Restarts the calling thread's sequence, e.g. so scenes built with
+// RandomDouble() on different threads come out identical.
+inline void SeedRandom(unsigned int seed)
+{
+    GetRandomGenerator().seed(seed);
 }
 
 inline double Clamp(double x, double min, double max)
@@ -28,9 +44,10 @@ inline double Clamp(double x, double min, double max)
     return x;
 }
 
+// Uniform in [min, max).
 inline double RandomDouble(double min, double max)
 {
-    return Clamp(RandomDouble(), min, max);
+    return min + (max - min) * RandomDouble();
 }
 
 // Usings
@@ -52,4 +69,13 @@ inline double DegreesToRadian(double degrees) {
 inline double ffmin(double a, double b) { return a <= b ? a : b; }
 inline double ffmax(double a, double b) { return a >= b ? a : b; }
 
+// Asks for the cache line holding address ahead of a read. Only a hint, so
+// compilers without the builtin simply drop it.
+inline void Prefetch(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address, 0, 3);
+#endif
+}
+
 #endif /* Utils_h */
@@ -49,10 +49,11 @@ public:
     inline static Vector3 GetRandomUnitVector();
     inline static Vector3 Reflect(const Vector3& vector_in, const Vector3& normal);
     inline static Vector3 GetZero();
-    inline static Vector3 RandomInUnitSphere();
+    inline static Vector3 RandomOnUnitSphere();
     inline static Vector3 RandomInHemiSphere(Vector3& normal);
     inline static Vector3 Refract(const Vector3& uv, const Vector3& n, double etai_over_etat);
     inline static Vector3 RandomInUnitDisk();
+    inline static Vector3 RandomCosineDirection();
     inline void WriteColor(std::string& out, int samplesPerPixel);
     
     float m_value[3];
@@ -182,6 +183,12 @@ inline Vector3 unit_vector(Vector3 v)
     return v / v.Length();
 }
 
+// Rec. 709 luminance of a linear color.
+inline float Luminance(const Vector3& color)
+{
+    return 0.2126f * color.R() + 0.7152f * color.G() + 0.0722f * color.B();
+}
+
 inline void Vector3::WriteColor(std::ostream &out, int samplesPerPixel) {
     // Divide the color total by the number of samples.
     auto scale = 1.0 / samplesPerPixel;
@@ -238,12 +245,11 @@ inline Vector3 Vector3::GetZero()
 
 inline Vector3 Vector3::GetRandomUnitVector()
 {
-    Vector3 newVector = Vector3::Random();
-    newVector.MakeUnitVector();
-    return newVector;
+    return RandomOnUnitSphere();
 }
 
-Vector3 Vector3::RandomInUnitSphere()
+// Uniformly distributed point on the surface of the unit sphere.
+inline Vector3 Vector3::RandomOnUnitSphere()
 {
     double angle = RandomDouble(0, 2 * s_kPI);
     double z = RandomDouble(-1, 1);
@@ -252,9 +258,9 @@ Vector3 Vector3::RandomInUnitSphere()
     return p;
 }
 
-Vector3 Vector3::RandomInHemiSphere(Vector3& normal)
+inline Vector3 Vector3::RandomInHemiSphere(Vector3& normal)
 {
-    Vector3 randomInHemiSphere = RandomInUnitSphere();
+    Vector3 randomInHemiSphere = RandomOnUnitSphere();
     if (dot(randomInHemiSphere, normal) > 0)
     {
         return randomInHemiSphere;
@@ -282,4 +288,14 @@ inline Vector3 Vector3::RandomInUnitDisk()
         return p;
     }
 }
+
+// Cosine-weighted direction around +Z, pdf = cos(theta) / PI.
+inline Vector3 Vector3::RandomCosineDirection()
+{
+    double r1 = RandomDouble();
+    double r2 = RandomDouble();
+    double phi = 2 * s_kPI * r1;
+    double r = sqrt(r2);
+    return Vector3(cos(phi) * r, sin(phi) * r, sqrt(1 - r2));
+}
 #endif /* Vector_h */
@@ -0,0 +1,124 @@
+//
+//  Baker.h
+//  Raytracing
+//
+//  Bakes ambient occlusion and irradiance into the texels of a sphere's own
+//  (u, v) mapping, see HitRecord::GetUV. Every texel sends cosine
+//  distributed rays from its point on the surface through BatchTracer.
+//  Irradiance counts the sky and emitters seen directly; light bounced off
+//  other surfaces is not followed.
+//
+
+#ifndef Baker_h
+#define Baker_h
+
+#include "FrameBuffer.h"
+#include "Integrator.h"
+#include "RayQuery.h"
+#include "../Math/ONB.h"
+
+struct BakeSettings
+{
+    int m_width = 64;               // texels along u
+    int m_height = 32;              // texels along v
+    int m_samplesPerTexel = 64;
+    float m_occlusionDistance = 1.0f;   // hits further away do not occlude
+    float m_skyIntensity = 1.0f;
+};
+
+class Baker
+{
+public:
+    // Rays traced together, enough for a few chunks per worker.
+    static const int s_kRaysPerBatch = 1 << 16;
+    
+    Baker(ThreadPool* threadPool) : m_tracer(threadPool) {}
+    
+    // Adds each texel's estimate as one sample to ambientOcclusion_out (gray,
+    // 1 for an open texel) and irradiance_out, both resized to the map. Texel (i, j)
+    // covers u in [i, i + 1) / width and v in [j, j + 1) / height. Returns
+    // the number of rays traced.
+    size_t BakeSphere(const Hittable& world, const Vector3& center, float radius, const BakeSettings& settings,
+                      FrameBuffer& ambientOcclusion_out, FrameBuffer& irradiance_out)
+    {
+        ambientOcclusion_out.Resize(settings.m_width, settings.m_height);
+        irradiance_out.Resize(settings.m_width, settings.m_height);
+        const int texelCount = settings.m_width * settings.m_height;
+        const int samples = settings.m_samplesPerTexel;
+        const int texelsPerBatch = std::max(1, s_kRaysPerBatch / samples);
+        m_queries.resize(size_t(texelsPerBatch) * samples);
+        m_hits.resize(m_queries.size());
+        
+        size_t rayCount = 0;
+        for (int first = 0; first < texelCount; first += texelsPerBatch)
+        {
+            const int batchTexels = std::min(texelsPerBatch, texelCount - first);
+            for (int texel = 0; texel < batchTexels; ++texel)
+            {
+                Vector3 normal = GetSphereNormal(first + texel, settings);
+                Vector3 point = center + radius * normal;
+                ONB uvw(normal);
+                for (int s = 0; s < samples; ++s)
+                {
+                    RayQuery& query = m_queries[texel * samples + s];
+                    query.m_origin = point;
+                    query.m_direction = uvw.Local(Vector3::RandomCosineDirection());
+                    query.m_tMin = 1e-3f * fabs(radius);
+                    query.m_tMax = float(s_kInfinity);
+                }
+            }
+            
+            m_tracer.Trace(world, m_queries.data(), batchTexels * samples, m_hits.data());
+            rayCount += size_t(batchTexels) * samples;
+            
+            // With cosine sampling the mean incident radiance is irradiance
+            // over pi, and the unoccluded fraction is the occlusion term.
+            for (int texel = 0; texel < batchTexels; ++texel)
+            {
+                int open = 0;
+                Vector3 radiance = Vector3::GetZero();
+                for (int s = 0; s < samples; ++s)
+                {
+                    const RayQuery& query = m_queries[texel * samples + s];
+                    const RayQueryHit& hit = m_hits[texel * samples + s];
+                    if (!hit.m_material)
+                    {
+                        radiance += settings.m_skyIntensity * GetBackground(Ray(query.m_origin, query.m_direction));
+                    }
+                    else
+                    {
+                        HitRecord rec;
+                        rec.m_frontFace = hit.m_bFrontFace;
+                        radiance += hit.m_material->Emitted(rec);
+                    }
+                    open += hit.m_t > settings.m_occlusionDistance ? 1 : 0;
+                }
+                
+                const int i = (first + texel) % settings.m_width;
+                const int j = (first + texel) / settings.m_width;
+                const float occlusion = float(open) / samples;
+                ambientOcclusion_out.AddSamples(i, j, Vector3(occlusion, occlusion, occlusion), 1);
+                irradiance_out.AddSamples(i, j, float(s_kPI) / samples * radiance, 1);
+            }
+        }
+        return rayCount;
+    }
+    
+    // Outward normal at the center of a texel, inverting the longitude and
+    // latitude mapping of HitRecord::GetUV.
+    static Vector3 GetSphereNormal(int texel, const BakeSettings& settings)
+    {
+        double u = (texel % settings.m_width + 0.5) / settings.m_width;
+        double v = (texel / settings.m_width + 0.5) / settings.m_height;
+        double theta = v * s_kPI;
+        double phi = u * 2 * s_kPI - s_kPI;
+        return Vector3(sin(theta) * cos(phi), -cos(theta), -sin(theta) * sin(phi));
+    }
+
+private:
+    BatchTracer                 m_tracer;
+    std::vector<RayQuery>       m_queries;
+    std::vector<RayQueryHit>    m_hits;
+};
+
+#endif /* Baker_h */
@@ -0,0 +1,478 @@
+//
+//  Bidirectional.h
+//  Raytracing
+//
+//  Bidirectional path tracing (Veach; the structure follows pbrt). Each
+//  camera sample traces a camera subpath and a light subpath leaving an
+//  emissive sphere, connects every pair of prefixes and weights each
+//  strategy with the balance heuristic. Connections straight to the camera
+//  (light tracing) land on arbitrary pixels and are splatted into the
+//  worker's own layer of the frame buffer. Camera paths that escape pick up
+//  the sky at full weight, since no light subpath starts there.
+//
+
+#ifndef Bidirectional_h
+#define Bidirectional_h
+
+#include "../Camera/Camera.h"
+#include "../Accel/LightTree.h"
+#include "FrameBuffer.h"
+#include "Integrator.h"
+
+struct BidirectionalVertex
+{
+    enum Type { kCamera, kLight, kSurface };
+    
+    Type        m_type;
+    Vector3     m_point;
+    Vector3     m_normal;       // surfaces: facing the side the path arrived on; lights: outward; camera: forward
+    Vector3     m_incoming;     // unit direction back to the previous vertex
+    Vector3     m_beta;         // throughput of the subpath up to this vertex
+    HitRecord   m_hit;          // surfaces only
+    int         m_light;        // light vertices only
+    bool        m_bDelta;       // scattered by a delta lobe, cannot be connected to
+    double      m_pdfFwd;       // area density of this vertex given the subpath before it
+    double      m_pdfRev;       // the same for the path generated from the other end
+};
+
+// What one sample needs besides its two subpaths. The vertex arrays hold
+// m_maxDepth + 1 entries each.
+struct BidirectionalContext
+{
+    const Hittable*         m_world;
+    const Camera*           m_camera;
+    const LightTree*        m_lightTree;
+    const EnvironmentMap*   m_environment;      // nullptr for the gradient sky
+    float                   m_skyIntensity;
+    int                     m_maxDepth;
+    FrameBuffer*            m_frameBuffer;
+    int                     m_splatLayer;
+    BidirectionalVertex*    m_cameraPath;
+    BidirectionalVertex*    m_lightPath;
+};
+
+// Turns a solid angle density at from into an area density at to.
+inline double ConvertDensity(double pdf, const BidirectionalVertex& from, const BidirectionalVertex& to)
+{
+    Vector3 direction = to.m_point - from.m_point;
+    double distance2 = direction.SquaredLength();
+    if (distance2 <= 0)
+    {
+        return 0.0;
+    }
+    pdf /= distance2;
+    if (to.m_type != BidirectionalVertex::kCamera)
+    {
+        pdf *= fabs(dot(to.m_normal, direction)) / sqrt(distance2);
+    }
+    return pdf;
+}
+
+// Light index of an emitting vertex, or -1.
+inline int GetVertexLight(const BidirectionalContext& context, const BidirectionalVertex& vertex)
+{
+    if (vertex.m_type == BidirectionalVertex::kLight)
+    {
+        return vertex.m_light;
+    }
+    return context.m_lightTree ? context.m_lightTree->FindLight(vertex.m_hit.m_object) : -1;
+}
+
+// Area density of starting a light subpath at an emitting vertex.
+inline double GetLightOriginPdf(const BidirectionalContext& context, const BidirectionalVertex& vertex)
+{
+    int light = GetVertexLight(context, vertex);
+    if (light < 0)
+    {
+        return 0.0;
+    }
+    float radius = context.m_lightTree->GetLight(light).m_radius;
+    return context.m_lightTree->PowerPmf(light) / (4 * s_kPI * radius * radius);
+}
+
+// Area density at next of a light subpath leaving an emitting vertex, whose
+// directions are cosine distributed about the normal.
+inline double GetEmissionPdf(const BidirectionalVertex& vertex, const BidirectionalVertex& next)
+{
+    double cosine = dot(vertex.m_normal, unit_vector(next.m_point - vertex.m_point));
+    return cosine > 0 ? ConvertDensity(cosine / s_kPI, vertex, next) : 0.0;
+}
+
+// Area density at next of the subpath through vertex continuing there after
+// arriving from previous.
+inline double GetVertexPdf(const BidirectionalContext& context, const BidirectionalVertex& vertex,
+                           const BidirectionalVertex* previous, const BidirectionalVertex& next)
+{
+    Vector3 direction = next.m_point - vertex.m_point;
+    switch (vertex.m_type)
+    {
+        case BidirectionalVertex::kCamera:
+            return ConvertDensity(context.m_camera->GetDirectionPdf(vertex.m_point, direction), vertex, next);
+        case BidirectionalVertex::kLight:
+            return GetEmissionPdf(vertex, next);
+        default:
+        {
+            Vector3 incoming = previous ? unit_vector(previous->m_point - vertex.m_point) : vertex.m_incoming;
+            double pdf = vertex.m_hit.m_material->Pdf(Ray(vertex.m_point, -incoming), vertex.m_hit, unit_vector(direction));
+            return ConvertDensity(pdf, vertex, next);
+        }
+    }
+}
+
+// BSDF of a surface vertex between m_incoming and direction.
+inline Vector3 GetSurfaceValue(const BidirectionalVertex& vertex, const Vector3& direction)
+{
+    return vertex.m_hit.m_material->Evaluate(Ray(vertex.m_point, -vertex.m_incoming), vertex.m_hit, direction);
+}
+
+// Extends the subpath ending at path[count - 1] along ray until it leaves the
+// scene, reaches maxCount vertices or is absorbed. beta and pdf are the
+// throughput and solid angle density of ray. Radiance from the sky is added
+// to escaped_out when given. Returns the new vertex count.
+inline int RandomWalk(const BidirectionalContext& context, Ray ray, Vector3 beta, double pdf,
+                      BidirectionalVertex* path, int count, int maxCount, Vector3* escaped_out)
+{
+    double pdfFwd = pdf;
+    while (count < maxCount)
+    {
+        BidirectionalVertex& vertex = path[count];
+        BidirectionalVertex& previous = path[count - 1];
+        HitRecord& hitRec = vertex.m_hit;
+        Profiler::CountRays(1);
+        if (!context.m_world->hit(ray, 0.001, s_kInfinity, hitRec))
+        {
+            if (escaped_out)
+            {
+                Vector3 sky = context.m_environment ? context.m_environment->Lookup(ray.GetDirection()) : GetBackground(ray);
+                *escaped_out += beta * (context.m_skyIntensity * sky);
+            }
+            break;
+        }
+        
+        vertex.m_type = BidirectionalVertex::kSurface;
+        vertex.m_point = hitRec.m_point;
+        vertex.m_normal = hitRec.m_normal;
+        vertex.m_incoming = -unit_vector(ray.GetDirection());
+        vertex.m_beta = beta;
+        vertex.m_light = -1;
+        vertex.m_bDelta = false;
+        vertex.m_pdfFwd = ConvertDensity(pdfFwd, previous, vertex);
+        vertex.m_pdfRev = 0;
+        if (++count == maxCount)
+        {
+            break;
+        }
+        
+        BSDFSample sample;
+        if (!hitRec.m_material->Sample(ray, hitRec, sample))
+        {
+            break;
+        }
+        Vector3 direction = unit_vector(sample.m_direction);
+        double pdfRev = 0;
+        if (sample.m_isSpecular)
+        {
+            vertex.m_bDelta = true;
+            beta *= sample.m_value;
+            pdfFwd = 0;
+        }
+        else
+        {
+            double cosine = fabs(dot(direction, hitRec.m_normal));
+            if (sample.m_pdf <= 0 || cosine <= 0)
+            {
+                break;
+            }
+            beta *= sample.m_value * (cosine / sample.m_pdf);
+            pdfFwd = sample.m_pdf;
+            pdfRev = hitRec.m_material->Pdf(Ray(hitRec.m_point, -direction), hitRec, vertex.m_incoming);
+        }
+        previous.m_pdfRev = ConvertDensity(pdfRev, vertex, previous);
+        ray = Ray(hitRec.m_point, direction);
+    }
+    return count;
+}
+
+// Balance heuristic weight of the strategy with s light and t camera
+// vertices, computed from the ratios of the densities every other strategy
+// would have had for the same path. sampled stands in for the light vertex
+// when s == 1 and for the camera vertex when t == 1. The reverse densities
+// at the connection depend on it, so they are set here and restored after.
+inline double GetBidirectionalWeight(const BidirectionalContext& context, BidirectionalVertex& sampled, int s, int t)
+{
+    // Emitters the light tree does not know can only be found by the camera
+    // subpath.
+    if (s + t == 2 || (s == 0 && GetLightOriginPdf(context, context.m_cameraPath[t - 1]) <= 0))
+    {
+        return 1.0;
+    }
+    
+    auto lightVertex = [&](int i) -> BidirectionalVertex& { return s == 1 && i == 0 ? sampled : context.m_lightPath[i]; };
+    auto cameraVertex = [&](int i) -> BidirectionalVertex& { return t == 1 && i == 0 ? sampled : context.m_cameraPath[i]; };
+    BidirectionalVertex* qs = s > 0 ? &lightVertex(s - 1) : nullptr;
+    BidirectionalVertex* pt = &cameraVertex(t - 1);
+    BidirectionalVertex* qsMinus = s > 1 ? &lightVertex(s - 2) : nullptr;
+    BidirectionalVertex* ptMinus = t > 1 ? &cameraVertex(t - 2) : nullptr;
+    
+    const bool bPtDelta = pt->m_bDelta;
+    const double ptPdfRev = pt->m_pdfRev;
+    const double ptMinusPdfRev = ptMinus ? ptMinus->m_pdfRev : 0.0;
+    const bool bQsDelta = qs ? qs->m_bDelta : false;
+    const double qsPdfRev = qs ? qs->m_pdfRev : 0.0;
+    const double qsMinusPdfRev = qsMinus ? qsMinus->m_pdfRev : 0.0;
+    
+    pt->m_bDelta = false;
+    pt->m_pdfRev = qs ? GetVertexPdf(context, *qs, qsMinus, *pt) : GetLightOriginPdf(context, *pt);
+    if (ptMinus)
+    {
+        ptMinus->m_pdfRev = qs ? GetVertexPdf(context, *pt, qs, *ptMinus) : GetEmissionPdf(*pt, *ptMinus);
+    }
+    if (qs)
+    {
+        qs->m_bDelta = false;
+        qs->m_pdfRev = GetVertexPdf(context, *pt, ptMinus, *qs);
+    }
+    if (qsMinus)
+    {
+        qsMinus->m_pdfRev = GetVertexPdf(context, *qs, pt, *qsMinus);
+    }
+    
+    // Densities of zero come from delta vertices, which the checks skip.
+    auto remap = [](double pdf) { return pdf != 0 ? pdf : 1.0; };
+    double sum = 0;
+    double ratio = 1;
+    for (int i = t - 1; i > 0; --i)
+    {
+        ratio *= remap(cameraVertex(i).m_pdfRev) / remap(cameraVertex(i).m_pdfFwd);
+        if (!cameraVertex(i).m_bDelta && !cameraVertex(i - 1).m_bDelta)
+        {
+            sum += ratio;
+        }
+    }
+    ratio = 1;
+    for (int i = s - 1; i >= 0; --i)
+    {
+        ratio *= remap(lightVertex(i).m_pdfRev) / remap(lightVertex(i).m_pdfFwd);
+        if (!lightVertex(i).m_bDelta && !(i > 0 && lightVertex(i - 1).m_bDelta))
+        {
+            sum += ratio;
+        }
+    }
+    
+    pt->m_bDelta = bPtDelta;
+    pt->m_pdfRev = ptPdfRev;
+    if (ptMinus)
+    {
+        ptMinus->m_pdfRev = ptMinusPdfRev;
+    }
+    if (qs)
+    {
+        qs->m_bDelta = bQsDelta;
+        qs->m_pdfRev = qsPdfRev;
+    }
+    if (qsMinus)
+    {
+        qsMinus->m_pdfRev = qsMinusPdfRev;
+    }
+    return 1 / (1 + sum);
+}
+
+// Weighted contribution of joining the first s light and t camera vertices.
+// Strategies with t == 1 splat their result and return zero.
+inline Vector3 ConnectBidirectional(const BidirectionalContext& context, int s, int t)
+{
+    const Hittable& world = *context.m_world;
+    BidirectionalVertex sampled;
+    Vector3 color = Vector3::GetZero();
+    Vector3 from = Vector3::GetZero();
+    Vector3 to = Vector3::GetZero();
+    double u = 0, v = 0;
+    
+    if (s == 0)
+    {
+        // The camera subpath found a light on its own.
+        const BidirectionalVertex& pt = context.m_cameraPath[t - 1];
+        if (pt.m_type != BidirectionalVertex::kSurface)
+        {
+            return color;
+        }
+        color = pt.m_beta * pt.m_hit.m_material->Emitted(pt.m_hit);
+    }
+    else if (t == 1)
+    {
+        // Light tracing: join the light subpath to a point on the lens.
+        const BidirectionalVertex& qs = context.m_lightPath[s - 1];
+        if (qs.m_bDelta)
+        {
+            return color;
+        }
+        
+        const Camera& camera = *context.m_camera;
+        Vector3 lensPoint = camera.SampleLensPoint();
+        if (!camera.Project(qs.m_point, lensPoint, u, v))
+        {
+            return color;
+        }
+        Vector3 toLens = lensPoint - qs.m_point;
+        double distance2 = toLens.SquaredLength();
+        Vector3 direction = toLens / sqrt(distance2);
+        
+        sampled.m_type = BidirectionalVertex::kCamera;
+        sampled.m_point = lensPoint;
+        sampled.m_normal = camera.GetForward();
+        sampled.m_bDelta = false;
+        sampled.m_pdfFwd = 1;
+        sampled.m_pdfRev = 0;
+        
+        // The importance of a ray through the image is its direction
+        // density, scaled from the solid angle at the lens to the area at qs.
+        double importance = camera.GetDirectionPdf(lensPoint, -toLens) / distance2;
+        color = qs.m_beta * GetSurfaceValue(qs, direction) * (fabs(dot(direction, qs.m_normal)) * importance);
+        from = qs.m_point;
+        to = lensPoint;
+    }
+    else if (s == 1)
+    {
+        // Next event estimation: a light picked for pt, a point on it.
+        const BidirectionalVertex& pt = context.m_cameraPath[t - 1];
+        if (pt.m_bDelta || !context.m_lightTree)
+        {
+            return color;
+        }
+        
+        const LightTree& lightTree = *context.m_lightTree;
+        int light;
+        double pmf, directionPdf;
+        Vector3 direction;
+        float distance;
+        if (!lightTree.Sample(pt.m_point, pt.m_normal, RandomDouble(), light, pmf) ||
+            !LightTree::SampleSphere(pt.m_point, lightTree.GetLight(light), direction, directionPdf, distance))
+        {
+            return color;
+        }
+        
+        const SphereLight& sphere = lightTree.GetLight(light);
+        sampled.m_type = BidirectionalVertex::kLight;
+        sampled.m_point = pt.m_point + direction * distance;
+        sampled.m_normal = unit_vector(sampled.m_point - sphere.m_center);
+        sampled.m_light = light;
+        sampled.m_bDelta = false;
+        sampled.m_pdfFwd = GetLightOriginPdf(context, sampled);
+        sampled.m_pdfRev = 0;
+        
+        color = pt.m_beta * GetSurfaceValue(pt, direction) * sphere.m_radiance *
+                (fabs(dot(direction, pt.m_normal)) / (pmf * directionPdf));
+        from = pt.m_point;
+        to = sampled.m_point;
+    }
+    else
+    {
+        const BidirectionalVertex& qs = context.m_lightPath[s - 1];
+        const BidirectionalVertex& pt = context.m_cameraPath[t - 1];
+        if (qs.m_bDelta || pt.m_bDelta)
+        {
+            return color;
+        }
+        
+        Vector3 toCamera = pt.m_point - qs.m_point;
+        double distance2 = toCamera.SquaredLength();
+        Vector3 direction = toCamera / sqrt(distance2);
+        double geometry = fabs(dot(direction, qs.m_normal)) * fabs(dot(direction, pt.m_normal)) / distance2;
+        color = qs.m_beta * GetSurfaceValue(qs, direction) * GetSurfaceValue(pt, -direction) * pt.m_beta * geometry;
+        from = qs.m_point;
+        to = pt.m_point;
+    }
+    
+    if (color.X() <= 0 && color.Y() <= 0 && color.Z() <= 0)
+    {
+        return Vector3::GetZero();
+    }
+    
+    if (s > 0)
+    {
+        Profiler::CountRays(1);
+        Vector3 segment = to - from;
+        float length = segment.Length();
+        if (world.occluded(Ray(from, segment / length), 0.001, length * 0.999f))
+        {
+            return Vector3::GetZero();
+        }
+    }
+    
+    color *= float(GetBidirectionalWeight(context, sampled, s, t));
+    if (t == 1)
+    {
+        FrameBuffer& frameBuffer = *context.m_frameBuffer;
+        int i = std::min(int(u * frameBuffer.Width()), frameBuffer.Width() - 1);
+        int j = std::min(int(v * frameBuffer.Height()), frameBuffer.Height() - 1);
+        frameBuffer.Splat(context.m_splatLayer, i, j, color);
+        return Vector3::GetZero();
+    }
+    return color;
+}
+
+// Radiance along a camera ray, plus the light tracing splats of its light
+// subpath. One light subpath is traced per camera ray, which is what makes
+// the splats of a pass average to the image.
+inline Vector3 TraceBidirectional(const Ray& r, const BidirectionalContext& context)
+{
+    const Camera& camera = *context.m_camera;
+    BidirectionalVertex& cameraVertex = context.m_cameraPath[0];
+    cameraVertex.m_type = BidirectionalVertex::kCamera;
+    cameraVertex.m_point = r.GetOrigin();
+    cameraVertex.m_normal = camera.GetForward();
+    cameraVertex.m_beta = Vector3(1, 1, 1);
+    cameraVertex.m_bDelta = false;
+    cameraVertex.m_pdfFwd = 1;
+    cameraVertex.m_pdfRev = 0;
+    
+    Vector3 color = Vector3::GetZero();
+    double cameraPdf = camera.GetDirectionPdf(r.GetOrigin(), r.GetDirection());
+    int cameraCount = RandomWalk(context, r, cameraVertex.m_beta, cameraPdf, context.m_cameraPath, 1,
+                                 context.m_maxDepth + 1, &color);
+    
+    // Light subpaths leave a point uniform over a sphere picked by power,
+    // cosine distributed about its normal.
+    int lightCount = 0;
+    int light;
+    double pmf;
+    if (context.m_lightTree && context.m_lightTree->SampleByPower(RandomDouble(), light, pmf))
+    {
+        const SphereLight& sphere = context.m_lightTree->GetLight(light);
+        double z = 1 - 2 * RandomDouble();
+        double phi = 2 * s_kPI * RandomDouble();
+        double radius = sqrt(ffmax(0, 1 - z * z));
+        Vector3 normal(radius * cos(phi), radius * sin(phi), z);
+        
+        BidirectionalVertex& lightVertex = context.m_lightPath[0];
+        lightVertex.m_type = BidirectionalVertex::kLight;
+        lightVertex.m_point = sphere.m_center + sphere.m_radius * normal;
+        lightVertex.m_normal = normal;
+        lightVertex.m_light = light;
+        lightVertex.m_bDelta = false;
+        lightVertex.m_pdfFwd = GetLightOriginPdf(context, lightVertex);
+        lightVertex.m_beta = sphere.m_radiance / float(lightVertex.m_pdfFwd);
+        lightVertex.m_pdfRev = 0;
+        
+        // Le * cos / (pdf * cos / pi) for the first segment.
+        ONB uvw(normal);
+        Vector3 direction = uvw.Local(Vector3::RandomCosineDirection());
+        lightCount = RandomWalk(context, Ray(lightVertex.m_point, direction), lightVertex.m_beta * float(s_kPI),
+                                dot(direction, normal) / s_kPI, context.m_lightPath, 1, context.m_maxDepth, nullptr);
+    }
+    
+    for (int t = 1; t <= cameraCount; ++t)
+    {
+        for (int s = 0; s <= lightCount; ++s)
+        {
+            if (s + t < 2 || (s == 1 && t == 1) || s + t - 1 > context.m_maxDepth)
+            {
+                continue;
+            }
+            color += ConnectBidirectional(context, s, t);
+        }
+    }
+    return color;
+}
+
+#endif /* Bidirectional_h */
@@ -0,0 +1,154 @@
+//
+//  Convergence.h
+//  Raytracing
+//
+//  Time-to-quality measurement. A configuration is rendered in passes of
+//  doubling sample counts into one buffer, and after each pass the error of
+//  the running average against a reference image is recorded with the
+//  render time spent so far. Comparing configurations on how soon they
+//  reach a given error accounts for both their speed and their noise.
+//
+
+#ifndef Convergence_h
+#define Convergence_h
+
+#include <chrono>
+#include <math.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Renderer.h"
+
+struct ImageError
+{
+    double m_rmse = 0.0;
+    double m_relMSE = 0.0;      // squared error over squared reference luminance, less fooled by bright pixels
+};
+
+struct ConvergencePoint
+{
+    int m_samplesPerPixel;
+    double m_seconds;           // render time only, error evaluation excluded
+    ImageError m_error;
+};
+
+struct ConvergenceSettings
+{
+    int m_maxSamplesPerPixel = 64;
+    double m_maxSeconds = 30.0;     // no new pass starts after this much render time
+};
+
+// Error of image's pixel averages against those of reference, which must
+// have the same size. Pixels without samples in either are skipped.
+inline ImageError GetImageError(const FrameBuffer& image, const FrameBuffer& reference)
+{
+    double squaredSum = 0;
+    double relativeSum = 0;
+    int count = 0;
+    for (int j = 0; j < image.Height(); ++j)
+    {
+        for (int i = 0; i < image.Width(); ++i)
+        {
+            if (image.GetSampleCount(i, j) == 0 || reference.GetSampleCount(i, j) == 0)
+            {
+                continue;
+            }
+            
+            Vector3 expected = reference.GetColorSum(i, j) / reference.GetSampleCount(i, j);
+            Vector3 difference = image.GetColorSum(i, j) / image.GetSampleCount(i, j) - expected;
+            float luminance = Luminance(expected);
+            squaredSum += difference.SquaredLength() / 3;
+            relativeSum += difference.SquaredLength() / 3 / (luminance * luminance + 1e-2);
+            count++;
+        }
+    }
+    
+    ImageError error;
+    if (count > 0)
+    {
+        error.m_rmse = sqrt(squaredSum / count);
+        error.m_relMSE = relativeSum / count;
+    }
+    return error;
+}
+
+// Renders passes of 1, 1, 2, 4, ... samples per pixel into frameBuffer,
+// which is cleared first, and returns the error after each. The reference
+// should have many times m_maxSamplesPerPixel samples or its own noise
+// becomes the floor of every curve.
+inline std::vector<ConvergencePoint> MeasureConvergence(Renderer& renderer, const Hittable& world, const Camera& camera,
+                                                        RenderSettings settings, const FrameBuffer& reference,
+                                                        FrameBuffer& frameBuffer, const ConvergenceSettings& convergenceSettings)
+{
+    std::vector<ConvergencePoint> points;
+    frameBuffer.Resize(reference.Width(), reference.Height());
+    
+    int samplesPerPixel = 0;
+    double seconds = 0;
+    int passSamples = 1;
+    while (samplesPerPixel < convergenceSettings.m_maxSamplesPerPixel && seconds < convergenceSettings.m_maxSeconds)
+    {
+        settings.m_samplesPerPixel = std::min(passSamples, convergenceSettings.m_maxSamplesPerPixel - samplesPerPixel);
+        auto startTime = std::chrono::steady_clock::now();
+        renderer.RenderPass(world, camera, settings, frameBuffer);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        samplesPerPixel += settings.m_samplesPerPixel;
+        points.push_back(ConvergencePoint{ samplesPerPixel, seconds, GetImageError(frameBuffer, reference) });
+        
+        if (samplesPerPixel > 1)
+        {
+            passSamples *= 2;
+        }
+    }
+    return points;
+}
+
+// Render time at which the curve first gets down to targetRMSE, interpolated
+// linearly in log-log space between passes, or a negative value if it never
+// does. Errors fall roughly as a power of time, which the interpolation
+// follows exactly.
+inline double GetSecondsToError(const std::vector<ConvergencePoint>& points, double targetRMSE)
+{
+    for (size_t point = 0; point < points.size(); ++point)
+    {
+        if (points[point].m_error.m_rmse > targetRMSE)
+        {
+            continue;
+        }
+        if (point == 0)
+        {
+            return points[0].m_seconds;
+        }
+        
+        const ConvergencePoint& before = points[point - 1];
+        const ConvergencePoint& after = points[point];
+        double fraction = log(before.m_error.m_rmse / targetRMSE) / log(before.m_error.m_rmse / after.m_error.m_rmse);
+        return exp(log(before.m_seconds) + fraction * (log(after.m_seconds) - log(before.m_seconds)));
+    }
+    return -1.0;
+}
+
+// Lists the curve a pass per line under name, then the time to targetRMSE.
+inline void PrintConvergence(const std::string& name, const std::vector<ConvergencePoint>& points, double targetRMSE,
+                             std::ostream& out)
+{
+    out << name << std::endl;
+    for (const ConvergencePoint& point : points)
+    {
+        out << "  " << point.m_samplesPerPixel << " spp  " << point.m_seconds << " s  RMSE " << point.m_error.m_rmse
+            << "  relMSE " << point.m_error.m_relMSE << std::endl;
+    }
+    
+    double seconds = GetSecondsToError(points, targetRMSE);
+    out << "  seconds to RMSE " << targetRMSE << ": ";
+    if (seconds < 0)
+    {
+        out << "not reached" << std::endl;
+    }
+    else
+    {
+        out << seconds << std::endl;
+    }
+}
+
+#endif /* Convergence_h */
@@ -0,0 +1,138 @@
+//
+//  DeadlineRenderer.h
+//  Raytracing
+//
+//  Renders against a wall-clock budget instead of a fixed sample count. The
+//  first pass measures throughput, later passes are sized to the time left
+//  and a watchdog cancels whatever pass is running when the deadline hits.
+//
+
+#ifndef DeadlineRenderer_h
+#define DeadlineRenderer_h
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include "Renderer.h"
+
+struct DeadlineSettings
+{
+    double m_budgetSeconds = 10.0;
+    int m_maxSamplesPerPixel = 100;     // stop early once every pixel has this many
+    double m_passFraction = 0.5;        // share of the remaining time each pass aims for
+};
+
+struct DeadlineReport
+{
+    int m_passes = 0;
+    int m_completedSamplesPerPixel = 0; // samples every pixel got from whole passes
+    bool m_bHitDeadline = false;
+    double m_seconds = 0.0;
+};
+
+class DeadlineRenderer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    
+    DeadlineRenderer(Renderer& renderer) : m_renderer(renderer) {}
+    
+    // Accumulates into frameBuffer until the budget runs out or the sample
+    // cap is reached. settings.m_samplesPerPixel is ignored. Tiles of the pass
+    // cut off by the deadline keep the samples they finished, so sample
+    // counts differ between regions; the buffer always holds a valid average.
+    // A bidirectional pass cut off by the deadline adds nothing, see
+    // Renderer::RenderPass().
+    DeadlineReport Render(const Hittable& world, const Camera& camera, RenderSettings settings,
+                          FrameBuffer& frameBuffer, const DeadlineSettings& deadlineSettings)
+    {
+        const Clock::time_point startTime = Clock::now();
+        const Clock::time_point deadline = startTime + std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(deadlineSettings.m_budgetSeconds));
+        
+        CancelToken cancelToken;
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool bFinished = false;
+        std::thread watchdog([&]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!condition.wait_until(lock, deadline, [&]() { return bFinished; }))
+            {
+                cancelToken.Cancel();
+            }
+        });
+        
+        DeadlineReport report;
+        double secondsPerSample = 0.0;
+        int samplesThisPass = 1;
+        while (report.m_completedSamplesPerPixel < deadlineSettings.m_maxSamplesPerPixel)
+        {
+            settings.m_samplesPerPixel = std::min(samplesThisPass, deadlineSettings.m_maxSamplesPerPixel - report.m_completedSamplesPerPixel);
+            bool bComplete = m_renderer.RenderPass(world, camera, settings, frameBuffer, &cancelToken);
+            report.m_passes++;
+            if (!bComplete)
+            {
+                report.m_bHitDeadline = true;
+                break;
+            }
+            
+            // Throughput over all whole passes so far, which smooths out the
+            // noise of short passes.
+            report.m_completedSamplesPerPixel += settings.m_samplesPerPixel;
+            secondsPerSample = std::chrono::duration<double>(Clock::now() - startTime).count() / report.m_completedSamplesPerPixel;
+            
+            double remaining = std::chrono::duration<double>(deadline - Clock::now()).count();
+            if (remaining <= 0)
+            {
+                report.m_bHitDeadline = true;
+                break;
+            }
+            samplesThisPass = std::max(1, int(remaining * deadlineSettings.m_passFraction / secondsPerSample));
+        }
+        
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            bFinished = true;
+        }
+        condition.notify_one();
+        watchdog.join();
+        
+        report.m_seconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+        return report;
+    }
+    
+    // Prints the average samples per pixel of a regions x regions grid over
+    // the image, top row first.
+    static void PrintSampleCounts(const FrameBuffer& frameBuffer, int regions, std::ostream& out)
+    {
+        for (int regionY = regions - 1; regionY >= 0; --regionY)
+        {
+            int beginY = regionY * frameBuffer.Height() / regions;
+            int endY = (regionY + 1) * frameBuffer.Height() / regions;
+            for (int regionX = 0; regionX < regions; ++regionX)
+            {
+                int beginX = regionX * frameBuffer.Width() / regions;
+                int endX = (regionX + 1) * frameBuffer.Width() / regions;
+                double samples = 0;
+                for (int j = beginY; j < endY; ++j)
+                {
+                    for (int i = beginX; i < endX; ++i)
+                    {
+                        samples += frameBuffer.GetSampleCount(i, j);
+                    }
+                }
+                int pixels = std::max(1, (endX - beginX) * (endY - beginY));
+                out << (regionX ? "\t" : "") << int(samples / pixels + 0.5);
+            }
+            out << "\n";
+        }
+    }
+    
+private:
+    Renderer& m_renderer;
+};
+
+#endif /* DeadlineRenderer_h */
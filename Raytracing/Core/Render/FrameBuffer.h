@@ -0,0 +1,417 @@
+//
+//  FrameBuffer.h
+//  Raytracing
+//
+//  Accumulation buffer holding the running color sum, sample count and
+//  sample variance of every pixel. Row j = 0 is the bottom of the image.
+//
+//  Colors are kept in one of three formats, see FrameBufferFormat, with the
+//  counts and variances in planes of their own. Every plane is stored in
+//  8 x 8 pixel blocks, so a render tile writes a few contiguous runs of
+//  memory rather than one short run per image row, each on its own page at
+//  poster widths.
+//
+
+#ifndef FrameBuffer_h
+#define FrameBuffer_h
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include "../Math/PackedColor.h"
+#include "../Math/Vector.h"
+
+enum class FrameBufferFormat
+{
+    Float32,    // float sums, int counts and float variances, 20 bytes a pixel
+    Half,       // half float averages, 16 bit counts and deviations, 12 bytes a pixel
+    RGB9E5,     // shared exponent averages, 16 bit counts and deviations, 10 bytes a pixel
+};
+
+class FrameBuffer
+{
+public:
+    FrameBuffer() : m_width(0), m_height(0), m_blocksPerRow(0), m_format(FrameBufferFormat::Float32),
+                    m_output(nullptr), m_outputStride(0) {}
+    FrameBuffer(int width, int height, FrameBufferFormat format = FrameBufferFormat::Float32)
+        : m_format(format), m_output(nullptr), m_outputStride(0) { Resize(width, height); }
+    
+    void Resize(int width, int height)
+    {
+        Allocate(width, height);
+        Clear();
+    }
+    
+    // Reserves storage without writing to it, so the pages are placed on the
+    // NUMA node of whichever thread clears each row first.
+    void Allocate(int width, int height)
+    {
+        m_width = width;
+        m_height = height;
+        m_blocksPerRow = (width + s_kBlockSize - 1) / s_kBlockSize;
+        const size_t pixelCount = GetStorageSize();
+        const bool bFloat = m_format == FrameBufferFormat::Float32;
+        m_colorSum.reset(bFloat ? new Vector3[pixelCount] : nullptr);
+        m_sampleCount.reset(bFloat ? new int[pixelCount] : nullptr);
+        m_variance.reset(bFloat ? new float[pixelCount] : nullptr);
+        m_halfColor.reset(m_format == FrameBufferFormat::Half ? new HalfColor[pixelCount] : nullptr);
+        m_sharedExponentColor.reset(m_format == FrameBufferFormat::RGB9E5 ? new uint32_t[pixelCount] : nullptr);
+        m_colorExtension.reset(bFloat ? nullptr : new uint16_t[pixelCount]);
+        m_shortSampleCount.reset(bFloat ? nullptr : new uint16_t[pixelCount]);
+        m_halfDeviation.reset(bFloat ? nullptr : new uint16_t[pixelCount]);
+        m_splatLayers.clear();
+    }
+    
+    // Changing the format reallocates and clears the buffer.
+    void SetFormat(FrameBufferFormat format)
+    {
+        m_format = format;
+        if (m_width > 0)
+        {
+            Resize(m_width, m_height);
+        }
+    }
+    
+    FrameBufferFormat GetFormat() const { return m_format; }
+    
+    void Clear() { ClearRows(0, m_height); }
+    
+    void ClearRows(int beginRow, int endRow)
+    {
+        for (int j = beginRow; j < endRow; ++j)
+        {
+            for (int i = 0; i < m_width; ++i)
+            {
+                const int index = Index(i, j);
+                if (m_format == FrameBufferFormat::Float32)
+                {
+                    m_colorSum[index] = Vector3::GetZero();
+                    m_sampleCount[index] = 0;
+                    m_variance[index] = 0;
+                }
+                else
+                {
+                    const float dither[4] = { 0, 0, 0, 0 };
+                    StoreAverage(index, Vector3::GetZero(), dither);
+                    m_shortSampleCount[index] = 0;
+                    m_halfDeviation[index] = 0;
+                }
+            }
+        }
+    }
+    
+    // Mirrors the running average of every pixel into caller memory as it
+    // is accumulated: linear RGB floats, top row first, rowStride bytes
+    // apart. Pass null to stop.
+    void SetOutput(float* pixels, size_t rowStride)
+    {
+        m_output = pixels;
+        m_outputStride = rowStride;
+    }
+    
+    int Width() const { return m_width; }
+    int Height() const { return m_height; }
+    
+    // Color, count and variance storage of one pixel, splat layers not
+    // included.
+    static size_t GetBytesPerPixel(FrameBufferFormat format)
+    {
+        switch (format)
+        {
+            case FrameBufferFormat::Half:   return sizeof(HalfColor) + 3 * sizeof(uint16_t);
+            case FrameBufferFormat::RGB9E5: return sizeof(uint32_t) + 3 * sizeof(uint16_t);
+            default:                        return sizeof(Vector3) + sizeof(int) + sizeof(float);
+        }
+    }
+    
+    // Counts of the compact formats stop here; see AddSamples().
+    static constexpr int s_kMaxShortSampleCount = 65535;
+    
+    // Includes the padding of partial blocks at the right and top edges.
+    size_t GetMemoryBytes() const { return GetStorageSize() * GetBytesPerPixel(m_format); }
+    
+    // Each pixel is only ever written by the tile that owns it, so no locking.
+    //
+    // The compact formats count up to s_kMaxShortSampleCount samples. Past
+    // that, the samples so far keep that much weight less the new ones, so
+    // the average stays unbiased but stops converging.
+    void AddSamples(int i, int j, const Vector3& colorSum, int count)
+    {
+        const int index = Index(i, j);
+        const float batchLuminance = Luminance(colorSum) / count;
+        if (m_format == FrameBufferFormat::Float32)
+        {
+            const int before = m_sampleCount[index];
+            const float meanBefore = before > 0 ? Luminance(m_colorSum[index]) / before : 0.0f;
+            m_colorSum[index] += colorSum;
+            m_sampleCount[index] += count;
+            m_variance[index] = UpdateVariance(m_variance[index], before, count, meanBefore,
+                                               Luminance(m_colorSum[index]) / m_sampleCount[index], batchLuminance);
+            UpdateOutput(i, j);
+            return;
+        }
+        
+        const int added = std::min(count, s_kMaxShortSampleCount);
+        const int before = std::min(int(m_shortSampleCount[index]), s_kMaxShortSampleCount - added);
+        const int after = before + added;
+        const Vector3 average = LoadAverage(index);
+        const Vector3 newAverage = average + (float(added) / after) * (colorSum / float(count) - average);
+        
+        float dither[4];
+        GetDither(index, after, dither);
+        StoreAverage(index, newAverage, dither);
+        m_shortSampleCount[index] = uint16_t(after);
+        
+        // The deviation, unlike the variance, fits the half range for any
+        // radiance the averages can hold.
+        const float deviation = HalfToFloat(m_halfDeviation[index]);
+        const float variance = UpdateVariance(deviation * deviation, before, added, Luminance(average),
+                                              Luminance(newAverage), batchLuminance);
+        uint32_t unused;
+        m_halfDeviation[index] = FloatToHalf<0>(sqrtf(variance), dither[3], unused);
+        UpdateOutput(i, j);
+    }
+    
+    // Light tracing lands on any pixel from any worker, so every worker
+    // splats into a layer of its own and ResolveSplats() adds the layers to
+    // the color sums once the pass is over, counting the pass's samples for
+    // every pixel. Layers are float whatever the format, as they only live
+    // for one pass.
+    void PrepareSplats(int layerCount)
+    {
+        if (int(m_splatLayers.size()) == layerCount)
+        {
+            return;
+        }
+        
+        const size_t pixelCount = GetStorageSize();
+        m_splatLayers.clear();
+        for (int layer = 0; layer < layerCount; ++layer)
+        {
+            m_splatLayers.emplace_back(new Vector3[pixelCount]);
+            std::fill(m_splatLayers.back().get(), m_splatLayers.back().get() + pixelCount, Vector3::GetZero());
+        }
+    }
+    
+    void Splat(int layer, int i, int j, const Vector3& color) { m_splatLayers[layer][Index(i, j)] += color; }
+    
+    // Call with no pass running. Both leave the layers cleared for the next
+    // pass.
+    void ResolveSplats(int samplesPerPixel)
+    {
+        for (int j = 0; j < m_height; ++j)
+        {
+            for (int i = 0; i < m_width; ++i)
+            {
+                const int pixel = Index(i, j);
+                Vector3 sum = Vector3::GetZero();
+                for (auto& layer : m_splatLayers)
+                {
+                    sum += layer[pixel];
+                    layer[pixel] = Vector3::GetZero();
+                }
+                AddSamples(i, j, sum, samplesPerPixel);
+            }
+        }
+    }
+    
+    void DiscardSplats()
+    {
+        const size_t pixelCount = GetStorageSize();
+        for (auto& layer : m_splatLayers)
+        {
+            std::fill(layer.get(), layer.get() + pixelCount, Vector3::GetZero());
+        }
+    }
+    
+    Vector3 GetColorSum(int i, int j) const { return LoadColorSum(Index(i, j)); }
+    int GetSampleCount(int i, int j) const { return LoadSampleCount(Index(i, j)); }
+    
+    // Variance of the luminance of a single sample, estimated from how far
+    // the mean of each AddSamples() call lies from the running mean. It
+    // needs at least two calls, and assumes they add equal sample counts, as
+    // passes do; 0 before that.
+    float GetVariance(int i, int j) const
+    {
+        const int index = Index(i, j);
+        if (m_format == FrameBufferFormat::Float32)
+        {
+            return m_variance[index];
+        }
+        const float deviation = HalfToFloat(m_halfDeviation[index]);
+        return deviation * deviation;
+    }
+    
+    void AppendPPM(std::string& out) const
+    {
+        AppendPPMHeader(out);
+        for (int j = m_height - 1; j >= 0; --j)
+        {
+            AppendPPMRow(out, j);
+        }
+    }
+    
+    // Streams the text a row at a time; the whole image as text would be
+    // over a gigabyte at poster sizes.
+    bool WritePPM(const std::string& fileName) const
+    {
+        std::ofstream outputImage(fileName.c_str());
+        if (!outputImage)
+        {
+            return false;
+        }
+        
+        std::string pixelColorString;
+        AppendPPMHeader(pixelColorString);
+        for (int j = m_height - 1; j >= 0; --j)
+        {
+            AppendPPMRow(pixelColorString, j);
+            outputImage << pixelColorString;
+            pixelColorString.clear();
+        }
+        return bool(outputImage);
+    }
+
+private:
+    static const int s_kBlockSize = 8;
+    
+    // Blocks follow each other along a row of blocks, rows of blocks go
+    // bottom up, and pixels within a block are row major.
+    int Index(int i, int j) const
+    {
+        const int block = (j / s_kBlockSize) * m_blocksPerRow + i / s_kBlockSize;
+        return block * s_kBlockSize * s_kBlockSize + (j % s_kBlockSize) * s_kBlockSize + i % s_kBlockSize;
+    }
+    
+    size_t GetStorageSize() const
+    {
+        const size_t blocksPerColumn = (m_height + s_kBlockSize - 1) / s_kBlockSize;
+        return size_t(m_blocksPerRow) * blocksPerColumn * s_kBlockSize * s_kBlockSize;
+    }
+    
+    // The compact formats hold the pixel's average rather than its sum, which
+    // stays near the radiance it estimates instead of overflowing the half
+    // range. The average is rounded again after every pass, with
+    // s_kColorExtensionBits more mantissa bits than its encoding and with a
+    // dither: rounding to nearest would drop every update under half a unit
+    // in the last place, so a progressive render would stop converging after
+    // a few hundred passes, and bias pixels whose samples are skewed.
+    Vector3 LoadColorSum(int index) const
+    {
+        if (m_format == FrameBufferFormat::Float32)
+        {
+            return m_colorSum[index];
+        }
+        return float(m_shortSampleCount[index]) * LoadAverage(index);
+    }
+    
+    int LoadSampleCount(int index) const
+    {
+        return m_format == FrameBufferFormat::Float32 ? m_sampleCount[index] : m_shortSampleCount[index];
+    }
+    
+    Vector3 LoadAverage(int index) const
+    {
+        return m_format == FrameBufferFormat::Half ? UnpackHalf(m_halfColor[index], m_colorExtension[index])
+                                                   : UnpackRGB9E5(m_sharedExponentColor[index], m_colorExtension[index]);
+    }
+    
+    void StoreAverage(int index, const Vector3& average, const float dither[3])
+    {
+        if (m_format == FrameBufferFormat::Half)
+        {
+            m_halfColor[index] = PackHalf(average, dither, m_colorExtension[index]);
+        }
+        else
+        {
+            m_sharedExponentColor[index] = PackRGB9E5(average, dither, m_colorExtension[index]);
+        }
+    }
+    
+    // Welford's update with each call's mean as one observation weighted by
+    // its count. Every term after the first has the variance of a single
+    // sample as its expectation whatever the count, so the estimate is
+    // their running mean, with the number of earlier calls taken as
+    // before / count.
+    static float UpdateVariance(float variance, int before, int count, float meanBefore, float meanAfter, float batchMean)
+    {
+        if (before == 0)
+        {
+            return 0.0f;
+        }
+        const float term = count * (batchMean - meanBefore) * (batchMean - meanAfter);
+        return variance + std::min(float(count) / before, 1.0f) * (term - variance);
+    }
+    
+    // Uniform values in [0, 1) hashed from the pixel and its count, so the
+    // rounding does not draw on the render's random sequence: one for each
+    // color channel and one for the deviation.
+    static void GetDither(int index, int count, float dither_out[4])
+    {
+        uint32_t hash = uint32_t(index) * 0x9e3779b1u ^ uint32_t(count) * 0x85ebca77u;
+        for (int channel = 0; channel < 4; ++channel)
+        {
+            hash ^= hash >> 16;
+            hash *= 0x7feb352du;
+            hash ^= hash >> 15;
+            hash *= 0x846ca68bu;
+            hash ^= hash >> 16;
+            dither_out[channel] = float(hash >> 8) * (1.0f / 16777216.0f);
+        }
+    }
+    
+    void AppendPPMHeader(std::string& out) const
+    {
+        out.append("P3\n" + std::to_string(m_width) + " " + std::to_string(m_height) + "\n255\n");
+    }
+    
+    void AppendPPMRow(std::string& out, int j) const
+    {
+        for (int i = 0; i < m_width; ++i)
+        {
+            int count = GetSampleCount(i, j);
+            if (count == 0)
+            {
+                out.append("0 0 0\n");
+                continue;
+            }
+            Vector3 color = GetColorSum(i, j);
+            color.WriteColor(out, count);
+        }
+    }
+    
+    void UpdateOutput(int i, int j)
+    {
+        if (!m_output || GetSampleCount(i, j) == 0)
+        {
+            return;
+        }
+        
+        float* pixel = reinterpret_cast<float*>(reinterpret_cast<char*>(m_output) + (m_height - 1 - j) * m_outputStride) + 3 * i;
+        const float scale = 1.0f / GetSampleCount(i, j);
+        const Vector3 colorSum = GetColorSum(i, j);
+        pixel[0] = colorSum.X() * scale;
+        pixel[1] = colorSum.Y() * scale;
+        pixel[2] = colorSum.Z() * scale;
+    }
+    
+    int m_width;
+    int m_height;
+    int m_blocksPerRow;
+    FrameBufferFormat m_format;
+    std::unique_ptr<Vector3[]> m_colorSum;                  // Float32
+    std::unique_ptr<int[]> m_sampleCount;                   // Float32
+    std::unique_ptr<float[]> m_variance;                    // Float32
+    std::unique_ptr<HalfColor[]> m_halfColor;               // Half
+    std::unique_ptr<uint32_t[]> m_sharedExponentColor;      // RGB9E5
+    std::unique_ptr<uint16_t[]> m_colorExtension;           // Half and RGB9E5, see PackHalf()
+    std::unique_ptr<uint16_t[]> m_shortSampleCount;         // Half and RGB9E5
+    std::unique_ptr<uint16_t[]> m_halfDeviation;            // Half and RGB9E5, half float square root of the variance
+    std::vector<std::unique_ptr<Vector3[]>> m_splatLayers;
+    float* m_output;
+    size_t m_outputStride;
+};
+
+#endif /* FrameBuffer_h */
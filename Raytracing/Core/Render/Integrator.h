@@ -0,0 +1,277 @@
+//
+//  Integrator.h
+//  Raytracing
+//
+//  Path tracing integrator shared by every render mode.
+//
+
+#ifndef Integrator_h
+#define Integrator_h
+
+#include "../Math/Hittable.h"
+#include "../Math/Material.h"
+#include "PathGuide.h"
+#include "../Accel/LightTree.h"
+#include "../Texture/EnvironmentMap.h"
+#include "../../System/Profiler.h"
+
+// Default for RenderSettings::m_diffuseInHemisphere.
+#ifndef DIFFUSE_IN_HEMISPHERE
+#define DIFFUSE_IN_HEMISPHERE 0
+#endif
+
+inline Vector3 GetBackground(const Ray& r)
+{
+    Vector3 unit_direction = unit_vector(r.GetDirection());
+    float t = 0.5 * (unit_direction.Y() + 1.0);
+    return (1.0 - t) * Vector3(1.0, 1.0, 1.0) + t * Vector3(0.5, 0.7, 1.0);
+}
+
+// Optional state shared by every path of a pass.
+struct PathContext
+{
+    PathGuide*              m_pathGuide = nullptr;      // learns from and guides rough bounces
+    const LightTree*        m_lightTree = nullptr;      // enables next event estimation
+    const EnvironmentMap*   m_environment = nullptr;    // replaces the gradient sky when set
+    bool                    m_bSampleEnvironment = true;    // next event estimation towards m_environment
+    float                   m_skyIntensity = 1.0f;
+    
+    bool SamplesEnvironment() const { return m_environment && m_bSampleEnvironment; }
+};
+
+// The last rough vertex of a path and the pdf its scattering strategy had
+// for the direction that left it. Emission found along that direction is
+// weighted against the chance the light tree had to sample it.
+struct PathVertex
+{
+    Vector3 m_point;
+    Vector3 m_normal;
+    double  m_pdf;
+};
+
+inline double PowerHeuristic(double pdf, double otherPdf)
+{
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+inline Vector3 GetSkyRadiance(const Ray& r, const PathContext* context)
+{
+    if (!context)
+    {
+        return GetBackground(r);
+    }
+    return context->m_skyIntensity * (context->m_environment ? context->m_environment->Lookup(r.GetDirection()) : GetBackground(r));
+}
+
+template<bool kDiffuseInHemisphere = false>
+Vector3 GetColor(const Ray& r, const Hittable& world, int depth,
+                 const PathContext* context = nullptr, const PathVertex* from = nullptr);
+
+// Solid angle pdf of scattering into direction: the BSDF's own pdf, mixed
+// with the guide's when one is in use.
+inline double GetScatterPdf(const Ray& r, const HitRecord& hitRec, const Vector3& direction,
+                            const DirectionalDistribution* distribution, double guideFraction)
+{
+    double pdf = (1 - guideFraction) * hitRec.m_material->Pdf(r, hitRec, direction);
+    if (distribution)
+    {
+        pdf += guideFraction * distribution->Pdf(direction);
+    }
+    return pdf;
+}
+
+// Next event estimation: one light picked by the light tree, one direction
+// towards it and a shadow ray, MIS-weighted against scattering.
+inline Vector3 SampleDirect(const Ray& r, const HitRecord& hitRec, const Hittable& world, const LightTree& lightTree,
+                            const DirectionalDistribution* distribution, double guideFraction)
+{
+    int light;
+    double pmf;
+    if (!lightTree.Sample(hitRec.m_point, hitRec.m_normal, RandomDouble(), light, pmf))
+    {
+        return Vector3::GetZero();
+    }
+    
+    Vector3 direction;
+    double directionPdf;
+    float distance;
+    if (!LightTree::SampleSphere(hitRec.m_point, lightTree.GetLight(light), direction, directionPdf, distance))
+    {
+        return Vector3::GetZero();
+    }
+    
+    Vector3 f = hitRec.m_material->Evaluate(r, hitRec, direction);
+    double cosine = fabs(dot(direction, hitRec.m_normal));
+    if (Luminance(f) <= 0 || cosine <= 0)
+    {
+        return Vector3::GetZero();
+    }
+    
+    Profiler::CountRays(1);
+    if (world.occluded(Ray(hitRec.m_point, direction), 0.001, distance * 0.999f))
+    {
+        return Vector3::GetZero();
+    }
+    
+    double lightPdf = pmf * directionPdf;
+    double weight = PowerHeuristic(lightPdf, GetScatterPdf(r, hitRec, direction, distribution, guideFraction));
+    return f * lightTree.GetLight(light).m_radiance * (cosine * weight / lightPdf);
+}
+
+// Next event estimation towards the environment map: one direction drawn in
+// proportion to its radiance and a shadow ray to infinity.
+inline Vector3 SampleEnvironment(const Ray& r, const HitRecord& hitRec, const Hittable& world, const PathContext& context,
+                                 const DirectionalDistribution* distribution, double guideFraction)
+{
+    Vector3 direction;
+    double environmentPdf;
+    if (!context.m_environment->Sample(RandomDouble(), RandomDouble(), direction, environmentPdf))
+    {
+        return Vector3::GetZero();
+    }
+    
+    Vector3 f = hitRec.m_material->Evaluate(r, hitRec, direction);
+    double cosine = fabs(dot(direction, hitRec.m_normal));
+    if (Luminance(f) <= 0 || cosine <= 0)
+    {
+        return Vector3::GetZero();
+    }
+    
+    Profiler::CountRays(1);
+    if (world.occluded(Ray(hitRec.m_point, direction), 0.001, s_kInfinity))
+    {
+        return Vector3::GetZero();
+    }
+    
+    double weight = PowerHeuristic(environmentPdf, GetScatterPdf(r, hitRec, direction, distribution, guideFraction));
+    Vector3 radiance = context.m_skyIntensity * context.m_environment->Lookup(direction);
+    return f * radiance * (cosine * weight / environmentPdf);
+}
+
+// Continues a path from a non-specular hit. Adds direct light from the light
+// tree and the environment map when there are any, and picks the next direction by one-sample MIS
+// between the BSDF and the path guide's learned incident radiance, which is
+// then taught the radiance found along it.
+template<bool kDiffuseInHemisphere>
+Vector3 ShadeRough(const Ray& r, HitRecord& hitRec, const Hittable& world, int depth, const PathContext& context)
+{
+    const Material& material = *hitRec.m_material;
+    PathGuide* guide = context.m_pathGuide;
+    double guideFraction = 0.0;
+    const DirectionalDistribution* distribution =
+        guide && guide->IsTrained() ? &guide->GetDistribution(hitRec.m_point, hitRec.m_normal, guideFraction) : nullptr;
+    
+    Vector3 color = Vector3::GetZero();
+    if (context.m_lightTree)
+    {
+        color = SampleDirect(r, hitRec, world, *context.m_lightTree, distribution, guideFraction);
+    }
+    if (context.SamplesEnvironment())
+    {
+        color += SampleEnvironment(r, hitRec, world, context, distribution, guideFraction);
+    }
+    
+    Vector3 direction;
+    if (distribution && RandomDouble() < guideFraction)
+    {
+        direction = distribution->Sample();
+    }
+    else
+    {
+        BSDFSample sample;
+        if (!material.Sample(r, hitRec, sample))
+        {
+            return color;
+        }
+        direction = unit_vector(sample.m_direction);
+    }
+    
+    double bsdfPdf = material.Pdf(r, hitRec, direction);
+    double pdf = (1 - guideFraction) * bsdfPdf + (distribution ? guideFraction * distribution->Pdf(direction) : 0.0);
+    double cosine = fabs(dot(direction, hitRec.m_normal));
+    Vector3 f = material.Evaluate(r, hitRec, direction);
+    if (pdf <= 0 || cosine <= 0 || (f.X() <= 0 && f.Y() <= 0 && f.Z() <= 0))
+    {
+        return color;
+    }
+    
+    Ray scattered(hitRec.m_point, direction);
+    scattered.SetCone(hitRec.m_footprint, Material::s_kRoughConeSpread);
+    PathVertex vertex = { hitRec.m_point, hitRec.m_normal, pdf };
+    Vector3 incident = GetColor<kDiffuseInHemisphere>(scattered, world, depth - 1, &context,
+                                                      context.m_lightTree || context.SamplesEnvironment() ? &vertex : nullptr);
+    if (guide)
+    {
+        guide->Record(hitRec.m_point, hitRec.m_normal, direction, Luminance(incident) * float(cosine),
+                      Luminance(f * incident) * float(cosine), pdf, bsdfPdf);
+    }
+    return color + f * (cosine / pdf) * incident;
+}
+
+// Radiance leaving a known hit point back along r. Split out of GetColor so
+// packet tracing can continue paths from hits it found itself.
+// kDiffuseInHemisphere replaces every material with a uniform hemisphere
+// bounce of 50% reflectance, useful to debug geometry and lighting.
+template<bool kDiffuseInHemisphere = false>
+Vector3 ShadeHit(const Ray& r, HitRecord& hitRec, const Hittable& world, int depth,
+                 const PathContext* context = nullptr, const PathVertex* from = nullptr)
+{
+    if (kDiffuseInHemisphere)
+    {
+        Vector3 target = hitRec.m_point + Vector3::RandomInHemiSphere(hitRec.m_normal);
+        return 0.5 * GetColor<kDiffuseInHemisphere>(Ray(hitRec.m_point, target - hitRec.m_point), world, depth - 1, context);
+    }
+    
+    // Emission the light tree could also have sampled from the previous
+    // vertex only gets its MIS share.
+    Vector3 emitted = hitRec.m_material->Emitted(hitRec);
+    if (from && context->m_lightTree && Luminance(emitted) > 0)
+    {
+        int light = context->m_lightTree->FindLight(hitRec.m_object);
+        if (light >= 0)
+        {
+            double lightPdf = context->m_lightTree->Pmf(from->m_point, from->m_normal, light) *
+                              LightTree::SpherePdf(from->m_point, context->m_lightTree->GetLight(light));
+            emitted *= float(PowerHeuristic(from->m_pdf, lightPdf));
+        }
+    }
+    
+    if (context && (context->m_pathGuide || context->m_lightTree || context->SamplesEnvironment()) &&
+        !hitRec.m_material->IsSpecular())
+    {
+        return emitted + ShadeRough<kDiffuseInHemisphere>(r, hitRec, world, depth, *context);
+    }
+    
+    Ray scattered;
+    Vector3 attenuation = Vector3::GetZero();
+    if (hitRec.m_material->Scatter(r, hitRec, attenuation, scattered))
+        return emitted + attenuation * GetColor<kDiffuseInHemisphere>(scattered, world, depth - 1, context);
+    return emitted + attenuation;
+}
+
+template<bool kDiffuseInHemisphere>
+Vector3 GetColor(const Ray& r, const Hittable& world, int depth, const PathContext* context, const PathVertex* from)
+{
+    if (depth <= 0)
+    {
+        return Vector3(0.f, 0.f, 0.f);
+    }
+    
+    HitRecord hitRec;
+    Profiler::CountRays(1);
+    if (world.hit(r, 0.001, s_kInfinity, hitRec))
+    {
+        return ShadeHit<kDiffuseInHemisphere>(r, hitRec, world, depth, context, from);
+    }
+    
+    // Like emission, sky light the environment sampling could have found
+    // from the previous vertex only gets its MIS share.
+    Vector3 sky = GetSkyRadiance(r, context);
+    if (from && context->SamplesEnvironment())
+    {
+        sky *= float(PowerHeuristic(from->m_pdf, context->m_environment->Pdf(unit_vector(r.GetDirection()))));
+    }
+    return sky;
+}
+
+#endif /* Integrator_h */
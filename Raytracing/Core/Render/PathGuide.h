@@ -0,0 +1,377 @@
+//
+//  PathGuide.h
+//  Raytracing
+//
+//  Path guiding in the spirit of "Practical Path Guiding" (Mueller et al.).
+//  A spatial binary tree over the scene holds, per leaf, a directional
+//  histogram of incident radiance. Passes record radiance into the building
+//  histograms with atomic adds; Update() between passes turns them into the
+//  sampling distributions used by the next pass and refines the tree where
+//  many samples landed. The directional part is a fixed equal-area grid
+//  rather than an adaptive quadtree, and each leaf keeps one per dominant
+//  normal axis so that surfaces facing apart (sides of a small sphere) do
+//  not learn each other's light from below their horizon. The probability
+//  of sampling the guide rather than the BSDF is learned alongside: each
+//  histogram picks, from a few candidates, the fraction whose estimator had
+//  the lowest second moment over the last pass.
+//
+
+#ifndef PathGuide_h
+#define PathGuide_h
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "../Math/AABB.h"
+#include "../Math/Hittable.h"
+#include "../Math/Utils.h"
+#include "../Math/Vector.h"
+
+struct PathGuideSettings
+{
+    int m_directionalResolution = 16;   // bins along cos(theta) and phi
+    int m_splitThreshold = 4000;        // samples per leaf, scaled by sqrt(2^iteration)
+    int m_maxLeaves = 4096;
+    double m_guideFraction = 0.5;       // probability of sampling the guide instead of the BSDF, until learned
+    bool m_learnGuideFraction = true;   // per leaf and normal bin, see PathGuide::Update()
+    double m_uniformFraction = 0.1;     // uniform share mixed into learned distributions
+};
+
+// Piecewise-constant density over the sphere, on the (cos(theta), phi)
+// mapping where every bin covers the same solid angle.
+class DirectionalDistribution
+{
+public:
+    DirectionalDistribution(int resolution) :
+    m_resolution(resolution), m_density(resolution * resolution, 1.0f / (4 * s_kPI)), m_cdf(resolution * resolution)
+    {
+        BuildCdf();
+    }
+    
+    int GetBin(const Vector3& direction) const
+    {
+        double cosTheta = Clamp(direction.Z(), -1.0, 1.0);
+        double phi = atan2(direction.Y(), direction.X());
+        phi = phi < 0 ? phi + 2 * s_kPI : phi;
+        int row = std::min(int((cosTheta + 1) * 0.5 * m_resolution), m_resolution - 1);
+        int column = std::min(int(phi / (2 * s_kPI) * m_resolution), m_resolution - 1);
+        return row * m_resolution + column;
+    }
+    
+    double Pdf(const Vector3& direction) const { return m_density[GetBin(direction)]; }
+    
+    Vector3 Sample() const
+    {
+        double u = RandomDouble();
+        int bin = int(std::upper_bound(m_cdf.begin(), m_cdf.end(), float(u)) - m_cdf.begin());
+        bin = std::min(bin, int(m_cdf.size()) - 1);
+        double cosTheta = -1 + 2 * (bin / m_resolution + RandomDouble()) / m_resolution;
+        double phi = 2 * s_kPI * (bin % m_resolution + RandomDouble()) / m_resolution;
+        double sinTheta = sqrt(ffmax(0, 1 - cosTheta * cosTheta));
+        return Vector3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+    }
+    
+    // Makes the density proportional to the given bin weights, mixed with a
+    // uniform share so no direction becomes impossible to sample.
+    void SetFromWeights(const std::vector<float>& weights, double uniformFraction)
+    {
+        double total = 0;
+        for (float weight : weights)
+        {
+            total += weight;
+        }
+        if (total <= 0)
+        {
+            return;
+        }
+        
+        const double binSolidAngle = 4 * s_kPI / weights.size();
+        for (size_t bin = 0; bin < weights.size(); ++bin)
+        {
+            double probability = (1 - uniformFraction) * weights[bin] / total + uniformFraction / weights.size();
+            m_density[bin] = float(probability / binSolidAngle);
+        }
+        BuildCdf();
+    }
+
+private:
+    void BuildCdf()
+    {
+        const double binSolidAngle = 4 * s_kPI / m_density.size();
+        double sum = 0;
+        for (size_t bin = 0; bin < m_density.size(); ++bin)
+        {
+            sum += m_density[bin] * binSolidAngle;
+            m_cdf[bin] = float(sum);
+        }
+    }
+    
+    int m_resolution;
+    std::vector<float> m_density;
+    std::vector<float> m_cdf;
+};
+
+class PathGuide
+{
+public:
+    // Positions outside bounds use the nearest leaf.
+    PathGuide(const AABB& bounds, const PathGuideSettings& settings = PathGuideSettings()) :
+    m_bounds(bounds), m_settings(settings), m_iteration(0), m_bTrained(false)
+    {
+        m_nodes.push_back(Node{ -1, 0, 0 });
+        m_leaves.emplace_back(new Leaf(settings.m_directionalResolution, float(settings.m_guideFraction)));
+    }
+    
+    // Bounds for a guide over a scene: the objects at most maxObjectExtent
+    // across with a 10% margin, clipped to the whole scene. Huge objects such
+    // as a ground sphere then only count where the others are, instead of
+    // folding every position into a few leaves of a tree sized to them.
+    // Falls back to the whole scene when every object is huge.
+    static AABB GetSceneBounds(const std::vector<shared_ptr<Hittable>>& objects, float maxObjectExtent = 100.0f)
+    {
+        AABB scene;
+        AABB bounded;
+        bool bAnyBounded = false;
+        for (const auto& object : objects)
+        {
+            AABB box;
+            if (!object->boundingBox(box))
+            {
+                continue;
+            }
+            scene.Grow(box);
+            Vector3 extent = box.Extent();
+            if (ffmax(extent.X(), ffmax(extent.Y(), extent.Z())) <= maxObjectExtent)
+            {
+                bounded.Grow(box);
+                bAnyBounded = true;
+            }
+        }
+        if (!bAnyBounded)
+        {
+            return scene;
+        }
+        
+        Vector3 low = bounded.Min() - 0.1f * bounded.Extent();
+        Vector3 high = bounded.Max() + 0.1f * bounded.Extent();
+        return AABB(Vector3(ffmax(low.X(), scene.Min().X()), ffmax(low.Y(), scene.Min().Y()), ffmax(low.Z(), scene.Min().Z())),
+                    Vector3(ffmin(high.X(), scene.Max().X()), ffmin(high.Y(), scene.Max().Y()), ffmin(high.Z(), scene.Max().Z())));
+    }
+    
+    bool IsTrained() const { return m_bTrained; }
+    size_t GetLeafCount() const { return m_leaves.size(); }
+    
+    // Learned distribution at a point and the probability of sampling it
+    // rather than the BSDF there; only valid after the first Update().
+    const DirectionalDistribution& GetDistribution(const Vector3& point, const Vector3& normal, double& guideFraction_out) const
+    {
+        const Leaf& leaf = *m_leaves[FindLeaf(point)];
+        const int normalBin = GetNormalBin(normal);
+        guideFraction_out = leaf.m_guideFractions[normalBin];
+        return leaf.m_sampling[normalBin];
+    }
+    
+    // Records an estimate of incident radiance from direction, sampled with
+    // the given pdf, of which bsdfPdf is the BSDF's own before mixing.
+    // integrand is the luminance the estimate was taken of, BSDF and cosine
+    // included, and teaches the guide fraction. Safe to call from any number
+    // of threads during a pass.
+    void Record(const Vector3& point, const Vector3& normal, const Vector3& direction, float radiance, float integrand,
+                double pdf, double bsdfPdf)
+    {
+        if (!(radiance >= 0) || pdf <= 0)
+        {
+            return;
+        }
+        
+        Leaf& leaf = *m_leaves[FindLeaf(point)];
+        const int normalBin = GetNormalBin(normal);
+        const DirectionalDistribution& distribution = leaf.m_sampling[normalBin];
+        AtomicAdd(leaf.m_building[normalBin * leaf.m_numBins + distribution.GetBin(direction)], float(radiance / pdf));
+        leaf.m_sampleCount.fetch_add(1, std::memory_order_relaxed);
+        
+        if (!m_settings.m_learnGuideFraction || !m_bTrained)
+        {
+            return;
+        }
+        
+        // Each candidate's second moment, integrand^2 / candidatePdf, from a
+        // sample drawn with pdf. The guide's pdf is never zero, so neither is
+        // a candidate's.
+        leaf.m_fractionSampleCounts[normalBin].fetch_add(1, std::memory_order_relaxed);
+        if (integrand > 0)
+        {
+            const double guidePdf = distribution.Pdf(direction);
+            for (int candidate = 0; candidate < s_kNumGuideFractions; ++candidate)
+            {
+                double candidatePdf = s_kGuideFractions[candidate] * guidePdf + (1 - s_kGuideFractions[candidate]) * bsdfPdf;
+                AtomicAdd(leaf.m_secondMoments[normalBin * s_kNumGuideFractions + candidate],
+                          float(double(integrand) * integrand / (candidatePdf * pdf)));
+            }
+        }
+    }
+    
+    // Call between passes, with no pass running. Turns the recorded radiance
+    // into the distributions sampled by the next pass and, where enough
+    // samples landed, picks the guide fraction with the lowest second
+    // moment. Then splits leaves that received more samples than the
+    // threshold for this iteration.
+    void Update()
+    {
+        std::vector<float> weights(m_settings.m_directionalResolution * m_settings.m_directionalResolution);
+        for (auto& leaf : m_leaves)
+        {
+            for (int normalBin = 0; normalBin < s_kNormalBins; ++normalBin)
+            {
+                for (size_t bin = 0; bin < weights.size(); ++bin)
+                {
+                    weights[bin] = leaf->m_building[normalBin * leaf->m_numBins + bin].load();
+                }
+                leaf->m_sampling[normalBin].SetFromWeights(weights, m_settings.m_uniformFraction);
+                
+                const std::atomic<float>* moments = &leaf->m_secondMoments[normalBin * s_kNumGuideFractions];
+                if (leaf->m_fractionSampleCounts[normalBin].load() >= s_kMinFractionSamples && moments[0].load() > 0)
+                {
+                    int best = 0;
+                    for (int candidate = 1; candidate < s_kNumGuideFractions; ++candidate)
+                    {
+                        best = moments[candidate].load() < moments[best].load() ? candidate : best;
+                    }
+                    leaf->m_guideFractions[normalBin] = s_kGuideFractions[best];
+                }
+            }
+        }
+        
+        const double threshold = m_settings.m_splitThreshold * sqrt(pow(2.0, m_iteration));
+        const size_t numNodes = m_nodes.size();
+        for (size_t node = 0; node < numNodes; ++node)
+        {
+            if (m_nodes[node].m_firstChild < 0)
+            {
+                Split(int(node), m_leaves[m_nodes[node].m_leaf]->m_sampleCount.load(), threshold);
+            }
+        }
+        
+        for (auto& leaf : m_leaves)
+        {
+            leaf->Reset();
+        }
+        m_iteration++;
+        m_bTrained = true;
+    }
+
+private:
+    static const int s_kNormalBins = 6;
+    static const int s_kNumGuideFractions = 5;
+    static constexpr float s_kGuideFractions[s_kNumGuideFractions] = { 0.1f, 0.3f, 0.5f, 0.7f, 0.9f };
+    static const int s_kMinFractionSamples = 64;   // per normal bin and pass before the fraction changes
+    
+    static void AtomicAdd(std::atomic<float>& value, float addend)
+    {
+        float current = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(current, current + addend, std::memory_order_relaxed)) {}
+    }
+    
+    static int GetNormalBin(const Vector3& normal)
+    {
+        float x = fabs(normal.X()), y = fabs(normal.Y()), z = fabs(normal.Z());
+        int axis = (x > y && x > z) ? 0 : (y > z ? 1 : 2);
+        return 2 * axis + (normal.m_value[axis] < 0 ? 1 : 0);
+    }
+    
+    struct Node
+    {
+        int m_firstChild;   // children are adjacent; -1 for leaves
+        int m_leaf;
+        int m_depth;        // picks the split axis
+    };
+    
+    struct Leaf
+    {
+        Leaf(int resolution, float guideFraction) :
+        m_sampling(s_kNormalBins, DirectionalDistribution(resolution)),
+        m_building(new std::atomic<float>[s_kNormalBins * resolution * resolution]), m_numBins(resolution * resolution),
+        m_secondMoments(new std::atomic<float>[s_kNormalBins * s_kNumGuideFractions]),
+        m_fractionSampleCounts(new std::atomic<uint32_t>[s_kNormalBins])
+        {
+            std::fill(m_guideFractions, m_guideFractions + s_kNormalBins, guideFraction);
+            Reset();
+        }
+        
+        void Reset()
+        {
+            for (int bin = 0; bin < s_kNormalBins * m_numBins; ++bin)
+            {
+                m_building[bin].store(0.0f);
+            }
+            for (int moment = 0; moment < s_kNormalBins * s_kNumGuideFractions; ++moment)
+            {
+                m_secondMoments[moment].store(0.0f);
+            }
+            for (int normalBin = 0; normalBin < s_kNormalBins; ++normalBin)
+            {
+                m_fractionSampleCounts[normalBin].store(0);
+            }
+            m_sampleCount.store(0);
+        }
+        
+        std::vector<DirectionalDistribution> m_sampling;    // per normal bin
+        std::unique_ptr<std::atomic<float>[]> m_building;   // s_kNormalBins x m_numBins
+        int m_numBins;
+        std::atomic<uint32_t> m_sampleCount;
+        float m_guideFractions[s_kNormalBins];
+        std::unique_ptr<std::atomic<float>[]> m_secondMoments;          // s_kNormalBins x s_kNumGuideFractions
+        std::unique_ptr<std::atomic<uint32_t>[]> m_fractionSampleCounts;    // per normal bin
+    };
+    
+    // Halves the node, assuming its samples were spread evenly, until each
+    // part is under the threshold. Children start from their parent's
+    // distributions and guide fractions.
+    void Split(int node, double samples, double threshold)
+    {
+        if (samples <= threshold || m_leaves.size() >= size_t(m_settings.m_maxLeaves))
+        {
+            return;
+        }
+        
+        const int parentLeaf = m_nodes[node].m_leaf;
+        const int depth = m_nodes[node].m_depth + 1;
+        const int firstChild = int(m_nodes.size());
+        m_nodes[node].m_firstChild = firstChild;
+        m_nodes.push_back(Node{ -1, parentLeaf, depth });
+        m_nodes.push_back(Node{ -1, int(m_leaves.size()), depth });
+        m_leaves.emplace_back(new Leaf(m_settings.m_directionalResolution, float(m_settings.m_guideFraction)));
+        m_leaves.back()->m_sampling = m_leaves[parentLeaf]->m_sampling;
+        std::copy(m_leaves[parentLeaf]->m_guideFractions, m_leaves[parentLeaf]->m_guideFractions + s_kNormalBins,
+                  m_leaves.back()->m_guideFractions);
+        
+        Split(firstChild, samples / 2, threshold);
+        Split(firstChild + 1, samples / 2, threshold);
+    }
+    
+    int FindLeaf(const Vector3& point) const
+    {
+        Vector3 minimum = m_bounds.Min();
+        Vector3 maximum = m_bounds.Max();
+        int node = 0;
+        while (m_nodes[node].m_firstChild >= 0)
+        {
+            int axis = m_nodes[node].m_depth % 3;
+            float middle = 0.5f * (minimum.m_value[axis] + maximum.m_value[axis]);
+            bool bUpper = point.m_value[axis] >= middle;
+            (bUpper ? minimum : maximum).m_value[axis] = middle;
+            node = m_nodes[node].m_firstChild + (bUpper ? 1 : 0);
+        }
+        return m_nodes[node].m_leaf;
+    }
+    
+    AABB                                m_bounds;
+    PathGuideSettings                   m_settings;
+    std::vector<Node>                   m_nodes;
+    std::vector<std::unique_ptr<Leaf>>  m_leaves;
+    int                                 m_iteration;
+    bool                                m_bTrained;
+};
+
+#endif /* PathGuide_h */
@@ -0,0 +1,115 @@
+//
+//  RayQuery.h
+//  Raytracing
+//
+//  Closest-hit queries for caller-made rays, for work such as baking that
+//  does not start from the camera. A buffer of rays is cut into chunks that
+//  the worker threads trace with Hittable::hitBatch(), so the queries go
+//  through the same intersection code as rendering.
+//
+
+#ifndef RayQuery_h
+#define RayQuery_h
+
+#include <algorithm>
+#include "../Math/Hittable.h"
+#include "../Math/Material.h"
+#include "../../System/Arena.h"
+#include "../../System/ThreadPool.h"
+
+struct RayQuery
+{
+    Vector3 m_origin;
+    Vector3 m_direction;        // need not be unit length; t is measured in its units
+    float   m_tMin;
+    float   m_tMax;
+};
+
+struct RayQueryHit
+{
+    float           m_t;            // infinity on a miss
+    Vector3         m_normal;       // outward unit surface normal
+    const Material* m_material;     // nullptr on a miss
+    bool            m_bFrontFace;   // the ray arrived from the outside
+};
+
+class BatchTracer
+{
+public:
+    // Rays per job; large enough for hitBatch() to keep its lanes full.
+    static const int s_kChunkSize = 4096;
+    
+    BatchTracer(ThreadPool* threadPool) : m_threadPool(threadPool) {}
+    
+    // Traces count rays and returns when every hit is filled in. world must
+    // not change meanwhile.
+    void Trace(const Hittable& world, const RayQuery* queries, int count, RayQueryHit* hits)
+    {
+        for (int first = 0; first < count; first += s_kChunkSize)
+        {
+            const int chunkCount = std::min(s_kChunkSize, count - first);
+            auto job = [&world, queries, hits, first, chunkCount]()
+            {
+                TraceChunk(world, queries + first, chunkCount, hits + first);
+            };
+            
+            if (m_threadPool)
+            {
+                m_threadPool->QueueJob(job);
+            }
+            else
+            {
+                job();
+            }
+        }
+        
+        if (m_threadPool)
+        {
+            m_threadPool->WaitUntilDone();
+        }
+    }
+    
+    static void TraceChunk(const Hittable& world, const RayQuery* queries, int count, RayQueryHit* hits)
+    {
+        // hitBatch() takes one t_min for all rays, so each ray starts at its
+        // own m_tMin and distances are shifted back afterwards.
+        MemoryArena& scratch = GetScratchArena();
+        Ray* rays = scratch.AllocateArray<Ray>(count);
+        float* t = scratch.AllocateArray<float>(count);
+        const Hittable** objects = scratch.AllocateArray<const Hittable*>(count);
+        for (int k = 0; k < count; ++k)
+        {
+            const RayQuery& query = queries[k];
+            rays[k] = Ray(query.m_origin + query.m_tMin * query.m_direction, query.m_direction);
+            t[k] = query.m_tMax - query.m_tMin;
+            objects[k] = nullptr;
+        }
+        world.hitBatch(rays, count, 0.0f, t, objects);
+        
+        for (int k = 0; k < count; ++k)
+        {
+            RayQueryHit& hit = hits[k];
+            HitRecord rec;
+            if (objects[k] && objects[k]->hit(rays[k], 0.0f, s_kInfinity, rec))
+            {
+                hit.m_t = rec.m_t + queries[k].m_tMin;
+                hit.m_normal = rec.m_frontFace ? rec.m_normal : -rec.m_normal;
+                hit.m_material = rec.m_material;
+                hit.m_bFrontFace = rec.m_frontFace;
+            }
+            else
+            {
+                hit.m_t = float(s_kInfinity);
+                hit.m_normal = Vector3::GetZero();
+                hit.m_material = nullptr;
+                hit.m_bFrontFace = false;
+            }
+        }
+        scratch.Reset();
+    }
+
+private:
+    ThreadPool* m_threadPool;
+};
+
+#endif /* RayQuery_h */
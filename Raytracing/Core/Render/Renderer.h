@@ -0,0 +1,663 @@
+//
+//  Renderer.h
+//  Raytracing
+//
+//  Splits a frame into tiles and traces them on the thread pool. Passes can
+//  be cancelled between rows through a CancelToken.
+//
+
+#ifndef Renderer_h
+#define Renderer_h
+
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include "FrameBuffer.h"
+#include "Integrator.h"
+#include "Bidirectional.h"
+#include "Sampler.h"
+#include "../Camera/Camera.h"
+#include "../../System/Arena.h"
+#include "../../System/ThreadPool.h"
+
+enum class IntegratorType
+{
+    Path,           // unidirectional, with next event estimation when there is a light tree
+    Bidirectional   // see Bidirectional.h; ignores m_pathGuide and m_diffuseInHemisphere
+};
+
+struct RenderSettings
+{
+    int m_samplesPerPixel = 100;
+    int m_maxDepth = 50;
+    int m_tileSize = 16;
+    SamplerType m_sampler = SamplerType::Random;
+    bool m_diffuseInHemisphere = DIFFUSE_IN_HEMISPHERE;
+    bool m_primaryPackets = true;   // trace camera rays as 8x8 packets
+    PathGuide* m_pathGuide = nullptr;   // learns from and guides diffuse bounces when set
+    const LightTree* m_lightTree = nullptr; // samples emitters directly when set
+    const EnvironmentMap* m_environment = nullptr;  // lat-long sky, scaled by m_skyIntensity
+    bool m_sampleEnvironment = true;    // importance sample m_environment at rough hits
+    float m_skyIntensity = 1.0f;
+    IntegratorType m_integrator = IntegratorType::Path;
+    bool m_interleavedTraversal = false;    // trace a tile's paths bounce by bounce with Hittable::hitBatch()
+    
+    PathContext GetPathContext() const
+    {
+        PathContext context;
+        context.m_pathGuide = m_pathGuide;
+        context.m_lightTree = m_lightTree && !m_lightTree->IsEmpty() ? m_lightTree : nullptr;
+        context.m_environment = m_environment && !m_environment->IsEmpty() ? m_environment : nullptr;
+        context.m_bSampleEnvironment = m_sampleEnvironment;
+        context.m_skyIntensity = m_skyIntensity;
+        return context;
+    }
+};
+
+// A pass is valid while the generation it started with is still current.
+class CancelToken
+{
+public:
+    CancelToken() : m_generation(0) {}
+    
+    uint64_t Current() const { return m_generation.load(); }
+    void Cancel() { m_generation.fetch_add(1); }
+    bool IsCancelled(uint64_t generation) const { return m_generation.load(std::memory_order_relaxed) != generation; }
+    
+private:
+    std::atomic<uint64_t> m_generation;
+};
+
+// One camera of a multi-view batch and the buffer its samples go to.
+struct RenderView
+{
+    Camera          m_camera;
+    FrameBuffer*    m_frameBuffer;
+};
+
+typedef void (*TileKernel)(const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                           FrameBuffer& frameBuffer, int tileX, int tileY,
+                           const CancelToken* cancelToken, uint64_t generation);
+
+class Renderer
+{
+public:
+    // A null pool renders every tile on the calling thread.
+    Renderer(ThreadPool* threadPool) : m_threadPool(threadPool), m_tileCount(0), m_tilesDone(0) {}
+    
+    // Optional per-NUMA-node copies of the world, indexed by pool node. Tiles
+    // then trace the copy local to the worker instead of the world passed to
+    // RenderPass. Replicas must be identical and outlive the renderer's use.
+    void SetSceneReplicas(const std::vector<const Hittable*>& replicas) { m_replicas = replicas; }
+    
+    // Allocates the frame buffer and clears each band of tile rows from the
+    // node that will render it, so its pages are first touched there.
+    void AllocateFrameBuffer(FrameBuffer& frameBuffer, int width, int height, int tileSize)
+    {
+        frameBuffer.Allocate(width, height);
+        const int nodeCount = GetNodeCount();
+        for (int tileY = 0; tileY < height; tileY += tileSize)
+        {
+            auto job = [&frameBuffer, tileY, tileSize, height]()
+            {
+                frameBuffer.ClearRows(tileY, std::min(tileY + tileSize, height));
+            };
+            
+            if (m_threadPool)
+            {
+                m_threadPool->QueueJob(job, GetBandNode(tileY, height, tileSize, nodeCount), true);
+            }
+            else
+            {
+                job();
+            }
+        }
+        
+        if (m_threadPool)
+        {
+            m_threadPool->WaitUntilDone();
+        }
+    }
+    
+    // Adds settings.m_samplesPerPixel samples to every pixel of the frame
+    // buffer. Returns false if the pass was cancelled, in which case the
+    // tiles that finished keep their samples and the others are untouched,
+    // except with the bidirectional integrator, where the pass adds nothing.
+    bool RenderPass(const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                    FrameBuffer& frameBuffer, const CancelToken* cancelToken = nullptr)
+    {
+        uint64_t generation = cancelToken ? cancelToken->Current() : 0;
+        m_tilesDone.store(0);
+        m_tileCount.store(GetTileCount(frameBuffer, settings.m_tileSize));
+        PrepareSplats(settings, frameBuffer);
+        QueueTiles(world, camera, settings, frameBuffer, cancelToken, generation);
+        
+        if (m_threadPool)
+        {
+            m_threadPool->WaitUntilDone();
+        }
+        
+        const bool bCancelled = cancelToken && cancelToken->IsCancelled(generation);
+        ResolveSplats(settings, frameBuffer, bCancelled);
+        return !bCancelled;
+    }
+    
+    // Renders a pass of every view of the same world. All tiles of all views
+    // are queued before waiting, so workers move on to the next view instead
+    // of idling while the last tiles of a frame finish. The views must stay
+    // alive until this returns.
+    bool RenderViews(const Hittable& world, const std::vector<RenderView>& views, const RenderSettings& settings,
+                     const CancelToken* cancelToken = nullptr)
+    {
+        uint64_t generation = cancelToken ? cancelToken->Current() : 0;
+        int tileCount = 0;
+        for (const RenderView& view : views)
+        {
+            tileCount += GetTileCount(*view.m_frameBuffer, settings.m_tileSize);
+        }
+        m_tilesDone.store(0);
+        m_tileCount.store(tileCount);
+        
+        for (const RenderView& view : views)
+        {
+            PrepareSplats(settings, *view.m_frameBuffer);
+            QueueTiles(world, view.m_camera, settings, *view.m_frameBuffer, cancelToken, generation);
+        }
+        
+        if (m_threadPool)
+        {
+            m_threadPool->WaitUntilDone();
+        }
+        
+        const bool bCancelled = cancelToken && cancelToken->IsCancelled(generation);
+        for (const RenderView& view : views)
+        {
+            ResolveSplats(settings, *view.m_frameBuffer, bCancelled);
+        }
+        return !bCancelled;
+    }
+    
+    // Fraction of the tiles of the current or last pass that have finished.
+    // Safe to call from any thread while a pass is running.
+    float GetProgress() const
+    {
+        const int tileCount = m_tileCount.load();
+        return tileCount > 0 ? float(m_tilesDone.load(std::memory_order_relaxed)) / tileCount : 0.0f;
+    }
+    
+    // Picks the kernel instantiated for this camera model, integrator and
+    // sampler combination.
+    static TileKernel SelectKernel(const RenderSettings& settings, const Camera& camera)
+    {
+        const bool bStratified = settings.m_sampler == SamplerType::Stratified;
+        if (settings.m_integrator == IntegratorType::Bidirectional)
+        {
+            if (camera.HasLens())
+                return bStratified ? &RenderBidirectionalTile<true, StratifiedSampler> : &RenderBidirectionalTile<true, RandomSampler>;
+            return bStratified ? &RenderBidirectionalTile<false, StratifiedSampler> : &RenderBidirectionalTile<false, RandomSampler>;
+        }
+        
+        if (camera.HasLens())
+        {
+            if (settings.m_diffuseInHemisphere)
+                return bStratified ? &RenderTile<true, true, StratifiedSampler> : &RenderTile<true, true, RandomSampler>;
+            return bStratified ? &RenderTile<true, false, StratifiedSampler> : &RenderTile<true, false, RandomSampler>;
+        }
+        
+        if (settings.m_diffuseInHemisphere)
+            return bStratified ? &RenderTile<false, true, StratifiedSampler> : &RenderTile<false, true, RandomSampler>;
+        return bStratified ? &RenderTile<false, false, StratifiedSampler> : &RenderTile<false, false, RandomSampler>;
+    }
+    
+    template<bool kThinLens, bool kDiffuseInHemisphere, typename Sampler>
+    static void RenderTile(const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                           FrameBuffer& frameBuffer, int tileX, int tileY,
+                           const CancelToken* cancelToken, uint64_t generation)
+    {
+        const int width = frameBuffer.Width();
+        const int height = frameBuffer.Height();
+        const int endX = std::min(tileX + settings.m_tileSize, width);
+        const int endY = std::min(tileY + settings.m_tileSize, height);
+        const int tileWidth = endX - tileX;
+        
+        // Accumulate the tile in scratch memory and flush it once, so a
+        // cancelled tile leaves the frame buffer untouched.
+        MemoryArena& scratch = GetScratchArena();
+        Vector3* tileColors = scratch.AllocateArray<Vector3>(tileWidth * (endY - tileY));
+        Sampler sampler(settings.m_samplesPerPixel);
+        const float pixelSpread = camera.GetPixelSpread(height);
+        const PathContext context = settings.GetPathContext();
+        if (settings.m_interleavedTraversal && !context.m_pathGuide && !context.m_lightTree && !context.SamplesEnvironment())
+        {
+            if (!RenderInterleaved<kThinLens, kDiffuseInHemisphere>(world, camera, settings, context, sampler, width, height,
+                                                                     tileX, tileY, endX, endY, tileColors,
+                                                                     cancelToken, generation))
+            {
+                scratch.Reset();
+                return;
+            }
+        }
+        else if (settings.m_primaryPackets && settings.m_maxDepth > 0)
+        {
+            for (int packetY = endY - s_kPacketWidth; packetY > tileY - s_kPacketWidth; packetY -= s_kPacketWidth)
+            {
+                if (cancelToken && cancelToken->IsCancelled(generation))
+                {
+                    scratch.Reset();
+                    return;
+                }
+                
+                for (int packetX = tileX; packetX < endX; packetX += s_kPacketWidth)
+                {
+                    int packetStartY = std::max(packetY, tileY);
+                    RenderPacket<kThinLens, kDiffuseInHemisphere>(world, camera, settings, sampler, width, height,
+                        packetX, packetStartY, std::min(packetX + s_kPacketWidth, endX), packetY + s_kPacketWidth,
+                        tileColors + (packetStartY - tileY) * tileWidth + (packetX - tileX), tileWidth);
+                }
+            }
+        }
+        else
+        {
+            for (int j = endY - 1; j >= tileY; --j)
+            {
+                if (cancelToken && cancelToken->IsCancelled(generation))
+                {
+                    scratch.Reset();
+                    return;
+                }
+                
+                ProfileScope paths(kPhasePaths);
+                for (int i = tileX; i < endX; ++i)
+                {
+                    Vector3 color(0, 0, 0);
+                    for (int s = 0; s < settings.m_samplesPerPixel; ++s)
+                    {
+                        double du, dv;
+                        sampler.GetPixelOffset(s, du, dv);
+                        auto u = (i + du) / width;
+                        auto v = (j + dv) / height;
+                        Ray r = camera.GetRay<kThinLens>(u, v);
+                        r.SetCone(0, pixelSpread);
+                        color += GetColor<kDiffuseInHemisphere>(r, world, settings.m_maxDepth, &context);
+                    }
+                    tileColors[(j - tileY) * tileWidth + (i - tileX)] = color;
+                }
+            }
+        }
+        
+        FlushTile(settings, frameBuffer, tileX, tileY, endX, endY, tileColors);
+        scratch.Reset();
+    }
+    
+    // Traces each sample as a camera and a light path, see Bidirectional.h.
+    // There is no packet or interleaved variant. The light tracing
+    // strategies splat into the calling worker's layer of the frame buffer,
+    // and so does the finished tile, which the pass adds to the buffer only
+    // if it completes.
+    template<bool kThinLens, typename Sampler>
+    static void RenderBidirectionalTile(const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                                        FrameBuffer& frameBuffer, int tileX, int tileY,
+                                        const CancelToken* cancelToken, uint64_t generation)
+    {
+        const int width = frameBuffer.Width();
+        const int height = frameBuffer.Height();
+        const int endX = std::min(tileX + settings.m_tileSize, width);
+        const int endY = std::min(tileY + settings.m_tileSize, height);
+        const int tileWidth = endX - tileX;
+        
+        MemoryArena& scratch = GetScratchArena();
+        Vector3* tileColors = scratch.AllocateArray<Vector3>(tileWidth * (endY - tileY));
+        Sampler sampler(settings.m_samplesPerPixel);
+        const float pixelSpread = camera.GetPixelSpread(height);
+        const PathContext context = settings.GetPathContext();
+        BidirectionalContext bidirectional = {};
+        bidirectional.m_world = &world;
+        bidirectional.m_camera = &camera;
+        bidirectional.m_lightTree = context.m_lightTree;
+        bidirectional.m_environment = context.m_environment;
+        bidirectional.m_skyIntensity = settings.m_skyIntensity;
+        bidirectional.m_maxDepth = settings.m_maxDepth;
+        bidirectional.m_frameBuffer = &frameBuffer;
+        bidirectional.m_splatLayer = ThreadPool::GetCurrentWorker();
+        bidirectional.m_cameraPath = scratch.AllocateArray<BidirectionalVertex>(settings.m_maxDepth + 1);
+        bidirectional.m_lightPath = scratch.AllocateArray<BidirectionalVertex>(settings.m_maxDepth + 1);
+        
+        for (int j = endY - 1; j >= tileY; --j)
+        {
+            if (cancelToken && cancelToken->IsCancelled(generation))
+            {
+                scratch.Reset();
+                return;
+            }
+            
+            ProfileScope paths(kPhasePaths);
+            for (int i = tileX; i < endX; ++i)
+            {
+                Vector3 color(0, 0, 0);
+                for (int s = 0; s < settings.m_samplesPerPixel; ++s)
+                {
+                    double du, dv;
+                    sampler.GetPixelOffset(s, du, dv);
+                    Ray r = camera.GetRay<kThinLens>((i + du) / width, (j + dv) / height);
+                    r.SetCone(0, pixelSpread);
+                    color += TraceBidirectional(r, bidirectional);
+                }
+                tileColors[(j - tileY) * tileWidth + (i - tileX)] = color;
+            }
+        }
+        
+        ProfileScope output(kPhaseOutput);
+        for (int j = tileY; j < endY; ++j)
+        {
+            for (int i = tileX; i < endX; ++i)
+            {
+                frameBuffer.Splat(bidirectional.m_splatLayer, i, j, tileColors[(j - tileY) * tileWidth + (i - tileX)]);
+            }
+        }
+        scratch.Reset();
+    }
+    
+    // Adds a finished tile's sample sums to the frame buffer.
+    static void FlushTile(const RenderSettings& settings, FrameBuffer& frameBuffer,
+                          int tileX, int tileY, int endX, int endY, const Vector3* tileColors)
+    {
+        ProfileScope output(kPhaseOutput);
+        const int tileWidth = endX - tileX;
+        for (int j = tileY; j < endY; ++j)
+        {
+            for (int i = tileX; i < endX; ++i)
+            {
+                frameBuffer.AddSamples(i, j, tileColors[(j - tileY) * tileWidth + (i - tileX)], settings.m_samplesPerPixel);
+            }
+        }
+    }
+    
+    // Traces the camera rays of pixels [startX, endX) x [startY, endY) one
+    // sample at a time as a packet, then continues each path on its own.
+    // Packets are culled against the frustum of the pixel block, widened by
+    // the lens for thin lens cameras.
+    template<bool kThinLens, bool kDiffuseInHemisphere, typename Sampler>
+    static void RenderPacket(const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                             const Sampler& sampler, int width, int height,
+                             int startX, int startY, int endX, int endY,
+                             Vector3* colors, int colorStride)
+    {
+        const Frustum frustum = GetPacketFrustum<kThinLens>(camera, width, height, startX, startY, endX, endY);
+        
+        const int packetWidth = endX - startX;
+        for (int j = startY; j < endY; ++j)
+        {
+            for (int i = startX; i < endX; ++i)
+            {
+                colors[(j - startY) * colorStride + (i - startX)] = Vector3::GetZero();
+            }
+        }
+        
+        const float pixelSpread = camera.GetPixelSpread(height);
+        const PathContext context = settings.GetPathContext();
+        RayPacket packet;
+        PacketHits hits;
+        packet.m_count = packetWidth * (endY - startY);
+        for (int s = 0; s < settings.m_samplesPerPixel; ++s)
+        {
+            {
+                ProfileScope rayGeneration(kPhaseRayGeneration);
+                for (int k = 0; k < packet.m_count; ++k)
+                {
+                    double du, dv;
+                    sampler.GetPixelOffset(s, du, dv);
+                    auto u = (startX + k % packetWidth + du) / width;
+                    auto v = (startY + k / packetWidth + dv) / height;
+                    packet.Set(k, camera.GetRay<kThinLens>(u, v));
+                }
+            }
+            
+            {
+                ProfileScope traversal(kPhaseTraversal, packet.m_count);
+                hits.Reset(s_kInfinity);
+                world.hitPacket(packet, &frustum, 0.001, hits);
+            }
+            
+            // The rest of each path is traced on its own.
+            ProfileScope paths(kPhasePaths);
+            for (int k = 0; k < packet.m_count; ++k)
+            {
+                Ray r = packet.Get(k);
+                r.SetCone(0, pixelSpread);
+                HitRecord hitRec;
+                Vector3 color;
+                
+                // Recomputes the full record of the hit the packet found.
+                if (hits.m_object[k] && hits.m_object[k]->hit(r, 0.001, s_kInfinity, hitRec))
+                {
+                    color = ShadeHit<kDiffuseInHemisphere>(r, hitRec, world, settings.m_maxDepth, &context);
+                }
+                else
+                {
+                    color = GetSkyRadiance(r, &context);
+                }
+                colors[(k / packetWidth) * colorStride + (k % packetWidth)] += color;
+            }
+        }
+    }
+    
+    // Paths traced together by RenderInterleaved(), enough to keep every
+    // lane of the traversal busy without outgrowing the L2 cache.
+    static const int s_kInterleavedPaths = 4096;
+    
+    struct InterleavedPath
+    {
+        Ray     m_ray;
+        Vector3 m_throughput;
+        int     m_pixel;
+    };
+    
+    // The tile's paths advance one bounce at a time, a few samples per pixel
+    // at once, so that every bounce hands the scene a large batch of
+    // independent rays. Shades like GetColor() without a path guide or
+    // any next event estimation. Returns false if the pass was cancelled.
+    template<bool kThinLens, bool kDiffuseInHemisphere, typename Sampler>
+    static bool RenderInterleaved(const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                                  const PathContext& context, const Sampler& sampler, int width, int height,
+                                  int tileX, int tileY, int endX, int endY, Vector3* colors,
+                                  const CancelToken* cancelToken, uint64_t generation)
+    {
+        const int tileWidth = endX - tileX;
+        const int numPixels = tileWidth * (endY - tileY);
+        const int samplesPerWave = std::max(1, std::min(settings.m_samplesPerPixel, s_kInterleavedPaths / numPixels));
+        const float pixelSpread = camera.GetPixelSpread(height);
+        
+        MemoryArena& scratch = GetScratchArena();
+        InterleavedPath* paths = scratch.AllocateArray<InterleavedPath>(numPixels * samplesPerWave);
+        Ray* rays = scratch.AllocateArray<Ray>(numPixels * samplesPerWave);
+        float* t = scratch.AllocateArray<float>(numPixels * samplesPerWave);
+        const Hittable** objects = scratch.AllocateArray<const Hittable*>(numPixels * samplesPerWave);
+        for (int p = 0; p < numPixels; ++p)
+        {
+            colors[p] = Vector3::GetZero();
+        }
+        
+        for (int firstSample = 0; firstSample < settings.m_samplesPerPixel; firstSample += samplesPerWave)
+        {
+            int alive = 0;
+            {
+                ProfileScope rayGeneration(kPhaseRayGeneration);
+                const int endSample = std::min(firstSample + samplesPerWave, settings.m_samplesPerPixel);
+                for (int p = 0; p < numPixels; ++p)
+                {
+                    for (int s = firstSample; s < endSample; ++s)
+                    {
+                        double du, dv;
+                        sampler.GetPixelOffset(s, du, dv);
+                        InterleavedPath& path = paths[alive++];
+                        path.m_ray = camera.GetRay<kThinLens>((tileX + p % tileWidth + du) / width,
+                                                              (tileY + p / tileWidth + dv) / height);
+                        path.m_ray.SetCone(0, pixelSpread);
+                        path.m_throughput = Vector3(1, 1, 1);
+                        path.m_pixel = p;
+                    }
+                }
+            }
+            
+            for (int depth = 0; depth < settings.m_maxDepth && alive > 0; ++depth)
+            {
+                if (cancelToken && cancelToken->IsCancelled(generation))
+                {
+                    return false;
+                }
+                
+                {
+                    ProfileScope traversal(kPhaseTraversal, alive);
+                    for (int k = 0; k < alive; ++k)
+                    {
+                        rays[k] = paths[k].m_ray;
+                        t[k] = s_kInfinity;
+                        objects[k] = nullptr;
+                    }
+                    world.hitBatch(rays, alive, 0.001, t, objects);
+                }
+                
+                // Surviving paths are compacted to the front. Recomputing the
+                // full record of each hit the batch found counts as shading.
+                ProfileScope shading(kPhaseShading);
+                int next = 0;
+                for (int k = 0; k < alive; ++k)
+                {
+                    const InterleavedPath& path = paths[k];
+                    HitRecord hitRec;
+                    if (!objects[k] || !objects[k]->hit(path.m_ray, 0.001, s_kInfinity, hitRec))
+                    {
+                        colors[path.m_pixel] += path.m_throughput * GetSkyRadiance(path.m_ray, &context);
+                        continue;
+                    }
+                    
+                    Ray scattered;
+                    Vector3 attenuation = Vector3::GetZero();
+                    if (kDiffuseInHemisphere)
+                    {
+                        Vector3 target = hitRec.m_point + Vector3::RandomInHemiSphere(hitRec.m_normal);
+                        scattered = Ray(hitRec.m_point, target - hitRec.m_point);
+                        attenuation = Vector3(0.5, 0.5, 0.5);
+                    }
+                    else
+                    {
+                        colors[path.m_pixel] += path.m_throughput * hitRec.m_material->Emitted(hitRec);
+                        if (!hitRec.m_material->Scatter(path.m_ray, hitRec, attenuation, scattered))
+                        {
+                            colors[path.m_pixel] += path.m_throughput * attenuation;
+                            continue;
+                        }
+                    }
+                    
+                    InterleavedPath& survivor = paths[next++];
+                    survivor.m_ray = scattered;
+                    survivor.m_throughput = path.m_throughput * attenuation;
+                    survivor.m_pixel = path.m_pixel;
+                }
+                alive = next;
+            }
+        }
+        return true;
+    }
+    
+    template<bool kThinLens>
+    static Frustum GetPacketFrustum(const Camera& camera, int width, int height,
+                                    int startX, int startY, int endX, int endY)
+    {
+        double u0 = double(startX) / width;
+        double u1 = double(endX) / width;
+        double v0 = double(startY) / height;
+        double v1 = double(endY) / height;
+        Vector3 corners[4] =
+        {
+            camera.GetRay<false>(u0, v0).GetDirection(),
+            camera.GetRay<false>(u1, v0).GetDirection(),
+            camera.GetRay<false>(u1, v1).GetDirection(),
+            camera.GetRay<false>(u0, v1).GetDirection()
+        };
+        return Frustum(camera.GetRay<false>(u0, v0).GetOrigin(), corners, camera.GetForward(),
+                       kThinLens ? camera.GetLensRadius() : 0.0, camera.GetFocusDistance());
+    }
+    
+    // Splits the tile rows into one contiguous band per node.
+    static int GetBandNode(int tileY, int height, int tileSize, int nodeCount)
+    {
+        const int tileRows = (height + tileSize - 1) / tileSize;
+        return (tileY / tileSize) * nodeCount / std::max(tileRows, 1);
+    }
+    
+private:
+    // Queues (or, without a pool, renders) every tile of one frame.
+    void QueueTiles(const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                    FrameBuffer& frameBuffer, const CancelToken* cancelToken, uint64_t generation)
+    {
+        const int tileSize = settings.m_tileSize;
+        TileKernel renderTile = SelectKernel(settings, camera);
+        const int nodeCount = GetNodeCount();
+        
+        // Walk tiles from the top of the image down like the scanline order.
+        for (int tileY = ((frameBuffer.Height() - 1) / tileSize) * tileSize; tileY >= 0; tileY -= tileSize)
+        {
+            for (int tileX = 0; tileX < frameBuffer.Width(); tileX += tileSize)
+            {
+                auto job = [this, &world, &camera, &settings, &frameBuffer, renderTile, tileX, tileY, cancelToken, generation]()
+                {
+                    const Hittable& localWorld = m_replicas.empty() ? world : *m_replicas[ThreadPool::GetCurrentNode()];
+                    renderTile(localWorld, camera, settings, frameBuffer, tileX, tileY, cancelToken, generation);
+                    m_tilesDone.fetch_add(1, std::memory_order_relaxed);
+                };
+                
+                if (m_threadPool)
+                {
+                    m_threadPool->QueueJob(job, GetBandNode(tileY, frameBuffer.Height(), tileSize, nodeCount));
+                }
+                else
+                {
+                    job();
+                }
+            }
+        }
+    }
+    
+    // Light tracing splats go to one frame buffer layer per worker. They land
+    // on pixels of any tile, finished or not, so a cancelled pass drops them
+    // together with the tiles it did finish.
+    void PrepareSplats(const RenderSettings& settings, FrameBuffer& frameBuffer)
+    {
+        if (settings.m_integrator == IntegratorType::Bidirectional)
+        {
+            frameBuffer.PrepareSplats(m_threadPool ? m_threadPool->GetThreadCount() : 1);
+        }
+    }
+    
+    void ResolveSplats(const RenderSettings& settings, FrameBuffer& frameBuffer, bool bCancelled)
+    {
+        if (settings.m_integrator != IntegratorType::Bidirectional)
+        {
+            return;
+        }
+        
+        if (bCancelled)
+        {
+            frameBuffer.DiscardSplats();
+        }
+        else
+        {
+            frameBuffer.ResolveSplats(settings.m_samplesPerPixel);
+        }
+    }
+    
+    static int GetTileCount(const FrameBuffer& frameBuffer, int tileSize)
+    {
+        return ((frameBuffer.Width() + tileSize - 1) / tileSize) * ((frameBuffer.Height() + tileSize - 1) / tileSize);
+    }
+    
+    int GetNodeCount() const { return m_threadPool ? m_threadPool->GetNodeCount() : 1; }
+    
+    ThreadPool* m_threadPool;
+    std::vector<const Hittable*> m_replicas;
+    std::atomic<int> m_tileCount;
+    std::atomic<int> m_tilesDone;
+};
+
+#endif /* Renderer_h */
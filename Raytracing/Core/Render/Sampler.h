@@ -0,0 +1,67 @@
+//
+//  Sampler.h
+//  Raytracing
+//
+//  Sub-pixel sample positions. Samplers are template parameters of the tile
+//  kernels, so the choice costs nothing inside the sample loop.
+//
+
+#ifndef Sampler_h
+#define Sampler_h
+
+#include <math.h>
+#include "../Math/Utils.h"
+
+enum class SamplerType
+{
+    Random,
+    Stratified
+};
+
+// Independent uniform jitter, the original behaviour.
+class RandomSampler
+{
+public:
+    RandomSampler(int samplesPerPixel) {}
+    
+    void GetPixelOffset(int sampleIndex, double& du, double& dv) const
+    {
+        du = RandomDouble();
+        dv = RandomDouble();
+    }
+};
+
+// Jittered grid over the largest square number of samples, the remainder
+// falls back to uniform jitter.
+class StratifiedSampler
+{
+public:
+    StratifiedSampler(int samplesPerPixel)
+    {
+        m_strata = static_cast<int>(sqrt(double(samplesPerPixel)));
+        if (m_strata < 1)
+        {
+            m_strata = 1;
+        }
+        m_invStrata = 1.0 / m_strata;
+    }
+    
+    void GetPixelOffset(int sampleIndex, double& du, double& dv) const
+    {
+        if (sampleIndex >= m_strata * m_strata)
+        {
+            du = RandomDouble();
+            dv = RandomDouble();
+            return;
+        }
+        
+        du = ((sampleIndex % m_strata) + RandomDouble()) * m_invStrata;
+        dv = ((sampleIndex / m_strata) + RandomDouble()) * m_invStrata;
+    }
+    
+private:
+    int     m_strata;
+    double  m_invStrata;
+};
+
+#endif /* Sampler_h */
@@ -18,8 +18,16 @@ public:
     m_center(center), m_radius(radius), m_material(mat) {}
     
     virtual bool hit(const Ray& r, float tmin, float tmax, HitRecord& rec) const;
+    virtual bool occluded(const Ray& r, float tmin, float tmax) const;
+    virtual void hitPacket(const RayPacket& packet, const Frustum* frustum, float t_min, PacketHits& hits) const;
+    virtual bool boundingBox(AABB& box_out) const;
     const Vector3& GetCenter() const { return m_center; }
     const float GetRadius() const { return m_radius; }
+    const Material* GetMaterial() const { return m_material.get(); }
+    
+    // Shared with shapes that store spheres without a Sphere object.
+    static inline void FillHitRecord(const Ray& r, float t, const Vector3& center, float radius,
+                                     const Material* material, HitRecord& rec);
     
 private:
     float   m_radius;
@@ -27,7 +35,26 @@ private:
     shared_ptr<Material> m_material;
 };
 
-bool Sphere::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
+inline void Sphere::FillHitRecord(const Ray& r, float t, const Vector3& center, float radius,
+                           const Material* material, HitRecord& rec)
+{
+    rec.m_t = t;
+    rec.m_point = r.PointAtParameter(rec.m_t);
+    Vector3 outwardNormal = (rec.m_point - center) / radius;
+    rec.SetFaceNormal(r, outwardNormal);
+    rec.m_material = material;
+    rec.m_object = nullptr;
+    
+    // The outward normal of a hollow (negative radius) sphere points inward,
+    // texture coordinates follow the position.
+    rec.m_surfacePoint = radius < 0 ? -outwardNormal : outwardNormal;
+    
+    // One unit of v spans half the circumference.
+    rec.m_footprint = r.GetFootprint(t);
+    rec.m_uvFootprint = rec.m_footprint / (s_kPI * fabs(radius));
+}
+
+inline bool Sphere::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
 {
     Vector3 oc = r.GetOrigin() - GetCenter();
     float a = dot(r.GetDirection(), r.GetDirection());
@@ -39,27 +66,87 @@ bool Sphere::hit(const Ray& r, float t_min, float t_max, HitRecord& rec) const
         float temp = (-b - sqrt(discriminant))/a;
         if (temp < t_max && temp > t_min)
         {
-            rec.m_t = temp;
-            rec.m_point = r.PointAtParameter(rec.m_t);
-            
-            Vector3 outwardNormal = (rec.m_point - GetCenter()) / GetRadius();
-            rec.SetFaceNormal(r, outwardNormal);
-            rec.m_material = m_material;
+            FillHitRecord(r, temp, m_center, m_radius, m_material.get(), rec);
+            rec.m_object = this;
             return true;
         }
         
         temp = (-b + sqrt(discriminant)) / a;
         if (temp < t_max && temp > t_min)
         {
-            rec.m_t = temp;
-            rec.m_point = r.PointAtParameter(rec.m_t);
-            Vector3 outwardNormal = (rec.m_point - GetCenter()) / GetRadius();
-            rec.SetFaceNormal(r, outwardNormal);
-            rec.m_material = m_material;
+            FillHitRecord(r, temp, m_center, m_radius, m_material.get(), rec);
+            rec.m_object = this;
             return true;
         }
     }
     return false;
 }
 
+inline bool Sphere::boundingBox(AABB& box_out) const
+{
+    box_out = AABB::FromSphere(m_center, m_radius);
+    return true;
+}
+
+inline bool Sphere::occluded(const Ray& r, float t_min, float t_max) const
+{
+    Vector3 oc = r.GetOrigin() - GetCenter();
+    float a = dot(r.GetDirection(), r.GetDirection());
+    float b = dot(oc, r.GetDirection());
+    float c = dot(oc, oc) - GetRadius() * GetRadius();
+    float discriminant = b * b - a * c;
+    if (discriminant <= 0)
+    {
+        return false;
+    }
+    
+    // Only the root positions matter here, no point, normal or material.
+    float root = sqrt(discriminant);
+    float temp = (-b - root) / a;
+    if (temp < t_max && temp > t_min)
+    {
+        return true;
+    }
+    
+    temp = (-b + root) / a;
+    return (temp < t_max && temp > t_min);
+}
+
+// Same root selection as hit(), written branch-free over the packet lanes so
+// the compiler can vectorize it.
+inline void Sphere::hitPacket(const RayPacket& packet, const Frustum* frustum, float t_min, PacketHits& hits) const
+{
+    if (frustum && !frustum->OverlapsSphere(m_center, fabs(m_radius)))
+    {
+        return;
+    }
+    
+    const float centerX = m_center.X();
+    const float centerY = m_center.Y();
+    const float centerZ = m_center.Z();
+    const float radius2 = m_radius * m_radius;
+    for (int k = 0; k < packet.m_count; ++k)
+    {
+        float ocX = packet.m_originX[k] - centerX;
+        float ocY = packet.m_originY[k] - centerY;
+        float ocZ = packet.m_originZ[k] - centerZ;
+        float dX = packet.m_directionX[k];
+        float dY = packet.m_directionY[k];
+        float dZ = packet.m_directionZ[k];
+        
+        float a = dX * dX + dY * dY + dZ * dZ;
+        float b = ocX * dX + ocY * dY + ocZ * dZ;
+        float c = ocX * ocX + ocY * ocY + ocZ * ocZ - radius2;
+        float discriminant = b * b - a * c;
+        float root = sqrtf(discriminant > 0 ? discriminant : 0);
+        float nearT = (-b - root) / a;
+        float farT = (-b + root) / a;
+        float t = nearT > t_min ? nearT : farT;
+        
+        bool bHit = discriminant > 0 && t > t_min && t < hits.m_t[k];
+        hits.m_t[k] = bHit ? t : hits.m_t[k];
+        hits.m_object[k] = bHit ? this : hits.m_object[k];
+    }
+}
+
 #endif /* Sphere_h */
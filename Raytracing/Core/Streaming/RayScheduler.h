@@ -0,0 +1,190 @@
+//
+//  RayScheduler.h
+//  Raytracing
+//
+//  Closest-hit tracing of a batch of rays against a StreamedScene without
+//  stalling on every missing cluster. Rays are intersected with resident
+//  clusters right away and queued on clusters that are not loaded. Queues
+//  are then drained resident clusters first, then largest first, so every
+//  cluster load is shared by as many rays as possible, and queued rays that
+//  already found a closer hit skip the cluster entirely. Missing clusters
+//  are prefetched in drain order, so the scene's loader threads read them
+//  while the worker intersects the ones before; the worker only waits when
+//  it catches up with a read that has not finished.
+//
+
+#ifndef RayScheduler_h
+#define RayScheduler_h
+
+#include <algorithm>
+#include <vector>
+#include "StreamedScene.h"
+#include "../Shape/Sphere.h"
+
+struct StreamHit
+{
+    float           m_t;
+    PackedSphere    m_sphere;
+    bool            m_bHit;
+    
+    // Fills a HitRecord like Sphere::hit for the winning sphere.
+    void GetHitRecord(const StreamedScene& scene, const Ray& r, HitRecord& rec) const
+    {
+        Vector3 center(m_sphere.m_center[0], m_sphere.m_center[1], m_sphere.m_center[2]);
+        Sphere::FillHitRecord(r, m_t, center, m_sphere.m_radius, scene.GetMaterial(m_sphere.m_material), rec);
+    }
+};
+
+class RayScheduler
+{
+public:
+    RayScheduler(StreamedScene& scene)
+        : m_scene(scene), m_queues(scene.GetClusterCount()), m_resident(scene.GetClusterCount()), m_deferredRays(0) {}
+    
+    void Trace(const Ray* rays, int count, float t_min, StreamHit* hits)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            hits[i].m_t = s_kInfinity;
+            hits[i].m_bHit = false;
+        }
+        
+        // First sweep: resident clusters now, the rest is queued.
+        for (int i = 0; i < count; ++i)
+        {
+            m_scene.GetClusterBVH().Traverse(rays[i], t_min, s_kInfinity, [&](int cluster, float t_entry, float t_max)
+            {
+                std::shared_ptr<const StreamedCluster> data = m_scene.GetResident(cluster);
+                if (data)
+                {
+                    Intersect(*data, rays[i], t_min, hits[i]);
+                }
+                else
+                {
+                    if (m_queues[cluster].empty())
+                    {
+                        m_activeClusters.push_back(cluster);
+                    }
+                    m_queues[cluster].push_back({ i, t_entry });
+                    m_deferredRays++;
+                }
+                return std::min(t_max, hits[i].m_t);
+            });
+        }
+        
+        // Clusters that became resident meanwhile go first, then the longest
+        // queues. Residency is probed once, without touching the LRU order,
+        // as the queues do not change while they are drained.
+        size_t numResident = 0;
+        for (int cluster : m_activeClusters)
+        {
+            m_resident[cluster] = m_scene.IsResident(cluster);
+            numResident += m_resident[cluster];
+        }
+        std::sort(m_activeClusters.begin(), m_activeClusters.end(), [this](int a, int b)
+        {
+            if (m_resident[a] != m_resident[b])
+            {
+                return m_resident[a] > m_resident[b];
+            }
+            return m_queues[a].size() > m_queues[b].size();
+        });
+        
+        // Prefetches stay a few missing clusters ahead of the drain, as far
+        // as the scene allows, starting while the resident ones are drained.
+        // Further ahead, the clusters drained meanwhile would give their
+        // rays closer hits and make more of the reads useless. Clusters no
+        // queued ray needs any more are not read at all: hits only get
+        // closer.
+        size_t prefetched = numResident;
+        for (size_t next = 0; next < m_activeClusters.size(); ++next)
+        {
+            const size_t window = std::max(next + 1, numResident) + s_kPrefetchDepth;
+            prefetched = std::max(prefetched, next + 1);
+            while (prefetched < std::min(m_activeClusters.size(), window) &&
+                   (!IsNeeded(m_activeClusters[prefetched], hits) || m_scene.Prefetch(m_activeClusters[prefetched])))
+            {
+                prefetched++;
+            }
+            
+            const int cluster = m_activeClusters[next];
+            std::shared_ptr<const StreamedCluster> data;
+            for (const QueuedRay& queued : m_queues[cluster])
+            {
+                if (queued.m_entry >= hits[queued.m_ray].m_t)
+                {
+                    continue;
+                }
+                if (!data)
+                {
+                    data = m_scene.Acquire(cluster);
+                }
+                Intersect(*data, rays[queued.m_ray], t_min, hits[queued.m_ray]);
+            }
+            m_queues[cluster].clear();
+        }
+        m_activeClusters.clear();
+    }
+    
+    uint64_t GetDeferredRayCount() const { return m_deferredRays; }
+    
+private:
+    static const size_t s_kPrefetchDepth = 4;
+    
+    struct QueuedRay
+    {
+        int     m_ray;
+        float   m_entry;
+    };
+    
+    bool IsNeeded(int cluster, const StreamHit* hits) const
+    {
+        for (const QueuedRay& queued : m_queues[cluster])
+        {
+            if (queued.m_entry < hits[queued.m_ray].m_t)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static void Intersect(const StreamedCluster& cluster, const Ray& r, float t_min, StreamHit& hit)
+    {
+        Vector3 origin = r.GetOrigin();
+        Vector3 direction = r.GetDirection();
+        float a = dot(direction, direction);
+        for (const PackedSphere& sphere : cluster.m_spheres)
+        {
+            Vector3 oc = origin - Vector3(sphere.m_center[0], sphere.m_center[1], sphere.m_center[2]);
+            float b = dot(oc, direction);
+            float c = dot(oc, oc) - sphere.m_radius * sphere.m_radius;
+            float discriminant = b * b - a * c;
+            if (discriminant <= 0)
+            {
+                continue;
+            }
+            
+            float root = sqrt(discriminant);
+            float t = (-b - root) / a;
+            if (t <= t_min)
+            {
+                t = (-b + root) / a;
+            }
+            if (t > t_min && t < hit.m_t)
+            {
+                hit.m_t = t;
+                hit.m_sphere = sphere;
+                hit.m_bHit = true;
+            }
+        }
+    }
+    
+    StreamedScene&                          m_scene;
+    std::vector<std::vector<QueuedRay>>     m_queues;
+    std::vector<int>                        m_activeClusters;
+    std::vector<char>                       m_resident;     // per cluster, valid for active clusters while draining
+    uint64_t                                m_deferredRays;
+};
+
+#endif /* RayScheduler_h */
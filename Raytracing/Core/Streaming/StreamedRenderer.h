@@ -0,0 +1,164 @@
+//
+//  StreamedRenderer.h
+//  Raytracing
+//
+//  Wavefront path tracer for StreamedScene. A tile's paths advance one
+//  bounce at a time so the RayScheduler sees large batches, which is what
+//  makes cluster loads affordable.
+//
+
+#ifndef StreamedRenderer_h
+#define StreamedRenderer_h
+
+#include "RayScheduler.h"
+#include "../Render/Renderer.h"
+
+class StreamedRenderer
+{
+public:
+    StreamedRenderer(ThreadPool* threadPool) : m_threadPool(threadPool) {}
+    
+    void RenderPass(StreamedScene& scene, const Camera& camera, const RenderSettings& settings, FrameBuffer& frameBuffer)
+    {
+        // Schedulers belong to the pass, one per tile in flight, and are
+        // handed from tile to tile.
+        std::mutex schedulersMutex;
+        std::vector<std::unique_ptr<RayScheduler>> schedulers;
+        
+        const int tileSize = settings.m_tileSize;
+        for (int tileY = 0; tileY < frameBuffer.Height(); tileY += tileSize)
+        {
+            for (int tileX = 0; tileX < frameBuffer.Width(); tileX += tileSize)
+            {
+                auto job = [&, tileX, tileY]()
+                {
+                    std::unique_ptr<RayScheduler> scheduler;
+                    {
+                        std::unique_lock<std::mutex> lock(schedulersMutex);
+                        if (!schedulers.empty())
+                        {
+                            scheduler = std::move(schedulers.back());
+                            schedulers.pop_back();
+                        }
+                    }
+                    if (!scheduler)
+                    {
+                        scheduler.reset(new RayScheduler(scene));
+                    }
+                    
+                    RenderTile(scene, *scheduler, camera, settings, frameBuffer, tileX, tileY);
+                    
+                    std::unique_lock<std::mutex> lock(schedulersMutex);
+                    schedulers.push_back(std::move(scheduler));
+                };
+                
+                if (m_threadPool)
+                {
+                    m_threadPool->QueueJob(job);
+                }
+                else
+                {
+                    job();
+                }
+            }
+        }
+        
+        if (m_threadPool)
+        {
+            m_threadPool->WaitUntilDone();
+        }
+    }
+    
+private:
+    struct PathState
+    {
+        Ray     m_ray;
+        Vector3 m_throughput;
+        int     m_pixel;
+    };
+    
+    static void RenderTile(StreamedScene& scene, RayScheduler& scheduler, const Camera& camera, const RenderSettings& settings,
+                           FrameBuffer& frameBuffer, int tileX, int tileY)
+    {
+        const int width = frameBuffer.Width();
+        const int height = frameBuffer.Height();
+        const int endX = std::min(tileX + settings.m_tileSize, width);
+        const int endY = std::min(tileY + settings.m_tileSize, height);
+        const int tileWidth = endX - tileX;
+        const int numPixels = tileWidth * (endY - tileY);
+        const int numPaths = numPixels * settings.m_samplesPerPixel;
+        const float pixelSpread = camera.GetPixelSpread(height);
+        
+        MemoryArena& scratch = GetScratchArena();
+        Vector3* colors = scratch.AllocateArray<Vector3>(numPixels);
+        PathState* paths = scratch.AllocateArray<PathState>(numPaths);
+        Ray* rays = scratch.AllocateArray<Ray>(numPaths);
+        StreamHit* hits = scratch.AllocateArray<StreamHit>(numPaths);
+        
+        for (int p = 0; p < numPixels; ++p)
+        {
+            colors[p] = Vector3::GetZero();
+        }
+        
+        int alive = 0;
+        for (int p = 0; p < numPixels; ++p)
+        {
+            int i = tileX + p % tileWidth;
+            int j = tileY + p / tileWidth;
+            for (int s = 0; s < settings.m_samplesPerPixel; ++s)
+            {
+                PathState& path = paths[alive++];
+                path.m_ray = camera.GetRay((i + RandomDouble()) / width, (j + RandomDouble()) / height);
+                path.m_ray.SetCone(0, pixelSpread);
+                path.m_throughput = Vector3(1, 1, 1);
+                path.m_pixel = p;
+            }
+        }
+        
+        for (int depth = 0; depth < settings.m_maxDepth && alive > 0; ++depth)
+        {
+            for (int k = 0; k < alive; ++k)
+            {
+                rays[k] = paths[k].m_ray;
+            }
+            scheduler.Trace(rays, alive, 0.001, hits);
+            
+            // Compact surviving paths to the front.
+            int next = 0;
+            for (int k = 0; k < alive; ++k)
+            {
+                PathState& path = paths[k];
+                if (!hits[k].m_bHit)
+                {
+                    colors[path.m_pixel] += path.m_throughput * GetBackground(path.m_ray);
+                    continue;
+                }
+                
+                HitRecord rec;
+                hits[k].GetHitRecord(scene, path.m_ray, rec);
+                Ray scattered;
+                Vector3 attenuation;
+                if (!rec.m_material->Scatter(path.m_ray, rec, attenuation, scattered))
+                {
+                    continue;
+                }
+                
+                PathState& survivor = paths[next++];
+                survivor.m_ray = scattered;
+                survivor.m_throughput = path.m_throughput * attenuation;
+                survivor.m_pixel = path.m_pixel;
+            }
+            alive = next;
+        }
+        
+        for (int p = 0; p < numPixels; ++p)
+        {
+            frameBuffer.AddSamples(tileX + p % tileWidth, tileY + p / tileWidth, colors[p], settings.m_samplesPerPixel);
+        }
+        scratch.Reset();
+    }
+    
+    ThreadPool* m_threadPool;
+};
+
+#endif /* StreamedRenderer_h */
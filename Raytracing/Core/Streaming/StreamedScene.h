@@ -0,0 +1,450 @@
+//
+//  StreamedScene.h
+//  Raytracing
+//
+//  Chunked on-disk sphere geometry for scenes that do not fit in memory.
+//
+//  File layout: header | cluster payloads | material table | directory.
+//  A cluster is a spatially compact run of packed spheres. Only the header,
+//  materials and the per-cluster directory (bounds, offset, count) are kept
+//  in memory; cluster payloads are read on demand or ahead of use by a few
+//  loader threads, so that reads overlap each other, and evicted least-recently-used once the resident budget
+//  is exceeded.
+//
+
+#ifndef StreamedScene_h
+#define StreamedScene_h
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../Accel/BVH.h"
+#include "../Math/Material.h"
+#include "../../System/Arena.h"
+
+struct PackedSphere
+{
+    float       m_center[3];
+    float       m_radius;
+    uint32_t    m_material;
+};
+
+enum PackedMaterialType : uint32_t
+{
+    kPackedLambertian = 0,
+    kPackedMetal = 1,
+    kPackedDielectric = 2
+};
+
+struct PackedMaterial
+{
+    uint32_t    m_type;
+    float       m_albedo[3];
+    float       m_fuzz;
+    float       m_refractiveIndex;
+};
+
+struct ClusterRecord
+{
+    float       m_min[3];
+    float       m_max[3];
+    uint64_t    m_fileOffset;
+    uint32_t    m_sphereCount;
+    uint32_t    m_padding;
+};
+
+struct StreamedSceneHeader
+{
+    uint32_t    m_magic;
+    uint32_t    m_version;
+    uint32_t    m_numMaterials;
+    uint32_t    m_numClusters;
+    uint64_t    m_materialOffset;
+    uint64_t    m_directoryOffset;
+};
+
+static const uint32_t s_kStreamedSceneMagic = 0x43475452;  // "RTGC"
+static const int s_kStreamedSceneLoaders = 4;                // reads in flight ahead of use
+
+// Writes clusters as they are completed, so a generator never needs to hold
+// more than one cluster in memory.
+class StreamedSceneWriter
+{
+public:
+    bool Open(const std::string& fileName)
+    {
+        m_out.open(fileName.c_str(), std::ios::binary);
+        StreamedSceneHeader header = {};
+        m_out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return bool(m_out);
+    }
+    
+    uint32_t AddMaterial(const PackedMaterial& material)
+    {
+        m_materials.push_back(material);
+        return uint32_t(m_materials.size() - 1);
+    }
+    
+    void AddSphere(const Vector3& center, float radius, uint32_t material)
+    {
+        PackedSphere sphere = { { center.X(), center.Y(), center.Z() }, radius, material };
+        m_cluster.push_back(sphere);
+        m_clusterBounds.Grow(AABB::FromSphere(center, radius));
+    }
+    
+    void EndCluster()
+    {
+        if (m_cluster.empty())
+        {
+            return;
+        }
+        
+        ClusterRecord record = {};
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            record.m_min[axis] = m_clusterBounds.Min().m_value[axis];
+            record.m_max[axis] = m_clusterBounds.Max().m_value[axis];
+        }
+        record.m_fileOffset = uint64_t(m_out.tellp());
+        record.m_sphereCount = uint32_t(m_cluster.size());
+        m_directory.push_back(record);
+        
+        m_out.write(reinterpret_cast<const char*>(m_cluster.data()), m_cluster.size() * sizeof(PackedSphere));
+        m_cluster.clear();
+        m_clusterBounds = AABB();
+    }
+    
+    bool Close()
+    {
+        EndCluster();
+        
+        StreamedSceneHeader header = {};
+        header.m_magic = s_kStreamedSceneMagic;
+        header.m_version = 1;
+        header.m_numMaterials = uint32_t(m_materials.size());
+        header.m_numClusters = uint32_t(m_directory.size());
+        header.m_materialOffset = uint64_t(m_out.tellp());
+        m_out.write(reinterpret_cast<const char*>(m_materials.data()), m_materials.size() * sizeof(PackedMaterial));
+        header.m_directoryOffset = uint64_t(m_out.tellp());
+        m_out.write(reinterpret_cast<const char*>(m_directory.data()), m_directory.size() * sizeof(ClusterRecord));
+        
+        m_out.seekp(0);
+        m_out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        m_out.close();
+        return !m_out.fail();
+    }
+    
+private:
+    std::ofstream                   m_out;
+    std::vector<PackedMaterial>     m_materials;
+    std::vector<ClusterRecord>      m_directory;
+    std::vector<PackedSphere>       m_cluster;
+    AABB                            m_clusterBounds;
+};
+
+struct StreamedCluster
+{
+    std::vector<PackedSphere> m_spheres;
+};
+
+class StreamedScene
+{
+public:
+    StreamedScene(size_t residentBudgetBytes) :
+    m_file(-1), m_budgetBytes(residentBudgetBytes), m_residentBytes(0), m_peakResidentBytes(0), m_queuedBytes(0),
+    m_bStopping(false), m_loads(0), m_evictions(0), m_bytesRead(0), m_prefetches(0), m_stalls(0)
+    {
+    }
+    
+    ~StreamedScene()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_bStopping = true;
+        }
+        m_requestAdded.notify_all();
+        for (std::thread& loader : m_loaders)
+        {
+            loader.join();
+        }
+        if (m_file >= 0)
+        {
+            close(m_file);
+        }
+    }
+    
+    bool Open(const std::string& fileName)
+    {
+        m_file = open(fileName.c_str(), O_RDONLY);
+        if (m_file < 0)
+        {
+            return false;
+        }
+        
+        StreamedSceneHeader header;
+        if (pread(m_file, &header, sizeof(header), 0) != sizeof(header) || header.m_magic != s_kStreamedSceneMagic)
+        {
+            return false;
+        }
+        
+        std::vector<PackedMaterial> materials(header.m_numMaterials);
+        size_t materialBytes = materials.size() * sizeof(PackedMaterial);
+        if (pread(m_file, materials.data(), materialBytes, header.m_materialOffset) != ssize_t(materialBytes))
+        {
+            return false;
+        }
+        for (const PackedMaterial& material : materials)
+        {
+            Vector3 albedo(material.m_albedo[0], material.m_albedo[1], material.m_albedo[2]);
+            switch (material.m_type)
+            {
+                case kPackedMetal:
+                    m_materials.push_back(MakeShared<Metal>(m_materialArena, albedo, material.m_fuzz));
+                    break;
+                case kPackedDielectric:
+                    m_materials.push_back(MakeShared<Dielectric>(m_materialArena, material.m_refractiveIndex));
+                    break;
+                default:
+                    m_materials.push_back(MakeShared<Lambertian>(m_materialArena, albedo));
+                    break;
+            }
+        }
+        
+        m_directory.resize(header.m_numClusters);
+        size_t directoryBytes = m_directory.size() * sizeof(ClusterRecord);
+        if (pread(m_file, m_directory.data(), directoryBytes, header.m_directoryOffset) != ssize_t(directoryBytes))
+        {
+            return false;
+        }
+        
+        std::vector<AABB> clusterBounds;
+        for (const ClusterRecord& record : m_directory)
+        {
+            clusterBounds.push_back(AABB(Vector3(record.m_min[0], record.m_min[1], record.m_min[2]),
+                                         Vector3(record.m_max[0], record.m_max[1], record.m_max[2])));
+        }
+        m_clusterBVH.Build(clusterBounds, 1);
+        m_resident.resize(m_directory.size());
+        m_lruPosition.resize(m_directory.size());
+        m_loadState.resize(m_directory.size(), kNotLoading);
+        for (int i = 0; i < s_kStreamedSceneLoaders; ++i)
+        {
+            m_loaders.push_back(std::thread(&StreamedScene::LoaderMain, this));
+        }
+        return true;
+    }
+    
+    int GetClusterCount() const { return int(m_directory.size()); }
+    const BVH& GetClusterBVH() const { return m_clusterBVH; }
+    const Material* GetMaterial(uint32_t index) const { return m_materials[index].get(); }
+    
+    // The cluster if it is resident, without loading it.
+    std::shared_ptr<const StreamedCluster> GetResident(int cluster)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_resident[cluster])
+        {
+            Touch(cluster);
+        }
+        return m_resident[cluster];
+    }
+    
+    // Whether the cluster is loaded, without counting as a use for eviction.
+    bool IsResident(int cluster)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return bool(m_resident[cluster]);
+    }
+    
+    // Queues a read of the cluster on the loader threads unless it is
+    // resident or already being loaded, and returns at once. Queued reads
+    // are limited to half the budget, so that they do not evict each other
+    // before they are used; returns false if the cluster did not fit.
+    bool Prefetch(int cluster)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_resident[cluster] || m_loadState[cluster] != kNotLoading)
+        {
+            return true;
+        }
+        
+        const size_t bytes = GetClusterBytes(cluster);
+        if (m_queuedBytes + bytes > m_budgetBytes / 2)
+        {
+            return false;
+        }
+        m_loadState[cluster] = kQueued;
+        m_queuedBytes += bytes;
+        m_requests.push_back(cluster);
+        m_requestAdded.notify_one();
+        return true;
+    }
+    
+    // Loads the cluster if needed. A cluster a loader thread is reading is
+    // waited for; any other is read by the caller, taking it off the loader's
+    // queue, so that a worker never waits behind reads it does not need. The
+    // returned reference keeps the data alive even if the cache evicts it
+    // meanwhile.
+    std::shared_ptr<const StreamedCluster> Acquire(int cluster)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_resident[cluster])
+        {
+            Touch(cluster);
+            return m_resident[cluster];
+        }
+        
+        m_stalls++;
+        while (m_loadState[cluster] == kReading)
+        {
+            m_loadFinished.wait(lock);
+        }
+        if (m_resident[cluster])
+        {
+            Touch(cluster);
+            return m_resident[cluster];
+        }
+        
+        if (m_loadState[cluster] == kQueued)
+        {
+            m_requests.erase(std::find(m_requests.begin(), m_requests.end(), cluster));
+            m_queuedBytes -= GetClusterBytes(cluster);
+        }
+        m_loadState[cluster] = kReading;
+        lock.unlock();
+        std::shared_ptr<const StreamedCluster> data = Read(cluster);
+        lock.lock();
+        Insert(cluster, data);
+        return data;
+    }
+    
+    void PrintStatistics(std::ostream& out)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        out << "Streamed geometry: " << m_directory.size() << " clusters, " << m_loads << " loads ("
+            << m_prefetches << " ahead of use), " << m_stalls << " stalls, "
+            << m_evictions << " evictions, " << m_bytesRead / 1024 << " KB read, peak resident "
+            << m_peakResidentBytes / 1024 << " KB of " << m_budgetBytes / 1024 << " KB budget" << std::endl;
+    }
+    
+private:
+    void Touch(int cluster)
+    {
+        m_lru.splice(m_lru.begin(), m_lru, m_lruPosition[cluster]);
+    }
+    
+    size_t GetClusterBytes(int cluster) const { return m_directory[cluster].m_sphereCount * sizeof(PackedSphere); }
+    
+    // Reads a cluster without holding the lock. A failed read gives an
+    // empty cluster.
+    std::shared_ptr<const StreamedCluster> Read(int cluster) const
+    {
+        const ClusterRecord& record = m_directory[cluster];
+        auto data = std::make_shared<StreamedCluster>();
+        data->m_spheres.resize(record.m_sphereCount);
+        size_t bytes = GetClusterBytes(cluster);
+        if (pread(m_file, data->m_spheres.data(), bytes, record.m_fileOffset) != ssize_t(bytes))
+        {
+            data->m_spheres.clear();
+        }
+        return data;
+    }
+    
+    // Makes a cluster that was just read resident, evicting the least
+    // recently used ones to make room. Call with m_mutex held.
+    void Insert(int cluster, const std::shared_ptr<const StreamedCluster>& data)
+    {
+        const size_t bytes = GetClusterBytes(cluster);
+        m_loads++;
+        m_bytesRead += bytes;
+        while (!m_lru.empty() && m_residentBytes + bytes > m_budgetBytes)
+        {
+            int victim = m_lru.back();
+            m_lru.pop_back();
+            m_residentBytes -= m_resident[victim]->m_spheres.size() * sizeof(PackedSphere);
+            m_resident[victim].reset();
+            m_evictions++;
+        }
+        
+        m_resident[cluster] = data;
+        m_lru.push_front(cluster);
+        m_lruPosition[cluster] = m_lru.begin();
+        m_residentBytes += bytes;
+        m_peakResidentBytes = std::max(m_peakResidentBytes, m_residentBytes);
+        m_loadState[cluster] = kNotLoading;
+        m_loadFinished.notify_all();
+    }
+    
+    // Reads queued clusters in order until the scene is destroyed. Each
+    // loader thread takes the next one, so several reads are in flight.
+    void LoaderMain()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            m_requestAdded.wait(lock, [this] { return m_bStopping || !m_requests.empty(); });
+            if (m_bStopping)
+            {
+                return;
+            }
+            const int cluster = m_requests.front();
+            m_requests.pop_front();
+            m_loadState[cluster] = kReading;
+            lock.unlock();
+            
+            std::shared_ptr<const StreamedCluster> data = Read(cluster);
+            lock.lock();
+            m_queuedBytes -= GetClusterBytes(cluster);
+            m_prefetches++;
+            Insert(cluster, data);
+        }
+    }
+    
+    enum LoadState : char
+    {
+        kNotLoading,
+        kQueued,        // on the loader threads' queue
+        kReading        // by a loader thread or a caller of Acquire()
+    };
+    
+    int                                 m_file;
+    MemoryArena                         m_materialArena;
+    std::vector<shared_ptr<Material>>   m_materials;
+    std::vector<ClusterRecord>          m_directory;
+    BVH                                 m_clusterBVH;
+    
+    std::mutex                                          m_mutex;
+    std::vector<std::shared_ptr<const StreamedCluster>> m_resident;
+    std::list<int>                                      m_lru;
+    std::vector<std::list<int>::iterator>               m_lruPosition;
+    size_t                                              m_budgetBytes;
+    size_t                                              m_residentBytes;
+    size_t                                              m_peakResidentBytes;
+    
+    std::vector<std::thread>    m_loaders;
+    std::condition_variable     m_requestAdded;
+    std::condition_variable     m_loadFinished;
+    std::deque<int>             m_requests;         // read front first
+    std::vector<LoadState>      m_loadState;        // per cluster
+    size_t                      m_queuedBytes;      // queued or being read by a loader thread
+    bool                        m_bStopping;
+    
+    uint64_t                                            m_loads;
+    uint64_t                                            m_evictions;
+    uint64_t                                            m_bytesRead;
+    uint64_t                                            m_prefetches;   // loads by the loader threads
+    uint64_t                                            m_stalls;       // Acquire() calls that waited for or did a read
+};
+
+#endif /* StreamedScene_h */
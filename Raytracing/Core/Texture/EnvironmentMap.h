@@ -0,0 +1,180 @@
+//
+//  EnvironmentMap.h
+//  Raytracing
+//
+//  HDR lighting from a latitude-longitude image surrounding the scene. Row 0
+//  looks straight up (+Y) and the last row straight down; columns go once
+//  around the vertical axis. Texels are piecewise constant, so directions
+//  can be sampled exactly in proportion to their radiance: an alias table
+//  over texels weighted by luminance and solid angle picks one in constant
+//  time, then a point inside it is taken uniformly in (theta, phi).
+//
+
+#ifndef EnvironmentMap_h
+#define EnvironmentMap_h
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../Math/AliasTable.h"
+#include "../Math/Utils.h"
+#include "../Math/Vector.h"
+
+class EnvironmentMap
+{
+public:
+    EnvironmentMap() : m_width(0), m_height(0) {}
+    
+    // Takes width * height linear RGB values, top row first.
+    void SetPixels(int width, int height, std::vector<Vector3> pixels)
+    {
+        m_width = width;
+        m_height = height;
+        m_pixels = std::move(pixels);
+        
+        std::vector<float> weights(m_pixels.size());
+        for (int j = 0; j < m_height; ++j)
+        {
+            const float sinTheta = float(sin((j + 0.5) / m_height * s_kPI));
+            for (int i = 0; i < m_width; ++i)
+            {
+                weights[j * m_width + i] = std::max(0.0f, Luminance(m_pixels[j * m_width + i])) * sinTheta;
+            }
+        }
+        m_distribution.Build(weights);
+    }
+    
+    // Reads a color PFM ("PF" header, bottom row first, endianness from the
+    // sign of the scale). Leaves the map unchanged on failure.
+    bool LoadPFM(const std::string& fileName)
+    {
+        std::ifstream file(fileName.c_str(), std::ios::binary);
+        std::string format;
+        int width = 0, height = 0;
+        double scale = 0;
+        if (!(file >> format >> width >> height >> scale) || format != "PF" || width <= 0 || height <= 0 || scale == 0)
+        {
+            return false;
+        }
+        file.get();     // the single whitespace character ending the header
+        
+        std::vector<float> values(size_t(3) * width * height);
+        if (!file.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(float)))
+        {
+            return false;
+        }
+        
+        const uint16_t probe = 1;
+        const bool bLittleEndianHost = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        if ((scale < 0) != bLittleEndianHost)
+        {
+            for (float& value : values)
+            {
+                uint8_t* bytes = reinterpret_cast<uint8_t*>(&value);
+                std::swap(bytes[0], bytes[3]);
+                std::swap(bytes[1], bytes[2]);
+            }
+        }
+        
+        std::vector<Vector3> pixels(size_t(width) * height);
+        for (int j = 0; j < height; ++j)
+        {
+            const float* row = &values[size_t(3) * (height - 1 - j) * width];
+            for (int i = 0; i < width; ++i)
+            {
+                pixels[size_t(j) * width + i] = Vector3(row[3 * i], row[3 * i + 1], row[3 * i + 2]);
+            }
+        }
+        SetPixels(width, height, std::move(pixels));
+        return true;
+    }
+    
+    bool WritePFM(const std::string& fileName) const
+    {
+        std::ofstream file(fileName.c_str(), std::ios::binary);
+        const uint16_t probe = 1;
+        const bool bLittleEndianHost = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        file << "PF\n" << m_width << " " << m_height << "\n" << (bLittleEndianHost ? "-1.0" : "1.0") << "\n";
+        for (int j = m_height - 1; j >= 0; --j)
+        {
+            for (int i = 0; i < m_width; ++i)
+            {
+                const Vector3& pixel = m_pixels[size_t(j) * m_width + i];
+                float rgb[3] = { pixel.X(), pixel.Y(), pixel.Z() };
+                file.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+            }
+        }
+        return bool(file);
+    }
+    
+    bool IsEmpty() const { return m_pixels.empty(); }
+    int Width() const { return m_width; }
+    int Height() const { return m_height; }
+    
+    Vector3 Lookup(const Vector3& direction) const
+    {
+        return m_pixels[GetTexel(unit_vector(direction))];
+    }
+    
+    // Picks a direction in proportion to radiance times solid angle from
+    // two uniform numbers. Returns false for a map with no light at all.
+    bool Sample(double u1, double u2, Vector3& direction_out, double& pdf_out) const
+    {
+        if (m_distribution.IsEmpty())
+        {
+            return false;
+        }
+        
+        double remainder;
+        const int texel = m_distribution.Sample(u1, remainder);
+        const double theta = (texel / m_width + remainder) / m_height * s_kPI;
+        const double phi = (texel % m_width + u2) / m_width * 2 * s_kPI;
+        const double sinTheta = sin(theta);
+        if (sinTheta <= 0)
+        {
+            return false;
+        }
+        
+        direction_out = Vector3(sinTheta * sin(phi), cos(theta), -sinTheta * cos(phi));
+        pdf_out = m_distribution.Pmf(texel) * m_width * m_height / (2 * s_kPI * s_kPI * sinTheta);
+        return true;
+    }
+    
+    // Solid angle density Sample() has for a unit direction.
+    double Pdf(const Vector3& direction) const
+    {
+        if (m_distribution.IsEmpty())
+        {
+            return 0.0;
+        }
+        
+        const double sinTheta = sqrt(std::max(0.0, 1.0 - double(direction.Y()) * direction.Y()));
+        if (sinTheta <= 0)
+        {
+            return 0.0;
+        }
+        return m_distribution.Pmf(GetTexel(direction)) * m_width * m_height / (2 * s_kPI * s_kPI * sinTheta);
+    }
+
+private:
+    // phi runs from -Z towards +X, matching Sample().
+    int GetTexel(const Vector3& direction) const
+    {
+        double theta = acos(Clamp(direction.Y(), -1.0, 1.0));
+        double phi = atan2(direction.X(), -direction.Z());
+        phi = phi < 0 ? phi + 2 * s_kPI : phi;
+        int i = std::min(int(phi / (2 * s_kPI) * m_width), m_width - 1);
+        int j = std::min(int(theta / s_kPI * m_height), m_height - 1);
+        return j * m_width + i;
+    }
+    
+    int                     m_width;
+    int                     m_height;
+    std::vector<Vector3>    m_pixels;       // top row first
+    AliasTable              m_distribution; // over texels
+};
+
+#endif /* EnvironmentMap_h */
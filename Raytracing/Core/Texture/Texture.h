@@ -0,0 +1,75 @@
+//
+//  Texture.h
+//  Raytracing
+//
+//  Textures looked up by surface (u, v) with a filter footprint in texture
+//  space.
+//
+
+#ifndef Texture_h
+#define Texture_h
+
+#include <math.h>
+#include "TextureCache.h"
+
+class Texture
+{
+public:
+    virtual ~Texture() {}
+    virtual Vector3 Value(float u, float v, float uvFootprint) const = 0;
+};
+
+// Trilinear mip-mapped lookup through a TextureCache. u wraps, v clamps.
+class ImageTexture : public Texture
+{
+public:
+    ImageTexture(TextureCache* cache, int textureId) : m_cache(cache), m_textureId(textureId) {}
+    
+    virtual Vector3 Value(float u, float v, float uvFootprint) const
+    {
+        const TextureInfo& info = m_cache->GetInfo(m_textureId);
+        const int numLevels = int(info.m_levels.size());
+        const TextureLevel& base = info.m_levels[0];
+        
+        double texels = uvFootprint * std::max(base.m_width, base.m_height);
+        double lod = texels > 1 ? log2(texels) : 0.0;
+        lod = std::min(lod, double(numLevels - 1));
+        int level = int(lod);
+        float blend = float(lod - level);
+        
+        Vector3 color = Bilinear(level, u, v);
+        if (blend > 0 && level + 1 < numLevels)
+        {
+            color = (1 - blend) * color + blend * Bilinear(level + 1, u, v);
+        }
+        return color;
+    }
+    
+private:
+    Vector3 Bilinear(int level, float u, float v) const
+    {
+        const TextureLevel& info = m_cache->GetInfo(m_textureId).m_levels[level];
+        
+        // Texel rows are stored top to bottom.
+        float x = (u - floorf(u)) * info.m_width - 0.5f;
+        float y = (1 - Clamp(v, 0, 1)) * info.m_height - 0.5f;
+        int x0 = int(floorf(x));
+        int y0 = int(floorf(y));
+        float fx = x - x0;
+        float fy = y - y0;
+        
+        int x1 = (x0 + 1) % info.m_width;
+        x0 = (x0 + info.m_width) % info.m_width;
+        int y1 = std::min(y0 + 1, info.m_height - 1);
+        y0 = std::max(y0, 0);
+        
+        Vector3 top = (1 - fx) * m_cache->Fetch(m_textureId, level, x0, y0) + fx * m_cache->Fetch(m_textureId, level, x1, y0);
+        Vector3 bottom = (1 - fx) * m_cache->Fetch(m_textureId, level, x0, y1) + fx * m_cache->Fetch(m_textureId, level, x1, y1);
+        return (1 - fy) * top + fy * bottom;
+    }
+    
+    TextureCache*   m_cache;
+    int             m_textureId;
+};
+
+#endif /* Texture_h */
@@ -0,0 +1,493 @@
+//
+//  TextureCache.h
+//  Raytracing
+//
+//  On-demand texture tile cache with a fixed memory budget.
+//
+//  Textures are stored on disk in a tiled, mip-mapped format produced by
+//  ConvertPPM(). Only the header of a texture is read when it is opened;
+//  tiles are read with pread() the first time a lookup touches them and are
+//  evicted least-recently-used once the budget is exceeded. The cache is
+//  split into shards with their own lock, and every thread keeps a few
+//  recently used tiles as hints that are checked before taking any lock.
+//
+
+#ifndef TextureCache_h
+#define TextureCache_h
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../Math/Vector.h"
+
+// 8-bit RGB texels stored gamma 2 encoded like the PPM output.
+struct TextureTile
+{
+    std::vector<unsigned char> m_texels;
+};
+
+struct TextureLevel
+{
+    int         m_width;
+    int         m_height;
+    int         m_tilesX;
+    int         m_tilesY;
+    uint64_t    m_fileOffset;
+};
+
+struct TextureInfo
+{
+    int m_file;
+    int m_tileSize;
+    std::vector<TextureLevel> m_levels;
+};
+
+class TextureCache
+{
+public:
+    static const uint32_t s_kMagic = 0x58545452;   // "RTTX"
+    static const int s_kNumShards = 16;
+    static const int s_kNumHints = 4;
+    
+    TextureCache(size_t budgetBytes) :
+    m_budgetBytes(budgetBytes), m_hintHits(0), m_cacheHits(0), m_misses(0), m_evictions(0), m_bytesRead(0)
+    {
+        static std::atomic<uint64_t> s_nextCacheId(1);
+        m_cacheId = s_nextCacheId.fetch_add(1);
+    }
+    
+    ~TextureCache()
+    {
+        for (auto& texture : m_textures)
+        {
+            close(texture.m_file);
+        }
+    }
+    
+    // Converts a P3 or P6 PPM image into the tiled mip-mapped format. The
+    // image is read a row at a time and never held whole: every level of the
+    // pyramid keeps one band of tileSize rows, written out as tiles once
+    // full, and each pair of rows is filtered into the level below as soon
+    // as it arrives. Memory use is about two bands of the source image.
+    static bool ConvertPPM(const std::string& ppmFileName, const std::string& tiledFileName, int tileSize = 64)
+    {
+        PPMReader reader;
+        if (tileSize < 2 || !reader.Open(ppmFileName))
+        {
+            return false;
+        }
+        
+        std::vector<PyramidLevel> levels;
+        for (int width = reader.m_width, height = reader.m_height; ; width = std::max(1, width / 2), height = std::max(1, height / 2))
+        {
+            PyramidLevel level;
+            level.m_width = width;
+            level.m_height = height;
+            level.m_tilesX = (width + tileSize - 1) / tileSize;
+            level.m_numRows = 0;
+            level.m_fileOffset = 0;
+            level.m_band.resize(size_t(tileSize) * width * 3);
+            levels.push_back(std::move(level));
+            if (width == 1 && height == 1)
+            {
+                break;
+            }
+        }
+        
+        std::ofstream out(tiledFileName.c_str(), std::ios::binary);
+        if (!out)
+        {
+            return false;
+        }
+        
+        uint32_t header[3] = { s_kMagic, uint32_t(tileSize), uint32_t(levels.size()) };
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        uint64_t offset = sizeof(header) + levels.size() * 2 * sizeof(uint32_t);
+        for (PyramidLevel& level : levels)
+        {
+            uint32_t levelSize[2] = { uint32_t(level.m_width), uint32_t(level.m_height) };
+            out.write(reinterpret_cast<const char*>(levelSize), sizeof(levelSize));
+            level.m_fileOffset = offset;
+            offset += uint64_t(level.m_tilesX) * ((level.m_height + tileSize - 1) / tileSize) * TileBytes(tileSize);
+        }
+        
+        for (int y = 0; y < reader.m_height; ++y)
+        {
+            if (!reader.ReadRow(GetBandRow(levels[0], y, tileSize)))
+            {
+                return false;
+            }
+            FinishRow(levels, 0, tileSize, out);
+        }
+        return bool(out);
+    }
+    
+    // Reads the header of a converted texture. Returns its id or -1. Open
+    // every texture before rendering starts.
+    int Open(const std::string& tiledFileName)
+    {
+        int file = open(tiledFileName.c_str(), O_RDONLY);
+        if (file < 0)
+        {
+            return -1;
+        }
+        
+        uint32_t header[3];
+        if (pread(file, header, sizeof(header), 0) != sizeof(header) || header[0] != s_kMagic)
+        {
+            close(file);
+            return -1;
+        }
+        
+        TextureInfo info;
+        info.m_file = file;
+        info.m_tileSize = header[1];
+        uint64_t offset = sizeof(header) + header[2] * 2 * sizeof(uint32_t);
+        for (uint32_t l = 0; l < header[2]; ++l)
+        {
+            uint32_t size[2];
+            if (pread(file, size, sizeof(size), sizeof(header) + l * sizeof(size)) != sizeof(size))
+            {
+                close(file);
+                return -1;
+            }
+            
+            TextureLevel level;
+            level.m_width = size[0];
+            level.m_height = size[1];
+            level.m_tilesX = (level.m_width + info.m_tileSize - 1) / info.m_tileSize;
+            level.m_tilesY = (level.m_height + info.m_tileSize - 1) / info.m_tileSize;
+            level.m_fileOffset = offset;
+            offset += uint64_t(level.m_tilesX) * level.m_tilesY * TileBytes(info.m_tileSize);
+            info.m_levels.push_back(level);
+        }
+        
+        std::unique_lock<std::mutex> lock(m_texturesMutex);
+        m_textures.push_back(info);
+        return int(m_textures.size()) - 1;
+    }
+    
+    const TextureInfo& GetInfo(int textureId) const { return m_textures[textureId]; }
+    
+    // Linear RGB of one texel; coordinates must be inside the level.
+    Vector3 Fetch(int textureId, int level, int x, int y)
+    {
+        const TextureInfo& info = m_textures[textureId];
+        const int tileSize = info.m_tileSize;
+        const TextureTile* tile = GetTile(textureId, level, x / tileSize, y / tileSize);
+        if (!tile)
+        {
+            return Vector3::GetZero();
+        }
+        
+        const unsigned char* texel = &tile->m_texels[((y % tileSize) * tileSize + (x % tileSize)) * 3];
+        return Vector3(s_decode[texel[0]], s_decode[texel[1]], s_decode[texel[2]]);
+    }
+    
+    void PrintStatistics(std::ostream& out) const
+    {
+        uint64_t hits = m_hintHits + m_cacheHits;
+        uint64_t lookups = hits + m_misses;
+        out << "Texture cache: " << lookups << " tile lookups, "
+            << (lookups ? 100.0 * hits / lookups : 0.0) << "% hit rate ("
+            << m_hintHits << " thread hints, " << m_cacheHits << " shared), "
+            << m_misses << " misses, " << m_evictions << " evictions, "
+            << m_bytesRead / 1024 << " KB read, budget " << m_budgetBytes / 1024 << " KB" << std::endl;
+    }
+    
+private:
+    struct CacheEntry
+    {
+        uint64_t m_key;
+        std::shared_ptr<const TextureTile> m_tile;
+    };
+    
+    struct Shard
+    {
+        std::mutex m_mutex;
+        std::list<CacheEntry> m_lru;    // most recently used first
+        std::unordered_map<uint64_t, std::list<CacheEntry>::iterator> m_entries;
+        size_t m_bytes = 0;
+    };
+    
+    // A hint keeps its tile alive even after the shard evicted it.
+    struct TileHint
+    {
+        uint64_t m_cacheId = 0;
+        uint64_t m_key = 0;
+        std::shared_ptr<const TextureTile> m_tile;
+    };
+    
+    static size_t TileBytes(int tileSize) { return size_t(tileSize) * tileSize * 3; }
+    
+    static uint64_t MakeKey(int textureId, int level, int tileX, int tileY)
+    {
+        return (uint64_t(textureId) << 48) | (uint64_t(level) << 40) | (uint64_t(tileY) << 20) | uint64_t(tileX);
+    }
+    
+    const TextureTile* GetTile(int textureId, int level, int tileX, int tileY)
+    {
+        const uint64_t key = MakeKey(textureId, level, tileX, tileY);
+        
+        static thread_local TileHint s_hints[s_kNumHints];
+        static thread_local int s_nextHint = 0;
+        for (int h = 0; h < s_kNumHints; ++h)
+        {
+            if (s_hints[h].m_key == key && s_hints[h].m_cacheId == m_cacheId && s_hints[h].m_tile)
+            {
+                m_hintHits.fetch_add(1, std::memory_order_relaxed);
+                return s_hints[h].m_tile.get();
+            }
+        }
+        
+        std::shared_ptr<const TextureTile> tile = Lookup(key);
+        if (tile)
+        {
+            m_cacheHits.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            m_misses.fetch_add(1, std::memory_order_relaxed);
+            tile = LoadTile(textureId, level, tileX, tileY);
+            if (!tile)
+            {
+                return nullptr;
+            }
+            tile = Insert(key, tile);
+        }
+        
+        TileHint& hint = s_hints[s_nextHint];
+        s_nextHint = (s_nextHint + 1) % s_kNumHints;
+        hint.m_cacheId = m_cacheId;
+        hint.m_key = key;
+        hint.m_tile = tile;
+        return tile.get();
+    }
+    
+    Shard& GetShard(uint64_t key) { return m_shards[(key * 0x9E3779B97F4A7C15ull) >> 60]; }
+    
+    size_t ShardBudget() const
+    {
+        return std::max(m_budgetBytes / s_kNumShards, TileBytes(64));
+    }
+    
+    std::shared_ptr<const TextureTile> Lookup(uint64_t key)
+    {
+        Shard& shard = GetShard(key);
+        std::unique_lock<std::mutex> lock(shard.m_mutex);
+        auto found = shard.m_entries.find(key);
+        if (found == shard.m_entries.end())
+        {
+            return nullptr;
+        }
+        shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, found->second);
+        return found->second->m_tile;
+    }
+    
+    // Another thread may have loaded the same tile meanwhile; keep theirs.
+    std::shared_ptr<const TextureTile> Insert(uint64_t key, const std::shared_ptr<const TextureTile>& tile)
+    {
+        Shard& shard = GetShard(key);
+        std::unique_lock<std::mutex> lock(shard.m_mutex);
+        auto found = shard.m_entries.find(key);
+        if (found != shard.m_entries.end())
+        {
+            return found->second->m_tile;
+        }
+        
+        const size_t tileBytes = tile->m_texels.size();
+        while (!shard.m_lru.empty() && shard.m_bytes + tileBytes > ShardBudget())
+        {
+            shard.m_bytes -= shard.m_lru.back().m_tile->m_texels.size();
+            shard.m_entries.erase(shard.m_lru.back().m_key);
+            shard.m_lru.pop_back();
+            m_evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        
+        shard.m_lru.push_front({ key, tile });
+        shard.m_entries[key] = shard.m_lru.begin();
+        shard.m_bytes += tileBytes;
+        return tile;
+    }
+    
+    std::shared_ptr<const TextureTile> LoadTile(int textureId, int level, int tileX, int tileY)
+    {
+        const TextureInfo& info = m_textures[textureId];
+        const TextureLevel& levelInfo = info.m_levels[level];
+        const size_t tileBytes = TileBytes(info.m_tileSize);
+        
+        auto tile = std::make_shared<TextureTile>();
+        tile->m_texels.resize(tileBytes);
+        uint64_t offset = levelInfo.m_fileOffset + (uint64_t(tileY) * levelInfo.m_tilesX + tileX) * tileBytes;
+        if (pread(info.m_file, tile->m_texels.data(), tileBytes, offset) != ssize_t(tileBytes))
+        {
+            return nullptr;
+        }
+        m_bytesRead.fetch_add(tileBytes, std::memory_order_relaxed);
+        return tile;
+    }
+    
+    // A PPM image read one row at a time.
+    struct PPMReader
+    {
+        bool Open(const std::string& fileName)
+        {
+            m_in.open(fileName.c_str(), std::ios::binary);
+            m_in >> m_magic >> m_width >> m_height >> m_maxValue;
+            if (!m_in || (m_magic != "P3" && m_magic != "P6") || m_width <= 0 || m_height <= 0 || m_maxValue <= 0 || m_maxValue > 255)
+            {
+                return false;
+            }
+            m_in.get();
+            return true;
+        }
+        
+        // Linear RGB of the next row. PPM rows run top to bottom, texture v
+        // runs bottom to top; the tiled format keeps the file order and
+        // lookups flip v.
+        bool ReadRow(float* linear_out)
+        {
+            for (int i = 0; i < m_width * 3; ++i)
+            {
+                int value = 0;
+                if (m_magic == "P6")
+                {
+                    value = m_in.get();
+                }
+                else
+                {
+                    m_in >> value;
+                }
+                if (!m_in)
+                {
+                    return false;
+                }
+                float encoded = float(value) / m_maxValue;
+                linear_out[i] = encoded * encoded;
+            }
+            return true;
+        }
+        
+        std::ifstream   m_in;
+        std::string     m_magic;
+        int             m_width = 0;
+        int             m_height = 0;
+        int             m_maxValue = 0;
+    };
+    
+    // A level of the pyramid being built by ConvertPPM(). Row y lives in the
+    // band at y % tileSize until the band is written out.
+    struct PyramidLevel
+    {
+        int                 m_width;
+        int                 m_height;
+        int                 m_tilesX;
+        int                 m_numRows;  // received so far
+        uint64_t            m_fileOffset;
+        std::vector<float>  m_band;
+    };
+    
+    static float* GetBandRow(PyramidLevel& level, int y, int tileSize)
+    {
+        return &level.m_band[size_t(y % tileSize) * level.m_width * 3];
+    }
+    
+    // Call once the next row of level l is in its band. Writes the band out
+    // when it is complete and filters every second row with the one before
+    // into the next level, which is finished in turn.
+    static void FinishRow(std::vector<PyramidLevel>& levels, size_t l, int tileSize, std::ofstream& out)
+    {
+        PyramidLevel& level = levels[l];
+        const int y = level.m_numRows++;
+        if (y % tileSize == tileSize - 1 || y == level.m_height - 1)
+        {
+            WriteBand(level, y / tileSize, tileSize, out);
+        }
+        if (l + 1 == levels.size() || (y % 2 == 0 && level.m_height > 1))
+        {
+            return;
+        }
+        
+        // 2x2 box filter in linear space. Odd sizes drop their last row or
+        // column, and a single row or column is filtered with itself. The
+        // band still holds row y - 1, as tileSize is at least 2.
+        PyramidLevel& next = levels[l + 1];
+        const float* upper = GetBandRow(level, level.m_height > 1 ? y - 1 : y, tileSize);
+        const float* lower = GetBandRow(level, y, tileSize);
+        float* filtered = GetBandRow(next, next.m_numRows, tileSize);
+        for (int x = 0; x < next.m_width; ++x)
+        {
+            const int left = 2 * x * 3;
+            const int right = std::min(2 * x + 1, level.m_width - 1) * 3;
+            for (int c = 0; c < 3; ++c)
+            {
+                filtered[x * 3 + c] = (upper[left + c] + upper[right + c] + lower[left + c] + lower[right + c]) * 0.25f;
+            }
+        }
+        FinishRow(levels, l + 1, tileSize, out);
+    }
+    
+    // Writes the tiles of band tileY, gamma 2 encoded and padded with black.
+    static void WriteBand(PyramidLevel& level, int tileY, int tileSize, std::ofstream& out)
+    {
+        std::vector<unsigned char> tile(TileBytes(tileSize));
+        const int numRows = std::min(tileSize, level.m_height - tileY * tileSize);
+        out.seekp(level.m_fileOffset + uint64_t(tileY) * level.m_tilesX * tile.size());
+        for (int tileX = 0; tileX < level.m_tilesX; ++tileX)
+        {
+            std::fill(tile.begin(), tile.end(), 0);
+            for (int y = 0; y < numRows; ++y)
+            {
+                const float* row = GetBandRow(level, y, tileSize);
+                for (int x = 0; x < tileSize && tileX * tileSize + x < level.m_width; ++x)
+                {
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        float encoded = sqrt(Clamp(row[(tileX * tileSize + x) * 3 + c], 0.0, 1.0));
+                        tile[(y * tileSize + x) * 3 + c] = static_cast<unsigned char>(encoded * 255 + 0.5f);
+                    }
+                }
+            }
+            out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+        }
+    }
+    
+    struct DecodeTable
+    {
+        float m_values[256];
+        DecodeTable()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                float encoded = i / 255.0f;
+                m_values[i] = encoded * encoded;
+            }
+        }
+        float operator[](int i) const { return m_values[i]; }
+    };
+    static inline const DecodeTable s_decode;
+    
+    size_t                      m_budgetBytes;
+    uint64_t                    m_cacheId;
+    std::mutex                  m_texturesMutex;
+    std::vector<TextureInfo>    m_textures;
+    Shard                       m_shards[s_kNumShards];
+    
+    std::atomic<uint64_t>       m_hintHits;
+    std::atomic<uint64_t>       m_cacheHits;
+    std::atomic<uint64_t>       m_misses;
+    std::atomic<uint64_t>       m_evictions;
+    std::atomic<uint64_t>       m_bytesRead;
+};
+
+#endif /* TextureCache_h */
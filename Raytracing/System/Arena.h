@@ -0,0 +1,162 @@
+//
+//  Arena.h
+//  Raytracing
+//
+//  Bump allocator handing out memory from large blocks that are released all
+//  at once, plus an allocator adaptor so shared objects and their control
+//  blocks can live inside an arena.
+//
+
+#ifndef Arena_h
+#define Arena_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class MemoryArena
+{
+public:
+    MemoryArena(size_t blockSize = 64 * 1024) :
+    m_blockSize(blockSize), m_currentBlock(0), m_offset(0)
+    {
+    }
+    
+    ~MemoryArena()
+    {
+        for (auto& block : m_blocks)
+        {
+            ::operator delete(block.m_memory);
+        }
+    }
+    
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+    
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+    {
+        while (m_currentBlock < m_blocks.size())
+        {
+            Block& block = m_blocks[m_currentBlock];
+            size_t aligned = (m_offset + alignment - 1) & ~(alignment - 1);
+            if (aligned + size <= block.m_size)
+            {
+                m_offset = aligned + size;
+                return static_cast<char*>(block.m_memory) + aligned;
+            }
+            
+            // Move on to the next block retained by a previous Reset().
+            ++m_currentBlock;
+            m_offset = 0;
+        }
+        
+        size_t blockSize = size + alignment > m_blockSize ? size + alignment : m_blockSize;
+        m_blocks.push_back({ ::operator new(blockSize), blockSize });
+        m_currentBlock = m_blocks.size() - 1;
+        m_offset = 0;
+        return Allocate(size, alignment);
+    }
+    
+    // Default constructs the elements, which does nothing for trivial types.
+    // Nothing is ever destroyed, hence the destructor requirement.
+    template<typename T>
+    T* AllocateArray(size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena arrays are released without destruction");
+        T* elements = static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+        std::uninitialized_default_construct_n(elements, count);
+        return elements;
+    }
+    
+    // Keeps the blocks for reuse; nothing allocated before is valid afterwards.
+    void Reset()
+    {
+        m_currentBlock = 0;
+        m_offset = 0;
+    }
+    
+    size_t BytesReserved() const
+    {
+        size_t total = 0;
+        for (auto& block : m_blocks)
+        {
+            total += block.m_size;
+        }
+        return total;
+    }
+    
+private:
+    struct Block
+    {
+        void*   m_memory;
+        size_t  m_size;
+    };
+    
+    size_t              m_blockSize;
+    size_t              m_currentBlock;
+    size_t              m_offset;
+    std::vector<Block>  m_blocks;
+};
+
+// Standard allocator over a MemoryArena. Deallocation is a no-op, the memory
+// goes away with the arena.
+template<typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+    
+    ArenaAllocator(MemoryArena& arena) : m_arena(&arena) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.GetArena()) {}
+    
+    T* allocate(size_t count) { return static_cast<T*>(m_arena->Allocate(sizeof(T) * count, alignof(T))); }
+    void deallocate(T*, size_t) {}
+    
+    MemoryArena* GetArena() const { return m_arena; }
+    
+    template<typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return m_arena == other.GetArena(); }
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return m_arena != other.GetArena(); }
+    
+private:
+    MemoryArena* m_arena;
+};
+
+// Object and control block are placed next to each other in the arena.
+template<typename T, typename... Args>
+std::shared_ptr<T> MakeShared(MemoryArena& arena, Args&&... args)
+{
+    return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+}
+
+// Per-worker scratch memory for temporary per-tile and per-sample data. Reset
+// it when the data is no longer needed; it never returns memory to the heap.
+inline MemoryArena& GetScratchArena()
+{
+    static thread_local MemoryArena s_scratchArena(256 * 1024);
+    return s_scratchArena;
+}
+
+// Counts heap allocations. The counting operator new lives in main.cpp and is
+// only compiled in when TRACK_ALLOCATIONS is set, see the
+// RAYTRACING_TRACK_ALLOCATIONS CMake option.
+struct AllocationCounter
+{
+    static std::atomic<uint64_t>& Count()
+    {
+        static std::atomic<uint64_t> s_count(0);
+        return s_count;
+    }
+    
+    static uint64_t Get() { return Count().load(std::memory_order_relaxed); }
+    static void Increment() { Count().fetch_add(1, std::memory_order_relaxed); }
+};
+
+#endif /* Arena_h */
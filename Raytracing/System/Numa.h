@@ -0,0 +1,162 @@
+//
+//  Numa.h
+//  Raytracing
+//
+//  NUMA topology discovery from sysfs and thread pinning. Only the CPUs the
+//  process may run on (its sched_getaffinity mask, e.g. under taskset or a
+//  cpuset) are reported, and nodes left without any are dropped. On systems
+//  without /sys/devices/system/node (or outside Linux) everything is
+//  reported as a single node and pinning fails.
+//
+
+#ifndef Numa_h
+#define Numa_h
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+struct NumaNode
+{
+    int                 m_id;
+    std::vector<int>    m_cpus;
+};
+
+class NumaTopology
+{
+public:
+    static NumaTopology Detect()
+    {
+        NumaTopology topology;
+        const std::vector<int> allowedCpus = GetAllowedCpus();
+        DIR* directory = opendir("/sys/devices/system/node");
+        if (directory)
+        {
+            while (dirent* entry = readdir(directory))
+            {
+                std::string name = entry->d_name;
+                if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+                {
+                    continue;
+                }
+                
+                NumaNode node;
+                node.m_id = atoi(name.c_str() + 4);
+                std::ifstream cpuList(("/sys/devices/system/node/" + name + "/cpulist").c_str());
+                std::string list;
+                if (std::getline(cpuList, list))
+                {
+                    node.m_cpus = ParseCpuList(list);
+                }
+                if (!allowedCpus.empty())
+                {
+                    std::vector<int> cpus;
+                    std::sort(node.m_cpus.begin(), node.m_cpus.end());
+                    std::set_intersection(node.m_cpus.begin(), node.m_cpus.end(),
+                                          allowedCpus.begin(), allowedCpus.end(), std::back_inserter(cpus));
+                    node.m_cpus.swap(cpus);
+                }
+                
+                // Memory-only nodes, and nodes the process may not run on,
+                // have no CPUs to run workers on.
+                if (!node.m_cpus.empty())
+                {
+                    topology.m_nodes.push_back(node);
+                }
+            }
+            closedir(directory);
+        }
+        
+        if (topology.m_nodes.empty())
+        {
+            NumaNode node;
+            node.m_id = 0;
+            node.m_cpus = allowedCpus;
+            unsigned int numCpus = std::thread::hardware_concurrency();
+            for (unsigned int cpu = 0; node.m_cpus.empty() && cpu < (numCpus ? numCpus : 1); ++cpu)
+            {
+                node.m_cpus.push_back(cpu);
+            }
+            topology.m_nodes.push_back(node);
+        }
+        
+        std::sort(topology.m_nodes.begin(), topology.m_nodes.end(),
+                  [](const NumaNode& a, const NumaNode& b) { return a.m_id < b.m_id; });
+        return topology;
+    }
+    
+    // Sorted CPUs of the calling thread's affinity mask; empty when it is
+    // unknown.
+    static std::vector<int> GetAllowedCpus()
+    {
+        std::vector<int> cpus;
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &set))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+#endif
+        return cpus;
+    }
+    
+    // "0-3,8-11" -> 0 1 2 3 8 9 10 11
+    static std::vector<int> ParseCpuList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::stringstream stream(list);
+        std::string range;
+        while (std::getline(stream, range, ','))
+        {
+            if (range.empty())
+            {
+                continue;
+            }
+            size_t dash = range.find('-');
+            int first = atoi(range.c_str());
+            int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+    
+    int GetNodeCount() const { return int(m_nodes.size()); }
+    const NumaNode& GetNode(int index) const { return m_nodes[index]; }
+    
+    static bool PinThreadToCpu(std::thread& thread, int cpu)
+    {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+    
+private:
+    std::vector<NumaNode> m_nodes;
+};
+
+#endif /* Numa_h */
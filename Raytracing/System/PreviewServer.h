@@ -0,0 +1,253 @@
+//
+//  PreviewServer.h
+//  Raytracing
+//
+//  Long-running preview mode. The scene and the worker threads stay resident
+//  while camera and render parameters arrive as text commands on an input
+//  stream, one per line:
+//
+//      lookfrom x y z | lookat x y z | vup x y z | fov degrees
+//      aperture a | focus distance | spp n | depth n
+//      sampler random|stratified | hemisphere 0|1 | save file | quit
+//
+//  Every change restarts the image: a reduced resolution, 1 spp frame is
+//  written first, then full resolution passes refine it until the target
+//  spp is reached. In-flight tiles of a stale view are cancelled.
+//
+
+#ifndef PreviewServer_h
+#define PreviewServer_h
+
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "ThreadPool.h"
+#include "../Core/Render/Renderer.h"
+
+struct PreviewSettings
+{
+    int m_width = 780;
+    int m_height = 520;
+    int m_previewScale = 8;        // first frame is width/scale x height/scale
+    int m_previewDepth = 4;        // bounce limit of the first frame
+    int m_samplesPerPass = 1;
+    int m_targetSamplesPerPixel = 100;
+    int m_maxDepth = 50;
+    SamplerType m_sampler = SamplerType::Random;
+    bool m_diffuseInHemisphere = DIFFUSE_IN_HEMISPHERE;
+    std::string m_outputFile = "preview.ppm";
+};
+
+class PreviewServer
+{
+public:
+    PreviewServer(const Hittable& world, ThreadPool* threadPool, const CameraSettings& camera, const PreviewSettings& settings) :
+    m_world(world), m_renderer(threadPool), m_camera(camera), m_settings(settings),
+    m_bQuit(false), m_bInputClosed(false)
+    {
+    }
+    
+    ~PreviewServer()
+    {
+        if (m_inputThread.joinable())
+        {
+            m_inputThread.join();
+        }
+    }
+    
+    // Blocks until "quit" is received, or until the input closes and the
+    // last view has reached its target sample count.
+    void Run(std::istream& input)
+    {
+        m_inputThread = std::thread(&PreviewServer::ReadCommands, this, std::ref(input));
+        
+        FrameBuffer previewBuffer;
+        FrameBuffer frameBuffer(m_settings.m_width, m_settings.m_height);
+        int samplesDone = 0;
+        bool bNeedsPreview = true;
+        auto viewChangeTime = std::chrono::high_resolution_clock::now();
+        
+        while (true)
+        {
+            if (ApplyPendingCommands(frameBuffer))
+            {
+                frameBuffer.Resize(m_settings.m_width, m_settings.m_height);
+                samplesDone = 0;
+                bNeedsPreview = true;
+                viewChangeTime = std::chrono::high_resolution_clock::now();
+            }
+            
+            if (m_bQuit)
+            {
+                break;
+            }
+            
+            const double aspect = double(m_settings.m_width) / m_settings.m_height;
+            Camera camera = m_camera.Build(aspect);
+            
+            if (bNeedsPreview)
+            {
+                RenderSettings settings;
+                settings.m_samplesPerPixel = 1;
+                settings.m_maxDepth = m_settings.m_previewDepth;
+                settings.m_diffuseInHemisphere = m_settings.m_diffuseInHemisphere;
+                previewBuffer.Resize(std::max(1, m_settings.m_width / m_settings.m_previewScale),
+                                     std::max(1, m_settings.m_height / m_settings.m_previewScale));
+                if (m_renderer.RenderPass(m_world, camera, settings, previewBuffer, &m_cancelToken))
+                {
+                    previewBuffer.WritePPM(m_settings.m_outputFile);
+                    bNeedsPreview = false;
+                    cout << "[preview] first image " << previewBuffer.Width() << "x" << previewBuffer.Height()
+                         << " in " << MillisecondsSince(viewChangeTime) << " ms" << endl;
+                }
+                continue;
+            }
+            
+            if (samplesDone < m_settings.m_targetSamplesPerPixel)
+            {
+                RenderSettings settings;
+                settings.m_samplesPerPixel = std::min(m_settings.m_samplesPerPass,
+                                                      m_settings.m_targetSamplesPerPixel - samplesDone);
+                settings.m_maxDepth = m_settings.m_maxDepth;
+                settings.m_sampler = m_settings.m_sampler;
+                settings.m_diffuseInHemisphere = m_settings.m_diffuseInHemisphere;
+                if (m_renderer.RenderPass(m_world, camera, settings, frameBuffer, &m_cancelToken))
+                {
+                    samplesDone += settings.m_samplesPerPixel;
+                    frameBuffer.WritePPM(m_settings.m_outputFile);
+                    cout << "[preview] " << samplesDone << " spp after "
+                         << MillisecondsSince(viewChangeTime) << " ms" << endl;
+                }
+                continue;
+            }
+            
+            std::unique_lock<std::mutex> lock(m_commandMutex);
+            if (m_bInputClosed && m_pendingCommands.empty())
+            {
+                break;
+            }
+            m_commandCondition.wait(lock, [this]() { return !m_pendingCommands.empty() || m_bInputClosed; });
+        }
+        
+        // The loop only ends after the reader has seen "quit" or the end of
+        // the input, so it is not blocked on the stream any more.
+        m_inputThread.join();
+    }
+    
+private:
+    static double MillisecondsSince(std::chrono::high_resolution_clock::time_point start)
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::milli>(now - start).count();
+    }
+    
+    // Reads until "quit" or the end of the input, and reads nothing after
+    // "quit" so that Run() can join the thread without waiting for input.
+    void ReadCommands(std::istream& input)
+    {
+        std::string line;
+        while (std::getline(input, line))
+        {
+            if (line.empty())
+            {
+                continue;
+            }
+            
+            {
+                std::unique_lock<std::mutex> lock(m_commandMutex);
+                m_pendingCommands.push_back(line);
+            }
+            
+            // Saving does not change the image, anything else invalidates it.
+            if (line.compare(0, 4, "save") != 0)
+            {
+                m_cancelToken.Cancel();
+            }
+            m_commandCondition.notify_one();
+            
+            std::string command;
+            std::istringstream(line) >> command;
+            if (command == "quit")
+            {
+                break;
+            }
+        }
+        
+        {
+            std::unique_lock<std::mutex> lock(m_commandMutex);
+            m_bInputClosed = true;
+        }
+        m_commandCondition.notify_one();
+    }
+    
+    // Returns true if any command changed the view.
+    bool ApplyPendingCommands(const FrameBuffer& frameBuffer)
+    {
+        std::deque<std::string> commands;
+        {
+            std::unique_lock<std::mutex> lock(m_commandMutex);
+            commands.swap(m_pendingCommands);
+        }
+        
+        bool bViewChanged = false;
+        for (const std::string& line : commands)
+        {
+            std::istringstream stream(line);
+            std::string command;
+            stream >> command;
+            
+            if (command == "lookfrom")      { stream >> m_camera.m_lookFrom; }
+            else if (command == "lookat")   { stream >> m_camera.m_lookAt; }
+            else if (command == "vup")      { stream >> m_camera.m_vup; }
+            else if (command == "fov")      { stream >> m_camera.m_vfov; }
+            else if (command == "aperture") { stream >> m_camera.m_aperture; }
+            else if (command == "focus")    { stream >> m_camera.m_focusDistance; }
+            else if (command == "spp")      { stream >> m_settings.m_targetSamplesPerPixel; }
+            else if (command == "depth")    { stream >> m_settings.m_maxDepth; }
+            else if (command == "hemisphere") { stream >> m_settings.m_diffuseInHemisphere; }
+            else if (command == "sampler")
+            {
+                std::string name;
+                stream >> name;
+                m_settings.m_sampler = (name == "stratified") ? SamplerType::Stratified : SamplerType::Random;
+            }
+            else if (command == "quit")     { m_bQuit = true; }
+            else if (command == "save")
+            {
+                std::string fileName;
+                stream >> fileName;
+                if (!frameBuffer.WritePPM(fileName))
+                {
+                    cout << "[preview] could not write " << fileName << endl;
+                }
+                continue;
+            }
+            else
+            {
+                cout << "[preview] unknown command: " << line << endl;
+                continue;
+            }
+            
+            bViewChanged = true;
+        }
+        
+        return bViewChanged;
+    }
+    
+    const Hittable&     m_world;
+    Renderer            m_renderer;
+    CameraSettings      m_camera;
+    PreviewSettings     m_settings;
+    CancelToken         m_cancelToken;
+    bool                m_bQuit;
+    
+    std::thread                 m_inputThread;
+    std::mutex                  m_commandMutex;
+    std::condition_variable     m_commandCondition;
+    std::deque<std::string>     m_pendingCommands;
+    bool                        m_bInputClosed;
+};
+
+#endif /* PreviewServer_h */
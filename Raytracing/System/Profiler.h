@@ -0,0 +1,309 @@
+//
+//  Profiler.h
+//  Raytracing
+//
+//  Opt-in hardware counter profiling of the render phases. Every thread opens
+//  its own perf_event counters on first use; counter deltas are charged to
+//  the innermost open phase, so nested phases (shading that traces a bounce)
+//  are reported exclusively. Counters the kernel refuses are skipped, and on
+//  systems without perf_event_open the profiler reports nothing.
+//
+//  Every phase boundary reads the counters with a system call, so scopes
+//  enclose batches of work, a packet, a bounce of a wavefront or a row of
+//  scalar paths, and never a single ray; the syscalls would otherwise be a
+//  good part of what is measured. Rays are counted without a boundary.
+//
+
+#ifndef Profiler_h
+#define Profiler_h
+
+#include <stdint.h>
+#include <string.h>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum ProfilePhase
+{
+    kPhaseSceneBuild,
+    kPhaseRayGeneration,
+    kPhaseTraversal,
+    kPhaseShading,
+    kPhasePaths,        // scalar paths, tracing and shading one ray at a time
+    kPhaseOutput,
+    kPhaseCount
+};
+
+enum ProfileCounter
+{
+    kCounterCycles,
+    kCounterInstructions,
+    kCounterCacheMisses,
+    kCounterBranchMisses,
+    kCounterTaskClock,
+    kCounterCount
+};
+
+// The counters of one thread, read together as a perf_event group.
+class PerfCounterGroup
+{
+public:
+    PerfCounterGroup() : m_leader(-1), m_numOpen(0)
+    {
+        for (int counter = 0; counter < kCounterCount; ++counter)
+        {
+            m_fd[counter] = -1;
+            m_slot[counter] = -1;
+        }
+        
+#if defined(__linux__)
+        static const uint32_t s_types[kCounterCount] =
+            { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE };
+        static const uint64_t s_configs[kCounterCount] =
+            { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+              PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_SW_TASK_CLOCK };
+        
+        for (int counter = 0; counter < kCounterCount; ++counter)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = s_types[counter];
+            attr.config = s_configs[counter];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            
+            int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, m_leader, 0));
+            if (fd < 0)
+            {
+                continue;
+            }
+            if (m_leader < 0)
+            {
+                m_leader = fd;
+            }
+            m_fd[counter] = fd;
+            m_slot[counter] = m_numOpen++;
+        }
+#endif
+    }
+    
+    ~PerfCounterGroup()
+    {
+#if defined(__linux__)
+        for (int counter = 0; counter < kCounterCount; ++counter)
+        {
+            if (m_fd[counter] >= 0)
+            {
+                close(m_fd[counter]);
+            }
+        }
+#endif
+    }
+    
+    bool IsAvailable(int counter) const { return m_fd[counter] >= 0; }
+    
+    // Current value of every counter, 0 for unavailable ones.
+    void Read(uint64_t values[kCounterCount]) const
+    {
+        uint64_t buffer[1 + kCounterCount] = {};
+#if defined(__linux__)
+        if (m_leader < 0 || read(m_leader, buffer, sizeof(buffer)) <= 0)
+#else
+        if (m_leader < 0)
+#endif
+        {
+            memset(values, 0, sizeof(uint64_t) * kCounterCount);
+            return;
+        }
+        
+        for (int counter = 0; counter < kCounterCount; ++counter)
+        {
+            values[counter] = m_slot[counter] >= 0 ? buffer[1 + m_slot[counter]] : 0;
+        }
+    }
+    
+private:
+    int m_fd[kCounterCount];
+    int m_slot[kCounterCount];
+    int m_leader;
+    int m_numOpen;
+};
+
+class Profiler
+{
+public:
+    static bool IsEnabled() { return s_bEnabled; }
+    static void Enable() { s_bEnabled = true; }
+    
+    static void BeginPhase(ProfilePhase phase)
+    {
+        ThreadState& state = GetThreadState();
+        state.Charge();
+        state.m_stack.push_back(phase);
+    }
+    
+    static void EndPhase()
+    {
+        ThreadState& state = GetThreadState();
+        state.Charge();
+        state.m_stack.pop_back();
+    }
+    
+    static void AddRays(uint64_t count) { GetThreadState().m_rays += count; }
+    
+    // For rays traced inside a phase rather than at its start.
+    static void CountRays(uint64_t count)
+    {
+        if (s_bEnabled)
+        {
+            AddRays(count);
+        }
+    }
+    
+    // Sums every thread's counters. Call while no phase is running.
+    static void PrintReport(std::ostream& out)
+    {
+        static const char* s_phaseNames[kPhaseCount] = { "scene build", "ray generation", "traversal", "shading", "paths", "output" };
+        
+        std::lock_guard<std::mutex> lock(GetRegistryMutex());
+        uint64_t totals[kPhaseCount][kCounterCount] = {};
+        uint64_t rays = 0;
+        bool bAvailable[kCounterCount] = {};
+        for (const auto& state : GetRegistry())
+        {
+            for (int phase = 0; phase < kPhaseCount; ++phase)
+            {
+                for (int counter = 0; counter < kCounterCount; ++counter)
+                {
+                    totals[phase][counter] += state->m_totals[phase][counter];
+                }
+            }
+            for (int counter = 0; counter < kCounterCount; ++counter)
+            {
+                bAvailable[counter] = bAvailable[counter] || state->m_counters.IsAvailable(counter);
+            }
+            rays += state->m_rays;
+        }
+        
+        out << "Profile over " << GetRegistry().size() << " threads, " << rays << " rays" << std::endl;
+        out << std::left << std::setw(16) << "phase" << std::right << std::setw(12) << "cpu ms" << std::setw(10) << "IPC"
+            << std::setw(16) << "LLC miss/ray" << std::setw(16) << "br miss/ray" << std::endl;
+        
+        const double perRay = rays ? 1.0 / rays : 0.0;
+        for (int phase = 0; phase < kPhaseCount; ++phase)
+        {
+            const uint64_t* values = totals[phase];
+            out << std::left << std::setw(16) << s_phaseNames[phase] << std::right << std::fixed << std::setprecision(3);
+            PrintValue(out, 12, bAvailable[kCounterTaskClock], values[kCounterTaskClock] * 1e-6);
+            PrintValue(out, 10, bAvailable[kCounterCycles] && bAvailable[kCounterInstructions] && values[kCounterCycles],
+                       values[kCounterCycles] ? double(values[kCounterInstructions]) / values[kCounterCycles] : 0.0);
+            PrintValue(out, 16, bAvailable[kCounterCacheMisses], values[kCounterCacheMisses] * perRay);
+            PrintValue(out, 16, bAvailable[kCounterBranchMisses], values[kCounterBranchMisses] * perRay);
+            out << std::endl;
+        }
+        out.unsetf(std::ios::floatfield);
+    }
+    
+private:
+    struct ThreadState
+    {
+        ThreadState() : m_rays(0)
+        {
+            memset(m_totals, 0, sizeof(m_totals));
+            m_stack.reserve(64);
+            m_counters.Read(m_last);
+        }
+        
+        // Charges the counts since the last boundary to the current phase.
+        void Charge()
+        {
+            uint64_t now[kCounterCount];
+            m_counters.Read(now);
+            if (!m_stack.empty())
+            {
+                for (int counter = 0; counter < kCounterCount; ++counter)
+                {
+                    m_totals[m_stack.back()][counter] += now[counter] - m_last[counter];
+                }
+            }
+            memcpy(m_last, now, sizeof(m_last));
+        }
+        
+        PerfCounterGroup            m_counters;
+        uint64_t                    m_last[kCounterCount];
+        uint64_t                    m_totals[kPhaseCount][kCounterCount];
+        std::vector<ProfilePhase>   m_stack;
+        uint64_t                    m_rays;
+    };
+    
+    static void PrintValue(std::ostream& out, int width, bool bAvailable, double value)
+    {
+        if (bAvailable)
+            out << std::setw(width) << value;
+        else
+            out << std::setw(width) << "n/a";
+    }
+    
+    // States are owned by the registry so they survive their threads.
+    static ThreadState& GetThreadState()
+    {
+        static thread_local ThreadState* s_state = nullptr;
+        if (!s_state)
+        {
+            std::lock_guard<std::mutex> lock(GetRegistryMutex());
+            GetRegistry().emplace_back(new ThreadState());
+            s_state = GetRegistry().back().get();
+        }
+        return *s_state;
+    }
+    
+    static std::vector<std::unique_ptr<ThreadState>>& GetRegistry()
+    {
+        static std::vector<std::unique_ptr<ThreadState>> s_registry;
+        return s_registry;
+    }
+    
+    static std::mutex& GetRegistryMutex()
+    {
+        static std::mutex s_mutex;
+        return s_mutex;
+    }
+    
+    static inline bool s_bEnabled = false;
+};
+
+// Charges the enclosing scope to a phase when profiling is enabled.
+class ProfileScope
+{
+public:
+    ProfileScope(ProfilePhase phase, uint64_t rays = 0) : m_bActive(Profiler::IsEnabled())
+    {
+        if (m_bActive)
+        {
+            Profiler::BeginPhase(phase);
+            Profiler::AddRays(rays);
+        }
+    }
+    
+    ~ProfileScope()
+    {
+        if (m_bActive)
+        {
+            Profiler::EndPhase();
+        }
+    }
+    
+private:
+    bool m_bActive;
+};
+
+#endif /* Profiler_h */
@@ -15,6 +15,7 @@
 #include <queue>
 #include <atomic>
 #include <condition_variable>
+#include "Numa.h"
 
 using namespace std;
 
@@ -25,26 +26,60 @@ public:
     {
         m_workerThreadJobCount.store(0);
         m_mainThreadJobCount = 0;
+        m_numUnpinnedThreads = 0;
         m_numThreads = std::thread::hardware_concurrency();
         if (m_numThreads == 0)
         {
             m_numThreads = 1;
         }
         
-        cout << "Created thread pool with " << m_numThreads << " threads" << endl;
+        m_workQueues.resize(1);
+        
         for (int i = 0; i < m_numThreads; ++i)
         {
-            m_pool.push_back(std::thread(&ThreadPool::DoWork, this));
-            m_pool.back().detach();
+            m_pool.push_back(std::thread(&ThreadPool::DoWork, this, 0, i));
         }
         
     }
     
+    // One worker per CPU, pinned to it, with a job queue per NUMA node.
+    // Workers drain their own node's queue first and steal unpinned jobs
+    // from the other nodes when it runs dry. Workers the system refuses to
+    // pin still serve their node's queue, unpinned, and are counted by
+    // GetUnpinnedThreadCount().
+    explicit ThreadPool(const NumaTopology& topology) : m_bDone(false)
+    {
+        m_workerThreadJobCount.store(0);
+        m_mainThreadJobCount = 0;
+        m_numThreads = 0;
+        m_numUnpinnedThreads = 0;
+        m_workQueues.resize(topology.GetNodeCount());
+        
+        for (int node = 0; node < topology.GetNodeCount(); ++node)
+        {
+            for (int cpu : topology.GetNode(node).m_cpus)
+            {
+                m_pool.push_back(std::thread(&ThreadPool::DoWork, this, node, m_numThreads));
+                if (!NumaTopology::PinThreadToCpu(m_pool.back(), cpu))
+                {
+                    m_numUnpinnedThreads++;
+                }
+                m_numThreads++;
+            }
+        }
+    }
+    
     ~ThreadPool()
     {
-        m_bDone = true;
+        // Workers sleep on m_mainCondition, so they must be woken and joined
+        // before it is destroyed.
+        {
+            std::unique_lock<std::mutex> lock(m_mainMutex);
+            m_bDone = true;
+        }
         
         m_workQueueCondition.notify_all();
+        m_mainCondition.notify_all();
         
         for (auto& threads : m_pool)
         {
@@ -56,18 +91,36 @@ public:
         
     }
     
-    void QueueJob(std::function<void()> job)
+    // Queues the job on the given node. Pinned jobs only ever run there,
+    // which is what first-touch allocation relies on; unpinned jobs may be
+    // stolen by idle workers of other nodes.
+    void QueueJob(std::function<void()> job, int node = 0, bool bPinned = false)
     {
         m_mainThreadJobCount++;
         
         {
             std::unique_lock<std::mutex> m(m_workQueueMutex);
-            m_workQueue.push(job);
+            m_workQueues[node % m_workQueues.size()].push(Job{job, bPinned});
         }
         
-        m_workQueueCondition.notify_one();
+        // Any sleeping worker may be the one able to run it.
+        m_workQueueCondition.notify_all();
+        m_mainCondition.notify_all();
     }
     
+    int GetNodeCount() const { return int(m_workQueues.size()); }
+    
+    // Workers of a NUMA pool that could not be pinned to their CPU.
+    int GetUnpinnedThreadCount() const { return m_numUnpinnedThreads; }
+    
+    // Node of the calling worker thread; 0 for threads outside any pool.
+    static int GetCurrentNode() { return s_currentNode; }
+    
+    // Index of the calling worker in [0, GetThreadCount()), for per-thread
+    // data; 0 for threads outside any pool.
+    static int GetCurrentWorker() { return s_currentWorker; }
+    int GetThreadCount() const { return m_numThreads; }
+    
     void JobDone()
     {
         
@@ -86,7 +139,16 @@ public:
     
     void Poll()
     {
-        m_mainCondition.notify_one(); // wake one worker thread
+        // Pinned jobs need a worker of their own node, so with several nodes
+        // waking an arbitrary one is not enough.
+        if (m_workQueues.size() > 1)
+        {
+            m_mainCondition.notify_all();
+        }
+        else
+        {
+            m_mainCondition.notify_one(); // wake one worker thread
+        }
         std::this_thread::yield();
     }
     
@@ -107,16 +169,40 @@ public:
 private:
     // Functions
     
-    void DoWork()
+    struct Job
+    {
+        std::function<void()>   m_function;
+        bool                    m_bPinned;
+    };
+    
+    // Called with m_workQueueMutex held.
+    bool PopJob(int node, std::function<void()>& job)
     {
+        const int numQueues = int(m_workQueues.size());
+        for (int i = 0; i < numQueues; ++i)
+        {
+            std::queue<Job>& queue = m_workQueues[(node + i) % numQueues];
+            if (!queue.empty() && (i == 0 || !queue.front().m_bPinned))
+            {
+                job = std::move(queue.front().m_function);
+                queue.pop();
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void DoWork(int node, int worker)
+    {
+        s_currentNode = node;
+        s_currentWorker = worker;
         while (!m_bDone)
         {
             {
+                std::function<void()> job;
                 m_workQueueMutex.lock();
-                if (!m_workQueue.empty())
+                if (PopJob(node, job))
                 {
-                    std::function<void()> job = m_workQueue.front();
-                    m_workQueue.pop();
                     m_workQueueMutex.unlock();
                     job();
                     JobDone();
@@ -126,22 +212,29 @@ private:
                 {
                     m_workQueueMutex.unlock();
                     std::unique_lock<std::mutex> lock(m_mainMutex);
-                    m_mainCondition.wait(lock);
+                    if (!m_bDone)
+                    {
+                        m_mainCondition.wait(lock);
+                    }
                 }
             }
         }
     }
           
     // Variables
-    bool                m_bDone;
+    atomic_bool         m_bDone;
     int                 m_numThreads;
+    int                 m_numUnpinnedThreads;
     uint64_t            m_mainThreadJobCount;
     atomic_uint64_t     m_workerThreadJobCount;
     
     std::vector<thread>     m_pool;
     condition_variable      m_workQueueCondition;
     std::mutex              m_workQueueMutex;
-    std::queue<std::function<void()>> m_workQueue;
+    std::vector<std::queue<Job>> m_workQueues;
+    
+    static inline thread_local int s_currentNode = 0;
+    static inline thread_local int s_currentWorker = 0;
     
     std::mutex m_mainMutex;
     std::condition_variable m_mainCondition;
@@ -8,20 +8,71 @@
 
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <sstream>
 #include <string.h>
 #include "Core/Math/Material.h"
 #include "Core/Shape/Sphere.h"
 #include "Core/Math/HitRecord.h"
 #include "Core/Math/Hittablelist.h"
+#include "Core/Accel/HittableBVH.h"
 #include "Core/Camera/Camera.h"
+#include "Core/Render/Renderer.h"
+#include "Core/Render/DeadlineRenderer.h"
+#include "Core/Render/Convergence.h"
+#include "Core/Render/Baker.h"
 #include "System/ThreadPool.h"
+#include "System/PreviewServer.h"
+#include "Core/Streaming/StreamedRenderer.h"
+#include "Core/API/Raytracing.h"
 
 using namespace std;
 
 #define ASSETS_PATH "/Users/kashyaprajpal/Desktop/Personal Projects/CPU-Ray-Tracing/Raytracing/Assets/"
-#define DIFFUSE_IN_HEMISPHERE 0
 #define USE_MULTITHREADED_SYSTEM 1
-std::mutex main_mutex;
+// Only for --check-allocations: every allocation on every thread then goes
+// through one shared counter. Turned on by the RAYTRACING_TRACK_ALLOCATIONS
+// CMake option.
+#ifndef TRACK_ALLOCATIONS
+#define TRACK_ALLOCATIONS 0
+#endif
+
+#if TRACK_ALLOCATIONS
+// Counting replacement for the global allocator, see AllocationCounter. Kept
+// out of line so the compiler does not pair an inlined free() with new.
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    AllocationCounter::Increment();
+    if (void* memory = malloc(size ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept { free(memory); }
+#endif
+
+// Builds a renderer, or anything else that runs on a ThreadPool*, over a
+// pool of every core (of the given nodes with a topology) that threadPool_out
+// takes ownership of. Without the multithreaded system the pool stays null
+// and the work runs on the calling thread.
+template<typename T = Renderer>
+T MakeRenderer(unique_ptr<ThreadPool>& threadPool_out, const NumaTopology* topology = nullptr)
+{
+#if USE_MULTITHREADED_SYSTEM
+    threadPool_out.reset(topology ? new ThreadPool(*topology) : new ThreadPool());
+    cout << "Created thread pool with " << threadPool_out->GetThreadCount() << " threads on "
+         << threadPool_out->GetNodeCount() << " NUMA nodes" << endl;
+    if (threadPool_out->GetUnpinnedThreadCount() > 0)
+    {
+        cout << "Could not pin " << threadPool_out->GetUnpinnedThreadCount()
+             << " worker threads to their CPUs; they run unpinned" << endl;
+    }
+#endif
+    return T(threadPool_out.get());
+}
 
 float HitSpehere(const Vector3& center, float radius, const Ray& r)
 {
@@ -41,39 +92,13 @@ float HitSpehere(const Vector3& center, float radius, const Ray& r)
     }
 }
 
-Vector3 GetColor(const Ray& r, const Hittable& world, int depth)
-{
-    if (depth <= 0)
-    {
-        return Vector3(0.f, 0.f, 0.f);
-    }
-    
-    HitRecord hitRec;
-    if (world.hit(r, 0.001, s_kInfinity, hitRec))
-    {
-#if DIFFUSE_IN_HEMISHPHERE
-        Vector3 target = hitRec.m_point + RandomInHemiSphere(hitRec.m_normal);
-#else
-        Ray scattered;
-        Vector3 attenuation = Vector3::GetZero();
-        if (hitRec.m_material->Scatter(r, hitRec, attenuation, scattered))
-            return attenuation * GetColor(scattered, world, depth - 1);
-        return attenuation;
-#endif
-    }
-    
-    Vector3 unit_direction = unit_vector(r.GetDirection());
-    float t = 0.5 * (unit_direction.Y() + 1.0);
-    return (1.0 - t) * Vector3(1.0, 1.0, 1.0) + t * Vector3(0.5, 0.7, 1.0);
-}
-
-HittableList GetScene()
+HittableList GetScene(shared_ptr<Texture> texture = nullptr)
 {
     HittableList scene;
     
     // Add Background sphere
-    scene.AddHittable(make_shared<Sphere>(
-    Vector3(0,-1000,0), 1000, make_shared<Lambertian>(Vector3(0.5, 0.5, 0.5))));
+    scene.AddHittable(scene.Create<Sphere>(
+    Vector3(0,-1000,0), 1000, scene.Create<Lambertian>(Vector3(0.5, 0.5, 0.5))));
     
     for (int a = -11; a < 11; a++)
     {
@@ -86,7 +111,7 @@ HittableList GetScene()
                     // diffuse
                     auto albedo = Vector3::Random() * Vector3::Random();
                     scene.AddHittable(
-                        make_shared<Sphere>(center, 0.2, make_shared<Lambertian>(albedo)));
+                        scene.Create<Sphere>(center, 0.2, scene.Create<Lambertian>(albedo)));
                 }
                 else if (choose_mat < 0.95)
                 {
@@ -94,26 +119,110 @@ HittableList GetScene()
                     auto albedo = Vector3::Random(.5, 1);
                     auto fuzz = RandomDouble(0, .5);
                     scene.AddHittable(
-                        make_shared<Sphere>(center, 0.2, make_shared<Metal>(albedo, fuzz)));
+                        scene.Create<Sphere>(center, 0.2, scene.Create<Metal>(albedo, fuzz)));
                 }
                 else
                 {
                     // glass
-                    scene.AddHittable(make_shared<Sphere>(center, 0.2, make_shared<Dielectric>(1.5)));
+                    scene.AddHittable(scene.Create<Sphere>(center, 0.2, scene.Create<Dielectric>(1.5)));
                 }
             }
         }
     }
     
-    scene.AddHittable(make_shared<Sphere>(Vector3(0, 1, 0), 1.0, make_shared<Dielectric>(1.5)));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(0, 1, 0), 1.0, scene.Create<Dielectric>(1.5)));
 
     scene.AddHittable(
-        make_shared<Sphere>(Vector3(-4, 1, 0), 1.0, make_shared<Lambertian>(Vector3(0.4, 0.2, 0.1))));
+        scene.Create<Sphere>(Vector3(-4, 1, 0), 1.0, texture ? scene.Create<Lambertian>(texture) : scene.Create<Lambertian>(Vector3(0.4, 0.2, 0.1))));
 
     scene.AddHittable(
-        make_shared<Sphere>(Vector3(4, 1, 0), 1.0, make_shared<Metal>(Vector3(0.7, 0.6, 0.5), 0.0)));
+        scene.Create<Sphere>(Vector3(4, 1, 0), 1.0, scene.Create<Metal>(Vector3(0.7, 0.6, 0.5), 0.0)));
+
+    
+    return scene;
+}
 
+HittableList GetDemoScene(shared_ptr<Texture> texture = nullptr)
+{
+    HittableList world = GetScene(texture);
+    
+    // Lambertian Spheres
+    world.AddHittable(world.Create<Sphere>(Vector3(0.f, 0.f, -1.f), 0.5, world.Create<Lambertian>(Vector3(0.1, 0.2, 0.5))));
+    
+    world.AddHittable(world.Create<Sphere>(Vector3(0.f, -100.5, -1.f), 100, world.Create<Lambertian>(Vector3(0.8, 0.8, 0.0))));
+    
+    // Metal Spheres
+    world.AddHittable(world.Create<Sphere>(Vector3(1, 0, -1), 0.5, world.Create<Metal>(Vector3(0.8, 0.6, 0.2), RandomDouble())));
+    world.AddHittable(world.Create<Sphere>(Vector3(-1,0,-1), 0.5, world.Create<Metal>(Vector3(0.8, 0.8, 0.8), RandomDouble())));
+    
+    world.AddHittable(world.Create<Sphere>(Vector3(1, 0, -1), 0.5, world.Create<Metal>(Vector3(0.8, 0.6, 0.2), 0.3)));
+    
+    // Dielectric
+    world.AddHittable(world.Create<Sphere>(Vector3(-1, 0, -1), 0.5, world.Create<Dielectric>(1.5)));
+    
+    world.AddHittable(world.Create<Sphere>(Vector3(-1, 0, -1), -0.45, world.Create<Dielectric>(1.5)));
+    
+    return world;
+}
+
+// Ground and a few large spheres under a dim sky, lit by numLights small
+// emissive spheres scattered above the ground. Total emitted power does not
+// depend on numLights.
+HittableList GetNightScene(int numLights)
+{
+    HittableList scene;
+    scene.AddHittable(scene.Create<Sphere>(Vector3(0, -1000, 0), 1000, scene.Create<Lambertian>(Vector3(0.5, 0.5, 0.5))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(0, 1, 0), 1.0, scene.Create<Lambertian>(Vector3(0.7, 0.7, 0.7))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(-4, 1, 0), 1.0, scene.Create<Lambertian>(Vector3(0.4, 0.2, 0.1))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(4, 1, 0), 1.0, scene.Create<Metal>(Vector3(0.7, 0.6, 0.5), 0.2)));
     
+    const float radius = 0.05f;
+    const float radiance = 30000.0f / numLights;
+    for (int light = 0; light < numLights; ++light)
+    {
+        Vector3 center(RandomDouble(-11, 11), RandomDouble(0.5, 2.5), RandomDouble(-11, 11));
+        Vector3 color = Vector3::Random(0.3, 1);
+        scene.AddHittable(scene.Create<Sphere>(center, radius, scene.Create<DiffuseLight>(radiance * color)));
+    }
+    return scene;
+}
+
+// A glass sphere on the ground lit only by two small, bright spheres under
+// an almost black sky. Most of the light on the ground below the glass is a
+// caustic, which camera paths only find by hitting a light by chance.
+HittableList GetCausticScene()
+{
+    HittableList scene;
+    scene.AddHittable(scene.Create<Sphere>(Vector3(0, -1000, 0), 1000, scene.Create<Lambertian>(Vector3(0.6, 0.6, 0.6))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(0, 1, 0), 1.0, scene.Create<Dielectric>(1.5)));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(-3, 0.7, -1.5), 0.7, scene.Create<Lambertian>(Vector3(0.6, 0.3, 0.2))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(3, 0.7, 1.5), 0.7, scene.Create<Metal>(Vector3(0.7, 0.7, 0.7), 0.1)));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(-1, 4, 1), 0.1, scene.Create<DiffuseLight>(Vector3(400, 380, 340))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(2, 3, -2), 0.1, scene.Create<DiffuseLight>(Vector3(120, 160, 200))));
+    return scene;
+}
+
+// numSpheres spheres at random through a 40 x 10 x 40 box around the
+// default camera, for scenes far bigger than the caches. Spheres are created
+// in random spatial order, so neighbours in the BVH are not neighbours in
+// memory.
+HittableList GetSphereSoup(int numSpheres)
+{
+    HittableList scene;
+    shared_ptr<Material> materials[] =
+    {
+        scene.Create<Lambertian>(Vector3(0.7, 0.6, 0.5)),
+        scene.Create<Lambertian>(Vector3(0.3, 0.5, 0.7)),
+        scene.Create<Metal>(Vector3(0.8, 0.8, 0.8), 0.2),
+        scene.Create<Dielectric>(1.5)
+    };
+    // Rays travel about 4 units between hits at any density.
+    const float radius = 36.0f / sqrt(float(numSpheres));
+    for (int sphere = 0; sphere < numSpheres; ++sphere)
+    {
+        Vector3 center(RandomDouble(-20, 20), RandomDouble(-5, 5), RandomDouble(-20, 20));
+        scene.AddHittable(scene.Create<Sphere>(center, radius * float(RandomDouble(0.5, 1.5)), materials[sphere % 4]));
+    }
     return scene;
 }
 
@@ -123,112 +232,1481 @@ const int image_height = static_cast<int>(image_width / aspect_ratio);
 const int samplesPerPixel = 100;
 const int kMaxDepth = 50;
 
-Vector3 pixelColor[image_width][image_height];
+// Times the closest-hit query against the any-hit occlusion query on the demo
+// scene using the same set of random visibility segments.
+void RunOcclusionBenchmark(const HittableList& world, int numRays)
+{
+    std::vector<Ray> rays;
+    std::vector<float> segmentLengths;
+    rays.reserve(numRays);
+    segmentLengths.reserve(numRays);
+    for (int i = 0; i < numRays; ++i)
+    {
+        Vector3 origin(RandomDouble(-11, 11), RandomDouble(0.05, 3), RandomDouble(-11, 11));
+        Vector3 target(RandomDouble(-11, 11), RandomDouble(0, 3), RandomDouble(-11, 11));
+        rays.push_back(Ray(origin, unit_vector(target - origin)));
+        segmentLengths.push_back((target - origin).Length());
+    }
+    
+    int hitCount = 0;
+    auto hitStart = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < numRays; ++i)
+    {
+        HitRecord rec;
+        hitCount += world.hit(rays[i], 0.001, segmentLengths[i], rec) ? 1 : 0;
+    }
+    auto hitEnd = std::chrono::high_resolution_clock::now();
+    
+    int occludedCount = 0;
+    auto occludedStart = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < numRays; ++i)
+    {
+        occludedCount += world.occluded(rays[i], 0.001, segmentLengths[i]) ? 1 : 0;
+    }
+    auto occludedEnd = std::chrono::high_resolution_clock::now();
+    
+    double hitMs = std::chrono::duration<double, std::milli>(hitEnd - hitStart).count();
+    double occludedMs = std::chrono::duration<double, std::milli>(occludedEnd - occludedStart).count();
+    
+    cout << "Occlusion benchmark: " << numRays << " segments" << endl;
+    cout << "  hit():      " << hitMs << " ms, " << hitCount << " blocked" << endl;
+    cout << "  occluded(): " << occludedMs << " ms, " << occludedCount << " blocked" << endl;
+    cout << "  Speedup:    " << hitMs / occludedMs << "x" << endl;
+    if (hitCount != occludedCount)
+    {
+        cout << "  Warning: hit() and occluded() disagree" << endl;
+    }
+}
+
+// Times primary visibility for a pinhole view of the demo scene, once ray by
+// ray and once as frustum-culled 8x8 packets, then thin lens packets with
+// and without the lens frustum, and checks the culled hits agree.
+void RunPacketBenchmark(const HittableList& world)
+{
+    CameraSettings cameraSettings;
+    cameraSettings.m_aperture = 0;
+    Camera camera = cameraSettings.Build(double(image_width) / image_height);
+    
+    int scalarHits = 0;
+    auto scalarStart = std::chrono::high_resolution_clock::now();
+    for (int j = 0; j < image_height; ++j)
+    {
+        for (int i = 0; i < image_width; ++i)
+        {
+            HitRecord rec;
+            Ray r = camera.GetRay<false>((i + 0.5) / image_width, (j + 0.5) / image_height);
+            scalarHits += world.hit(r, 0.001, s_kInfinity, rec) ? 1 : 0;
+        }
+    }
+    auto scalarEnd = std::chrono::high_resolution_clock::now();
+    
+    int packetHits = 0;
+    auto packetStart = std::chrono::high_resolution_clock::now();
+    RayPacket packet;
+    PacketHits hits;
+    for (int y = 0; y < image_height; y += s_kPacketWidth)
+    {
+        for (int x = 0; x < image_width; x += s_kPacketWidth)
+        {
+            int endX = std::min(x + s_kPacketWidth, image_width);
+            int endY = std::min(y + s_kPacketWidth, image_height);
+            packet.m_count = 0;
+            for (int j = y; j < endY; ++j)
+            {
+                for (int i = x; i < endX; ++i)
+                {
+                    packet.Set(packet.m_count++, camera.GetRay<false>((i + 0.5) / image_width, (j + 0.5) / image_height));
+                }
+            }
+            
+            Frustum frustum = Renderer::GetPacketFrustum<false>(camera, image_width, image_height, x, y, endX, endY);
+            hits.Reset(s_kInfinity);
+            world.hitPacket(packet, &frustum, 0.001, hits);
+            for (int k = 0; k < packet.m_count; ++k)
+            {
+                packetHits += hits.m_object[k] ? 1 : 0;
+            }
+        }
+    }
+    auto packetEnd = std::chrono::high_resolution_clock::now();
+    
+    double scalarMs = std::chrono::duration<double, std::milli>(scalarEnd - scalarStart).count();
+    double packetMs = std::chrono::duration<double, std::milli>(packetEnd - packetStart).count();
+    cout << "Primary ray benchmark: " << image_width * image_height << " rays" << endl;
+    cout << "  per ray: " << scalarMs << " ms, " << scalarHits << " hits" << endl;
+    cout << "  packets: " << packetMs << " ms, " << packetHits << " hits" << endl;
+    cout << "  Speedup: " << scalarMs / packetMs << "x" << endl;
+    
+    // Thin lens packets of the default camera, culled against the lens
+    // frustum and traced again without culling.
+    Camera lensCamera = CameraSettings().Build(double(image_width) / image_height);
+    int mismatches = 0;
+    double culledMs = 0;
+    double unculledMs = 0;
+    for (int y = 0; y < image_height; y += s_kPacketWidth)
+    {
+        for (int x = 0; x < image_width; x += s_kPacketWidth)
+        {
+            int endX = std::min(x + s_kPacketWidth, image_width);
+            int endY = std::min(y + s_kPacketWidth, image_height);
+            packet.m_count = 0;
+            for (int j = y; j < endY; ++j)
+            {
+                for (int i = x; i < endX; ++i)
+                {
+                    packet.Set(packet.m_count++, lensCamera.GetRay<true>((i + 0.5) / image_width, (j + 0.5) / image_height));
+                }
+            }
+            
+            auto culledStart = std::chrono::high_resolution_clock::now();
+            Frustum frustum = Renderer::GetPacketFrustum<true>(lensCamera, image_width, image_height, x, y, endX, endY);
+            hits.Reset(s_kInfinity);
+            world.hitPacket(packet, &frustum, 0.001, hits);
+            auto culledEnd = std::chrono::high_resolution_clock::now();
+            
+            PacketHits reference;
+            reference.Reset(s_kInfinity);
+            world.hitPacket(packet, nullptr, 0.001, reference);
+            auto unculledEnd = std::chrono::high_resolution_clock::now();
+            
+            culledMs += std::chrono::duration<double, std::milli>(culledEnd - culledStart).count();
+            unculledMs += std::chrono::duration<double, std::milli>(unculledEnd - culledEnd).count();
+            for (int k = 0; k < packet.m_count; ++k)
+            {
+                mismatches += hits.m_object[k] != reference.m_object[k] ? 1 : 0;
+            }
+        }
+    }
+    cout << "  thin lens packets: " << unculledMs << " ms unculled, " << culledMs << " ms culled, "
+         << mismatches << " lanes differ" << endl;
+    cout << "  Speedup: " << unculledMs / culledMs << "x" << endl;
+}
 
-void ComputeColor(const int i, const int j, const HittableList& world, Camera& camera)
+// Writes a sphere soup for the streamed renderer: one cluster per grid cell
+// of spheresPerCell small spheres, plus a cluster for the ground sphere.
+// Clusters are generated and written one at a time.
+bool WriteStreamedSphereSoup(const string& fileName, int gridSize, int spheresPerCell)
 {
-    Vector3 color(0, 0, 0);
-    for (int s = 0; s < samplesPerPixel; ++s)
+    StreamedSceneWriter writer;
+    if (!writer.Open(fileName))
     {
-        auto u = (i + RandomDouble()) / image_width;
-        auto v = (j + RandomDouble()) / image_height;
-        Ray r = camera.GetRay(u, v);
-        color += GetColor(r, world, kMaxDepth);
+        return false;
     }
     
+    PackedMaterial ground = { kPackedLambertian, { 0.5f, 0.5f, 0.5f }, 0, 0 };
+    writer.AddSphere(Vector3(0, -1000, 0), 1000, writer.AddMaterial(ground));
+    writer.EndCluster();
     
+    // A small material palette keeps the in-memory table tiny.
+    std::vector<uint32_t> palette;
+    for (int m = 0; m < 64; ++m)
     {
-        std::unique_lock<std::mutex> lock(main_mutex);
-        pixelColor[i][j] = color;
+        Vector3 albedo = Vector3::Random() * Vector3::Random();
+        PackedMaterial material = { kPackedLambertian, { albedo.X(), albedo.Y(), albedo.Z() }, 0, 0 };
+        if (m % 8 == 6)
+        {
+            material.m_type = kPackedMetal;
+            material.m_fuzz = float(RandomDouble(0, 0.5));
+        }
+        else if (m % 8 == 7)
+        {
+            material.m_type = kPackedDielectric;
+            material.m_refractiveIndex = 1.5f;
+        }
+        palette.push_back(writer.AddMaterial(material));
     }
+    
+    const float cellSize = 2.0f;
+    for (int cellZ = 0; cellZ < gridSize; ++cellZ)
+    {
+        for (int cellX = 0; cellX < gridSize; ++cellX)
+        {
+            float x0 = (cellX - gridSize * 0.5f) * cellSize;
+            float z0 = (cellZ - gridSize * 0.5f) * cellSize;
+            for (int s = 0; s < spheresPerCell; ++s)
+            {
+                float radius = float(RandomDouble(0.03, 0.15));
+                Vector3 center(x0 + float(RandomDouble()) * cellSize, radius, z0 + float(RandomDouble()) * cellSize);
+                writer.AddSphere(center, radius, palette[int(RandomDouble() * palette.size())]);
+            }
+            writer.EndCluster();
+        }
+    }
+    return writer.Close();
 }
 
-int main(int argc, const char * argv[])
+// Renders a streamed scene with at most residentMB of cluster data loaded.
+int RunStreamedRender(const string& sceneFileName, size_t residentMB, const string& imageFileName, int spp)
+{
+    StreamedScene scene(residentMB * 1024 * 1024);
+    if (!scene.Open(sceneFileName))
+    {
+        cout << "Could not open streamed scene " << sceneFileName << endl;
+        return 1;
+    }
+    
+    auto startTime = std::chrono::high_resolution_clock::now();
+    CameraSettings cameraSettings;
+    Camera camera = cameraSettings.Build(double(image_width) / image_height);
+    RenderSettings settings;
+    settings.m_samplesPerPixel = spp;
+    settings.m_maxDepth = kMaxDepth;
+    FrameBuffer frameBuffer(image_width, image_height);
+    
+    unique_ptr<ThreadPool> threadPool;
+    StreamedRenderer renderer = MakeRenderer<StreamedRenderer>(threadPool);
+    renderer.RenderPass(scene, camera, settings, frameBuffer);
+    auto endTime = std::chrono::high_resolution_clock::now();
+    
+    frameBuffer.WritePPM(imageFileName);
+    scene.PrintStatistics(cout);
+    cout << "Streamed render: " << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms" << endl;
+    return 0;
+}
+
+// Renders the demo scene from every view listed in viewsFileName, one view
+// per line: "output.ppm fromX fromY fromZ atX atY atZ [vfov aperture focus]".
+// The scene and thread pool are created once and the tiles of all views are
+// scheduled together.
+int RunBatchRender(const string& viewsFileName, int spp)
 {
+    std::ifstream viewsFile(viewsFileName.c_str());
+    if (!viewsFile)
+    {
+        cout << "Could not open view list " << viewsFileName << endl;
+        return 1;
+    }
+    
+    std::vector<string> outputFileNames;
+    std::vector<CameraSettings> cameras;
+    string line;
+    while (std::getline(viewsFile, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        
+        std::istringstream stream(line);
+        string outputFileName;
+        CameraSettings camera;
+        if (!(stream >> outputFileName >> camera.m_lookFrom >> camera.m_lookAt))
+        {
+            cout << "Skipping malformed view: " << line << endl;
+            continue;
+        }
+        stream >> camera.m_vfov >> camera.m_aperture >> camera.m_focusDistance;
+        outputFileNames.push_back(outputFileName);
+        cameras.push_back(camera);
+    }
+    
     auto startTime = std::chrono::high_resolution_clock::now();
+    HittableList world = GetDemoScene();
+    RenderSettings settings;
+    settings.m_samplesPerPixel = spp;
+    settings.m_maxDepth = kMaxDepth;
     
-    std::ofstream outputImage;
-    string imageFileName(ASSETS_PATH);
-#if USE_MULTITHREADED_SYSTEM
-    imageFileName += "Basic_Image_6.ppm";
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool);
+    std::vector<FrameBuffer> frameBuffers(cameras.size());
+    std::vector<RenderView> views;
+    for (size_t view = 0; view < cameras.size(); ++view)
+    {
+        renderer.AllocateFrameBuffer(frameBuffers[view], image_width, image_height, settings.m_tileSize);
+        views.push_back(RenderView{ cameras[view].Build(double(image_width) / image_height), &frameBuffers[view] });
+    }
+    renderer.RenderViews(world, views, settings);
+    auto endTime = std::chrono::high_resolution_clock::now();
+    
+    int failures = 0;
+    for (size_t view = 0; view < cameras.size(); ++view)
+    {
+        if (!frameBuffers[view].WritePPM(outputFileNames[view]))
+        {
+            cout << "Could not write " << outputFileNames[view] << endl;
+            failures++;
+        }
+    }
+    
+    cout << "Rendered " << views.size() << " views in "
+         << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Renders the demo scene with hardware counters charged to each render
+// phase and prints IPC and misses per ray. Paths advance as wavefronts, so
+// traversal and shading are separate batches; scalar paths would only
+// show up as a whole under "paths".
+int RunProfile(const string& imageFileName, int spp)
+{
+    Profiler::Enable();
+    HittableList world;
+    {
+        ProfileScope sceneBuild(kPhaseSceneBuild);
+        world = GetDemoScene();
+    }
+    
+    Camera camera = CameraSettings().Build(double(image_width) / image_height);
+    RenderSettings settings;
+    settings.m_samplesPerPixel = spp;
+    settings.m_maxDepth = kMaxDepth;
+    settings.m_interleavedTraversal = true;
+    FrameBuffer frameBuffer(image_width, image_height);
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool);
+    auto startTime = std::chrono::high_resolution_clock::now();
+    renderer.RenderPass(world, camera, settings, frameBuffer);
+    {
+        ProfileScope output(kPhaseOutput);
+        frameBuffer.WritePPM(imageFileName);
+    }
+    auto endTime = std::chrono::high_resolution_clock::now();
+    
+    cout << "Profiled render: " << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms" << endl;
+    Profiler::PrintReport(cout);
+    return 0;
+}
+
+// Mean squared error of the pixel averages of a against those of b.
+double GetMeanSquaredError(const FrameBuffer& a, const FrameBuffer& b)
+{
+    double sum = 0;
+    for (int j = 0; j < a.Height(); ++j)
+    {
+        for (int i = 0; i < a.Width(); ++i)
+        {
+            Vector3 difference = a.GetColorSum(i, j) / a.GetSampleCount(i, j) - b.GetColorSum(i, j) / b.GetSampleCount(i, j);
+            sum += difference.SquaredLength();
+        }
+    }
+    return sum / (a.Width() * a.Height());
+}
+
+// Compares plain BSDF sampling with path guiding at equal samples per pixel,
+// against a reference rendered with referenceIntegrator. The guide trains on
+// passes of doubling length, once keeping the starting guide fraction and
+// once learning it. Errors are averaged over a few independent renders of
+// spp samples, as a single one is at the mercy of its brightest fireflies.
+void CompareGuiding(const string& name, const HittableList& scene, const Hittable& world, const Camera& camera,
+                    RenderSettings settings, IntegratorType referenceIntegrator, int spp, int referenceSpp,
+                    Renderer& renderer, int width, int height)
+{
+    const int numRenders = 4;
+    FrameBuffer reference(width, height);
+    RenderSettings referenceSettings = settings;
+    referenceSettings.m_integrator = referenceIntegrator;
+    referenceSettings.m_samplesPerPixel = referenceSpp;
+    renderer.RenderPass(world, camera, referenceSettings, reference);
+    cout << name << ", reference " << referenceSpp << " spp, " << width << "x" << height << ", " << numRenders
+         << " renders of " << spp << " spp each" << endl;
+    
+    // Mean error and time of numRenders renders with the given settings.
+    auto measure = [&](double& milliseconds_out)
+    {
+        double error = 0;
+        milliseconds_out = 0;
+        settings.m_samplesPerPixel = spp;
+        for (int render = 0; render < numRenders; ++render)
+        {
+            FrameBuffer frameBuffer(width, height);
+            auto startTime = std::chrono::high_resolution_clock::now();
+            renderer.RenderPass(world, camera, settings, frameBuffer);
+            milliseconds_out += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+            error += GetMeanSquaredError(frameBuffer, reference);
+        }
+        milliseconds_out /= numRenders;
+        return error / numRenders;
+    };
+    
+    double unguidedMs;
+    double unguidedError = measure(unguidedMs);
+    cout << "  BSDF sampling:     MSE " << unguidedError << " in " << unguidedMs << " ms" << endl;
+    
+    for (bool bLearnFraction : { false, true })
+    {
+        PathGuideSettings guideSettings;
+        guideSettings.m_learnGuideFraction = bLearnFraction;
+        PathGuide guide(PathGuide::GetSceneBounds(scene.GetObjects()), guideSettings);
+        settings.m_pathGuide = &guide;
+        auto startTime = std::chrono::high_resolution_clock::now();
+        FrameBuffer training(width, height);
+        for (int trainingSpp = 1; trainingSpp < spp; trainingSpp *= 2)
+        {
+            settings.m_samplesPerPixel = trainingSpp;
+            renderer.RenderPass(world, camera, settings, training);
+            guide.Update();
+        }
+        double trainingMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+        
+        double guidedMs;
+        double guidedError = measure(guidedMs);
+        cout << (bLearnFraction ? "  Learned fraction:  MSE " : "  Fixed fraction:    MSE ") << guidedError << " in " << guidedMs
+             << " ms (+" << trainingMs << " ms training, " << guide.GetLeafCount() << " leaves), variance ratio per sample "
+             << unguidedError / guidedError << "x, per unit time " << (unguidedError * unguidedMs) / (guidedError * guidedMs) << "x" << endl;
+        settings.m_pathGuide = nullptr;
+    }
+}
+
+// Path guiding on the glass-heavy scene under the smooth gradient sky, where
+// cosine sampling is already close to optimal and the guide should learn to
+// stay out of the way, and on the caustic scene, where the ground below the
+// glass is lit through it by two small, strong lights that next event
+// estimation cannot see. The caustic reference is bidirectional, which finds
+// those paths far more often than any unidirectional estimate being measured.
+int RunGuidingBenchmark(int spp, int referenceSpp)
+{
+    const int width = image_width / 5;
+    const int height = image_height / 5;
+    Camera camera = CameraSettings().Build(double(width) / height);
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool);
+    RenderSettings settings;
+    settings.m_maxDepth = kMaxDepth;
+    
+    HittableList scene = GetScene();
+    HittableBVH world(scene.GetObjects());
+    CompareGuiding("Glass spheres under the sky", scene, world, camera, settings, IntegratorType::Path,
+                   spp, referenceSpp, renderer, width, height);
+    
+    HittableList causticScene = GetCausticScene();
+    HittableBVH causticWorld(causticScene.GetObjects());
+    LightTree lightTree;
+    lightTree.Build(LightTree::GatherLights(causticScene.GetObjects()));
+    RenderSettings causticSettings = settings;
+    causticSettings.m_lightTree = &lightTree;
+    causticSettings.m_skyIntensity = 0.02f;
+    CompareGuiding("Caustic scene", causticScene, causticWorld, camera, causticSettings, IntegratorType::Bidirectional,
+                   spp, referenceSpp, renderer, width, height);
+    return 0;
+}
+
+// Noise of direct lighting estimates as the number of lights grows, picking
+// lights uniformly or with the light tree. Estimates are taken at the first
+// hit of each pixel's center ray so that nothing but light selection differs.
+int RunLightBenchmark(int spp, int referenceSpp)
+{
+    const int width = image_width / 5;
+    const int height = image_height / 5;
+    Camera camera = CameraSettings().Build(double(width) / height);
+    cout << "Reference " << referenceSpp << " spp, " << spp << " spp per estimate, " << width << "x" << height << endl;
+    for (int numLights : { 16, 256, 4096 })
+    {
+        HittableList scene = GetNightScene(numLights);
+        HittableBVH world(scene.GetObjects());
+        LightTree lightTree;
+        lightTree.Build(LightTree::GatherLights(scene.GetObjects()));
+        
+        std::vector<Ray> rays;
+        std::vector<HitRecord> hits;
+        for (int j = 0; j < height; ++j)
+        {
+            for (int i = 0; i < width; ++i)
+            {
+                Ray r = camera.GetRay((i + 0.5) / width, (j + 0.5) / height);
+                HitRecord hitRec;
+                if (world.hit(r, 0.001, s_kInfinity, hitRec) && !hitRec.m_material->IsSpecular() &&
+                    Luminance(hitRec.m_material->Emitted(hitRec)) <= 0)
+                {
+                    rays.push_back(r);
+                    hits.push_back(hitRec);
+                }
+            }
+        }
+        
+        // Mean reflected direct light at every shading point.
+        auto estimate = [&](int samples, std::vector<float>& estimates_out)
+        {
+            estimates_out.assign(hits.size(), 0.0f);
+            for (size_t point = 0; point < hits.size(); ++point)
+            {
+                const HitRecord& hitRec = hits[point];
+                Vector3 sum = Vector3::GetZero();
+                for (int s = 0; s < samples; ++s)
+                {
+                    int light;
+                    double pmf, directionPdf;
+                    Vector3 direction;
+                    float distance;
+                    if (lightTree.Sample(hitRec.m_point, hitRec.m_normal, RandomDouble(), light, pmf) &&
+                        LightTree::SampleSphere(hitRec.m_point, lightTree.GetLight(light), direction, directionPdf, distance) &&
+                        !world.occluded(Ray(hitRec.m_point, direction), 0.001, distance * 0.999f))
+                    {
+                        double cosine = fabs(dot(direction, hitRec.m_normal));
+                        sum += hitRec.m_material->Evaluate(rays[point], hitRec, direction) * lightTree.GetLight(light).m_radiance *
+                               (cosine / (pmf * directionPdf));
+                    }
+                }
+                estimates_out[point] = Luminance(sum) / samples;
+            }
+        };
+        
+        std::vector<float> reference, uniform, tree;
+        estimate(referenceSpp, reference);
+        
+        lightTree.SetUniform(true);
+        auto startTime = std::chrono::high_resolution_clock::now();
+        estimate(spp, uniform);
+        double uniformMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+        
+        lightTree.SetUniform(false);
+        startTime = std::chrono::high_resolution_clock::now();
+        estimate(spp, tree);
+        double treeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+        
+        // Relative squared error, so that the few points right next to a
+        // light do not decide the result.
+        double uniformError = 0, treeError = 0;
+        for (size_t point = 0; point < hits.size(); ++point)
+        {
+            double scale = reference[point] * reference[point] + 1e-2;
+            uniformError += (uniform[point] - reference[point]) * (uniform[point] - reference[point]) / scale;
+            treeError += (tree[point] - reference[point]) * (tree[point] - reference[point]) / scale;
+        }
+        cout << numLights << " lights: uniform relMSE " << uniformError / hits.size() << " in " << uniformMs
+             << " ms, light tree relMSE " << treeError / hits.size() << " in " << treeMs << " ms" << endl;
+    }
+    return 0;
+}
+
+// Renders a reference of each benchmark scene, then convergence curves of a
+// few render configurations against it. Prints every curve, optionally
+// writes them all as CSV, and ends with the time each configuration needs
+// to reach targetRMSE per scene.
+int RunConvergenceBenchmark(int referenceSpp, double targetRMSE, const string& csvFileName)
+{
+    struct Configuration
+    {
+        const char* m_name;
+        RenderSettings m_settings;
+    };
+    std::vector<Configuration> configurations(4);
+    configurations[0].m_name = "baseline";
+    configurations[1].m_name = "stratified";
+    configurations[1].m_settings.m_sampler = SamplerType::Stratified;
+    configurations[2].m_name = "scalar-primary";
+    configurations[2].m_settings.m_primaryPackets = false;
+    configurations[3].m_name = "tile-64";
+    configurations[3].m_settings.m_tileSize = 64;
+    for (Configuration& configuration : configurations)
+    {
+        configuration.m_settings.m_maxDepth = kMaxDepth;
+    }
+    
+    const char* sceneNames[] = { "spheres", "demo" };
+    HittableList scenes[] = { GetScene(), GetDemoScene() };
+    const int width = image_width / 5;
+    const int height = image_height / 5;
+    Camera camera = CameraSettings().Build(double(width) / height);
+    ConvergenceSettings convergenceSettings;
+    convergenceSettings.m_maxSamplesPerPixel = std::max(1, referenceSpp / 16);
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool);
+    
+    std::ofstream csv;
+    if (!csvFileName.empty())
+    {
+        csv.open(csvFileName.c_str());
+        if (!csv)
+        {
+            cerr << "Cannot write " << csvFileName << endl;
+            return 1;
+        }
+        csv << "scene,configuration,spp,seconds,rmse,relmse" << endl;
+    }
+    
+    std::vector<std::vector<double>> secondsToTarget;
+    for (int scene = 0; scene < 2; ++scene)
+    {
+        FrameBuffer reference(width, height);
+        RenderSettings referenceSettings = configurations[0].m_settings;
+        referenceSettings.m_samplesPerPixel = referenceSpp;
+        renderer.RenderPass(scenes[scene], camera, referenceSettings, reference);
+        
+        secondsToTarget.emplace_back();
+        for (const Configuration& configuration : configurations)
+        {
+            FrameBuffer frameBuffer;
+            std::vector<ConvergencePoint> points = MeasureConvergence(renderer, scenes[scene], camera, configuration.m_settings,
+                                                                      reference, frameBuffer, convergenceSettings);
+            PrintConvergence(string(sceneNames[scene]) + " / " + configuration.m_name, points, targetRMSE, cout);
+            for (const ConvergencePoint& point : points)
+            {
+                if (csv)
+                {
+                    csv << sceneNames[scene] << "," << configuration.m_name << "," << point.m_samplesPerPixel << ","
+                        << point.m_seconds << "," << point.m_error.m_rmse << "," << point.m_error.m_relMSE << endl;
+                }
+            }
+            secondsToTarget.back().push_back(GetSecondsToError(points, targetRMSE));
+        }
+    }
+    
+    cout << "Seconds to RMSE " << targetRMSE << " against " << referenceSpp << " spp references:" << endl;
+    for (size_t configuration = 0; configuration < configurations.size(); ++configuration)
+    {
+        cout << "  " << configurations[configuration].m_name;
+        for (int scene = 0; scene < 2; ++scene)
+        {
+            double seconds = secondsToTarget[scene][configuration];
+            cout << "  " << sceneNames[scene] << " ";
+            if (seconds < 0)
+            {
+                cout << "not reached";
+            }
+            else
+            {
+                cout << seconds;
+            }
+        }
+        cout << endl;
+    }
+    return 0;
+}
+
+// Convergence of the path tracer, with next event estimation through the
+// light tree, and the bidirectional one on the caustic scene, against a
+// bidirectional reference. The mean brightness of a path traced reference
+// of the same length is printed next to it as a check that both converge
+// to the same image.
+int RunBidirectionalBenchmark(int referenceSpp, double targetRMSE)
+{
+    HittableList scene = GetCausticScene();
+    HittableBVH world(scene.GetObjects());
+    LightTree lightTree;
+    lightTree.Build(LightTree::GatherLights(scene.GetObjects()));
+    
+    const int width = image_width / 5;
+    const int height = image_height / 5;
+    Camera camera = CameraSettings().Build(double(width) / height);
+    RenderSettings pathSettings;
+    pathSettings.m_maxDepth = kMaxDepth;
+    pathSettings.m_lightTree = &lightTree;
+    pathSettings.m_skyIntensity = 0.02f;
+    RenderSettings bidirectionalSettings = pathSettings;
+    bidirectionalSettings.m_integrator = IntegratorType::Bidirectional;
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool);
+    
+    auto getMeanLuminance = [](const FrameBuffer& frameBuffer)
+    {
+        double sum = 0;
+        for (int j = 0; j < frameBuffer.Height(); ++j)
+        {
+            for (int i = 0; i < frameBuffer.Width(); ++i)
+            {
+                sum += Luminance(frameBuffer.GetColorSum(i, j)) / frameBuffer.GetSampleCount(i, j);
+            }
+        }
+        return sum / (frameBuffer.Width() * frameBuffer.Height());
+    };
+    
+    FrameBuffer reference(width, height);
+    FrameBuffer pathReference(width, height);
+    bidirectionalSettings.m_samplesPerPixel = referenceSpp;
+    pathSettings.m_samplesPerPixel = referenceSpp;
+    renderer.RenderPass(world, camera, bidirectionalSettings, reference);
+    renderer.RenderPass(world, camera, pathSettings, pathReference);
+    cout << "Reference " << referenceSpp << " spp, " << width << "x" << height << ", mean luminance bidirectional "
+         << getMeanLuminance(reference) << ", path " << getMeanLuminance(pathReference) << endl;
+    
+    ConvergenceSettings convergenceSettings;
+    convergenceSettings.m_maxSamplesPerPixel = std::max(1, referenceSpp / 16);
+    const char* names[] = { "path", "bidirectional" };
+    const RenderSettings* settings[] = { &pathSettings, &bidirectionalSettings };
+    for (int integrator = 0; integrator < 2; ++integrator)
+    {
+        FrameBuffer frameBuffer;
+        std::vector<ConvergencePoint> points = MeasureConvergence(renderer, world, camera, *settings[integrator],
+                                                                  reference, frameBuffer, convergenceSettings);
+        PrintConvergence(names[integrator], points, targetRMSE, cout);
+    }
+    return 0;
+}
+
+// Closest-hit throughput of one ray at a time against interleaved batches
+// with 1 to 16 lanes, then render time with and without interleaved
+// traversal, on a sphere soup that fits in the last level cache and on one
+// a hundred times larger.
+int RunInterleavedBenchmark(int numSpheres, int spp)
+{
+    const int numRays = 1 << 20;
+    const int batchSize = 4096;
+    const int width = image_width / 5;
+    const int height = image_height / 5;
+    Camera camera = CameraSettings().Build(double(width) / height);
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool);
+    
+    for (int count : { numSpheres / 100, numSpheres })
+    {
+        HittableList scene = GetSphereSoup(count);
+        HittableBVH world(scene.GetObjects());
+        cout << count << " spheres" << endl;
+        
+        // Incoherent rays, like those of later bounces.
+        std::vector<Ray> rays;
+        for (int ray = 0; ray < numRays; ++ray)
+        {
+            Vector3 origin(RandomDouble(-20, 20), RandomDouble(-5, 5), RandomDouble(-20, 20));
+            rays.push_back(Ray(origin, Vector3::GetRandomUnitVector()));
+        }
+        
+        std::vector<float> scalarT(numRays);
+        auto startTime = std::chrono::high_resolution_clock::now();
+        for (int ray = 0; ray < numRays; ++ray)
+        {
+            HitRecord rec;
+            scalarT[ray] = world.hit(rays[ray], 0.001, s_kInfinity, rec) ? rec.m_t : float(s_kInfinity);
+        }
+        double scalarMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+        cout << "  one ray at a time:  " << numRays / scalarMs / 1000.0 << " Mrays/s" << endl;
+        
+        std::vector<float> t(numRays);
+        std::vector<const Hittable*> objects(numRays);
+        for (int lanes : { 1, 4, 8, 16 })
+        {
+            world.SetInterleavedLanes(lanes);
+            std::fill(t.begin(), t.end(), float(s_kInfinity));
+            startTime = std::chrono::high_resolution_clock::now();
+            for (int first = 0; first < numRays; first += batchSize)
+            {
+                world.hitBatch(&rays[first], std::min(batchSize, numRays - first), 0.001, &t[first], &objects[first]);
+            }
+            double batchMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+            int mismatches = 0;
+            for (int ray = 0; ray < numRays; ++ray)
+            {
+                mismatches += t[ray] != scalarT[ray] ? 1 : 0;
+            }
+            cout << "  " << lanes << " lanes interleaved: " << numRays / batchMs / 1000.0 << " Mrays/s, "
+                 << scalarMs / batchMs << "x" << (mismatches ? ", hits differ!" : "") << endl;
+        }
+        world.SetInterleavedLanes(8);
+        
+        RenderSettings settings;
+        settings.m_samplesPerPixel = spp;
+        settings.m_maxDepth = kMaxDepth;
+        double renderMs[2];
+        double meanLuminance[2];
+        for (int interleaved = 0; interleaved < 2; ++interleaved)
+        {
+            settings.m_interleavedTraversal = interleaved == 1;
+            FrameBuffer frameBuffer(width, height);
+            startTime = std::chrono::high_resolution_clock::now();
+            renderer.RenderPass(world, camera, settings, frameBuffer);
+            renderMs[interleaved] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+            meanLuminance[interleaved] = 0;
+            for (int j = 0; j < height; ++j)
+            {
+                for (int i = 0; i < width; ++i)
+                {
+                    meanLuminance[interleaved] += Luminance(frameBuffer.GetColorSum(i, j)) / (spp * width * height);
+                }
+            }
+        }
+        cout << "  render " << spp << " spp: " << renderMs[0] << " ms, interleaved " << renderMs[1] << " ms ("
+             << renderMs[0] / renderMs[1] << "x), mean luminance " << meanLuminance[0] << " / " << meanLuminance[1] << endl;
+    }
+    return 0;
+}
+
+// Bakes ambient occlusion and irradiance for the large diffuse sphere of the
+// default scene, writes both maps as PPM next to outputPrefix and reports
+// the ray throughput of the bake.
+int RunBake(const string& outputPrefix, int samplesPerTexel)
+{
+    HittableList scene = GetScene();
+    HittableBVH world(scene.GetObjects());
+    unique_ptr<ThreadPool> threadPool;
+    Baker baker = MakeRenderer<Baker>(threadPool);
+    
+    BakeSettings settings;
+    settings.m_width = 256;
+    settings.m_height = 128;
+    settings.m_samplesPerTexel = samplesPerTexel;
+    FrameBuffer ambientOcclusion, irradiance;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    size_t rays = baker.BakeSphere(world, Vector3(-4, 1, 0), 1.0f, settings, ambientOcclusion, irradiance);
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+    cout << "Baked " << settings.m_width << "x" << settings.m_height << " texels, " << rays << " rays in " << seconds
+         << " s (" << rays / seconds / 1e6 << " Mrays/s)" << endl;
+    
+    if (!ambientOcclusion.WritePPM(outputPrefix + "_ao.ppm") || !irradiance.WritePPM(outputPrefix + "_irradiance.ppm"))
+    {
+        cout << "Could not write " << outputPrefix << "_*.ppm" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// A clear sky with a small, very bright sun 30 degrees above the horizon and
+// a dim ground below it, as a latitude-longitude map.
+EnvironmentMap GetSunSkyMap(int width, int height)
+{
+    const Vector3 sunDirection = unit_vector(Vector3(0.6, 0.5, 0.6));
+    const double sunCosine = cos(DegreesToRadian(1.0));
+    std::vector<Vector3> pixels(width * height);
+    for (int j = 0; j < height; ++j)
+    {
+        double theta = (j + 0.5) / height * s_kPI;
+        for (int i = 0; i < width; ++i)
+        {
+            double phi = (i + 0.5) / width * 2 * s_kPI;
+            Vector3 direction(sin(theta) * sin(phi), cos(theta), -sin(theta) * cos(phi));
+            float up = direction.Y();
+            Vector3 radiance = up > 0 ? (1 - up) * Vector3(0.9, 0.9, 1.0) + up * Vector3(0.3, 0.5, 1.0) : Vector3(0.1, 0.09, 0.08);
+            if (dot(direction, sunDirection) > sunCosine)
+            {
+                radiance = Vector3(10000, 9000, 8000);
+            }
+            pixels[j * width + i] = radiance;
+        }
+    }
+    
+    EnvironmentMap map;
+    map.SetPixels(width, height, std::move(pixels));
+    return map;
+}
+
+// Ground and spheres with rough materials only, so that every bounce can
+// sample the sky. Mirrors and glass would show the sun as fireflies either
+// way.
+HittableList GetOutdoorScene()
+{
+    HittableList scene;
+    scene.AddHittable(scene.Create<Sphere>(Vector3(0, -1000, 0), 1000, scene.Create<Lambertian>(Vector3(0.5, 0.5, 0.5))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(0, 1, 0), 1.0, scene.Create<Lambertian>(Vector3(0.7, 0.7, 0.7))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(-4, 1, 0), 1.0, scene.Create<Lambertian>(Vector3(0.4, 0.2, 0.1))));
+    scene.AddHittable(scene.Create<Sphere>(Vector3(4, 1, 0), 1.0, scene.Create<Metal>(Vector3(0.7, 0.6, 0.5), 0.3)));
+    for (int sphere = 0; sphere < 60; ++sphere)
+    {
+        Vector3 center(RandomDouble(-8, 8), 0.2, RandomDouble(-8, 8));
+        scene.AddHittable(scene.Create<Sphere>(center, 0.2, scene.Create<Lambertian>(Vector3::Random() * Vector3::Random())));
+    }
+    return scene;
+}
+
+// Writes the sun and sky map as PFM, loads it back and measures how fast
+// the outdoor scene converges under it when sky light is only found by
+// paths that escape, and when it is also importance sampled at every rough
+// hit, against a reference rendered with importance sampling.
+int RunEnvironmentBenchmark(const string& mapFileName, int referenceSpp, double targetRMSE)
+{
+    EnvironmentMap environment;
+    if (!GetSunSkyMap(1024, 512).WritePFM(mapFileName) || !environment.LoadPFM(mapFileName))
+    {
+        cout << "Could not write and reload " << mapFileName << endl;
+        return 1;
+    }
+    
+    HittableList scene = GetOutdoorScene();
+    HittableBVH world(scene.GetObjects());
+    const int width = image_width / 5;
+    const int height = image_height / 5;
+    Camera camera = CameraSettings().Build(double(width) / height);
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool);
+    
+    RenderSettings sampledSettings;
+    sampledSettings.m_maxDepth = kMaxDepth;
+    sampledSettings.m_environment = &environment;
+    RenderSettings escapeSettings = sampledSettings;
+    escapeSettings.m_sampleEnvironment = false;
+    
+    FrameBuffer reference(width, height);
+    sampledSettings.m_samplesPerPixel = referenceSpp;
+    renderer.RenderPass(world, camera, sampledSettings, reference);
+    cout << "Reference " << referenceSpp << " spp, " << width << "x" << height << ", map " << environment.Width() << "x"
+         << environment.Height() << " from " << mapFileName << endl;
+    
+    ConvergenceSettings convergenceSettings;
+    convergenceSettings.m_maxSamplesPerPixel = std::max(1, referenceSpp / 16);
+    const char* names[] = { "escape only", "importance sampled" };
+    const RenderSettings* settings[] = { &escapeSettings, &sampledSettings };
+    for (int configuration = 0; configuration < 2; ++configuration)
+    {
+        FrameBuffer frameBuffer;
+        std::vector<ConvergencePoint> points = MeasureConvergence(renderer, world, camera, *settings[configuration],
+                                                                  reference, frameBuffer, convergenceSettings);
+        PrintConvergence(names[configuration], points, targetRMSE, cout);
+    }
+    return 0;
+}
+
+bool ParseFrameBufferFormat(const string& name, FrameBufferFormat& format_out)
+{
+    if (name == "float32")      format_out = FrameBufferFormat::Float32;
+    else if (name == "half")    format_out = FrameBufferFormat::Half;
+    else if (name == "rgb9e5")  format_out = FrameBufferFormat::RGB9E5;
+    else return false;
+    return true;
+}
+
+// Relative error of image's deviation planes against those of reference,
+// counted like ImageError::m_relMSE.
+double GetDeviationError(const FrameBuffer& image, const FrameBuffer& reference)
+{
+    double relativeSum = 0;
+    for (int j = 0; j < image.Height(); ++j)
+    {
+        for (int i = 0; i < image.Width(); ++i)
+        {
+            double expected = sqrt(reference.GetVariance(i, j));
+            double difference = sqrt(image.GetVariance(i, j)) - expected;
+            relativeSum += difference * difference / (expected * expected + 1e-2);
+        }
+    }
+    return sqrt(relativeSum / (image.Width() * image.Height()));
+}
+
+// Renders one view into each frame buffer format from the same random
+// sequence and checks the averages and deviations against float storage.
+// Errors are relative, so that the sun and the dim sky are held to the same
+// standard. Passes of one sample each are the hardest case for the compact
+// formats, which round their averages again after every pass.
+bool CheckFrameBufferFormats(const string& name, const Hittable& world, const Camera& camera, const RenderSettings& settings,
+                             int width, int height, int passes)
+{
+    // Averages keep 16 significant bits in half floats and 14 bits of the
+    // brightest channel in RGB9E5; deviations are plain half floats. Being
+    // rounded again after every pass, their errors grow with the square root
+    // of the pass count; the tolerances hold up to 16384 passes.
+    const FrameBufferFormat formats[] = { FrameBufferFormat::Float32, FrameBufferFormat::Half, FrameBufferFormat::RGB9E5 };
+    const char* names[] = { "float32", "half", "rgb9e5" };
+    const double tolerances[] = { 0.0, 1e-3, 4e-3 };
+    const double deviationTolerance = 1e-2;
+    Renderer renderer(nullptr);
+    
+    FrameBuffer reference;
+    bool bPassed = true;
+    cout << name << ", " << width << "x" << height << ", " << passes << " passes of 1 spp" << endl;
+    for (int format = 0; format < 3; ++format)
+    {
+        FrameBuffer frameBuffer(width, height, formats[format]);
+        SeedRandom(1);
+        auto startTime = std::chrono::steady_clock::now();
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            renderer.RenderPass(world, camera, settings, frameBuffer);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        
+        ImageError error;
+        double deviationError = 0;
+        if (format == 0)
+        {
+            reference = std::move(frameBuffer);
+        }
+        else
+        {
+            error = GetImageError(frameBuffer, reference);
+            deviationError = GetDeviationError(frameBuffer, reference);
+        }
+        const bool bWithinTolerance = sqrt(error.m_relMSE) <= tolerances[format] && deviationError <= deviationTolerance;
+        bPassed = bPassed && bWithinTolerance;
+        cout << "  " << names[format] << ": " << seconds << " s, against float32 RMSE " << error.m_rmse << ", relative "
+             << sqrt(error.m_relMSE) << " (tolerance " << tolerances[format] << "), deviation relative "
+             << deviationError << " (tolerance " << (format == 0 ? 0.0 : deviationTolerance) << ")"
+             << (bWithinTolerance ? "" : " FAILED") << endl;
+    }
+    return bPassed;
+}
+
+// Checks the compact frame buffer formats against float storage on the demo
+// scene and on an HDR view with the sun of GetSunSkyMap() in it, and
+// reports their memory for a 16K poster, where it decides what fits.
+int RunFrameBufferCheck(int width, int passes)
+{
+    const FrameBufferFormat formats[] = { FrameBufferFormat::Float32, FrameBufferFormat::Half, FrameBufferFormat::RGB9E5 };
+    const char* names[] = { "float32", "half", "rgb9e5" };
+    const int posterWidth = 16384;
+    const int posterHeight = 8192;
+    for (int format = 0; format < 3; ++format)
+    {
+        const size_t posterBytes = FrameBuffer::GetBytesPerPixel(formats[format]) * posterWidth * posterHeight;
+        const double reduction = double(FrameBuffer::GetBytesPerPixel(FrameBufferFormat::Float32)) /
+                                 FrameBuffer::GetBytesPerPixel(formats[format]);
+        cout << names[format] << ": " << FrameBuffer::GetBytesPerPixel(formats[format]) << " bytes/pixel, "
+             << posterBytes / (1024 * 1024) << " MB at " << posterWidth << "x" << posterHeight << " (" << reduction
+             << "x smaller)" << endl;
+    }
+    
+    const int height = width * 2 / 3;
+    RenderSettings settings;
+    settings.m_samplesPerPixel = 1;
+    settings.m_maxDepth = kMaxDepth;
+    
+    HittableList scene = GetDemoScene();
+    HittableBVH world(scene.GetObjects());
+    bool bPassed = CheckFrameBufferFormats("Demo scene", world, CameraSettings().Build(double(width) / height), settings,
+                                           width, height, passes);
+    
+    // Looking up past the spheres towards the sun, whose pixels average
+    // around 10000 and whose edges have deviations in the thousands.
+    SeedRandom(0);
+    EnvironmentMap environment = GetSunSkyMap(1024, 512);
+    HittableList outdoorScene = GetOutdoorScene();
+    HittableBVH outdoorWorld(outdoorScene.GetObjects());
+    CameraSettings sunView;
+    sunView.m_lookFrom = Vector3(-6, 1, -6);
+    sunView.m_lookAt = sunView.m_lookFrom + Vector3(0.6, 0.25, 0.6);
+    sunView.m_vfov = 60;
+    sunView.m_aperture = 0;
+    settings.m_environment = &environment;
+    bPassed = CheckFrameBufferFormats("Sun and sky", outdoorWorld, sunView.Build(double(width) / height), settings,
+                                      width, height, passes) && bPassed;
+    return bPassed ? 0 : 1;
+}
+
+// Reports heap allocations during scene construction and verifies that a
+// steady-state render pass does not touch the allocator at all.
+int RunAllocationCheck()
+{
+#if TRACK_ALLOCATIONS
+    uint64_t buildStart = AllocationCounter::Get();
+    auto startTime = std::chrono::high_resolution_clock::now();
+    HittableList world = GetDemoScene();
+    auto endTime = std::chrono::high_resolution_clock::now();
+    uint64_t buildAllocations = AllocationCounter::Get() - buildStart;
+    
+    cout << "Scene build: " << world.Size() << " objects, " << buildAllocations << " allocations, "
+         << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms" << endl;
+    
+    CameraSettings cameraSettings;
+    Camera camera = cameraSettings.Build(3.0 / 2.0);
+    RenderSettings settings;
+    settings.m_samplesPerPixel = 2;
+    FrameBuffer frameBuffer(60, 40);
+    Renderer renderer(nullptr);
+    
+    // The first pass warms up the per-thread scratch arena.
+    renderer.RenderPass(world, camera, settings, frameBuffer);
+    uint64_t renderStart = AllocationCounter::Get();
+    renderer.RenderPass(world, camera, settings, frameBuffer);
+    uint64_t renderAllocations = AllocationCounter::Get() - renderStart;
+    
+    cout << "Render pass: " << renderAllocations << " allocations" << endl;
+    return renderAllocations == 0 ? 0 : 1;
 #else
-    imageFileName += "Basic_Image_4.ppm";
+    cout << "Allocation tracking is disabled, configure with -DRAYTRACING_TRACK_ALLOCATIONS=ON" << endl;
+    return 1;
 #endif
-    //cout << imageFileName << endl;
-    outputImage.open(imageFileName.c_str());
+}
+
+// Renders a small scene through the C interface the way an embedding
+// program would, polling progress while the pixels land in its own buffer.
+int RunAPICheck()
+{
+    RTScene* scene = RTCreateScene();
+    int ground = RTAddLambertian(scene, 0.5f, 0.5f, 0.5f);
+    int glass = RTAddDielectric(scene, 1.5f);
+    int gold = RTAddMetal(scene, 0.8f, 0.6f, 0.2f, 0.1f);
+    RTAddSphere(scene, 0, -1000, 0, 1000, ground);
+    RTAddSphere(scene, -1, 1, 0, 1, glass);
+    RTAddSphere(scene, 1, 1, 0, 1, gold);
+    bool bRejected = RTAddSphere(scene, 0, 0, 0, 1, 7) == RT_ERROR_INVALID_ARGUMENT;
     
-    HittableList world = GetScene();
+    RTCamera camera = { { 0, 2, 8 }, { 0, 1, 0 }, { 0, 1, 0 }, 30, 0, 8 };
+    RTSetCamera(scene, &camera);
     
-    // Lambertian Spheres
-    world.AddHittable(make_shared<Sphere>(Vector3(0.f, 0.f, -1.f), 0.5, make_shared<Lambertian>(Vector3(0.1, 0.2, 0.5))));
+    // Straight down onto the ground beside the spheres, then up out of the
+    // glass sphere from its center.
+    RTRay rays[2] = { { { 3, 5, 0 }, { 0, -2, 0 }, 0.001f, INFINITY }, { { -1, 1, 0 }, { 0, 1, 0 }, 0.001f, INFINITY } };
+    RTHit hits[2];
+    RTResult traceResult = RTTraceRays(scene, rays, hits, 2);
+    bool bTraced = traceResult == RT_SUCCESS && fabs(hits[0].t - 2.5f) < 1e-2f && hits[0].material == ground &&
+                   fabs(hits[0].normal[1] - 1) < 1e-2f && hits[1].material == glass && fabs(hits[1].t - 1) < 1e-3f &&
+                   fabs(hits[1].normal[1] - 1) < 1e-3f;
     
-    world.AddHittable(make_shared<Sphere>(Vector3(0.f, -100.5, -1.f), 100, make_shared<Lambertian>(Vector3(0.8, 0.8, 0.0))));
+    // The bottom of a sphere resting on the ground is occluded, its top is
+    // open.
+    RTBakeSettings bakeSettings = { 16, 8, 64, 0.5f };
+    std::vector<float> occlusion(bakeSettings.width * bakeSettings.height);
+    std::vector<float> bakedIrradiance(3 * occlusion.size());
+    RTResult bakeResult = RTBakeSphere(scene, gold, &bakeSettings, occlusion.data(), bakedIrradiance.data());
+    bool bBaked = bakeResult == RT_SUCCESS && occlusion.front() < 0.5f && occlusion.back() > 0.9f &&
+                  bakedIrradiance.back() > bakedIrradiance.front();
     
-    // Metal Spheres
-    world.AddHittable(make_shared<Sphere>(Vector3(1, 0, -1), 0.5, make_shared<Metal>(Vector3(0.8, 0.6, 0.2), RandomDouble())));
-    world.AddHittable(make_shared<Sphere>(Vector3(-1,0,-1), 0.5, make_shared<Metal>(Vector3(0.8, 0.8, 0.8), RandomDouble())));
+    RTRenderSettings settings = { 96, 64, 16, 8 };
+    std::vector<float> pixels(3 * settings.width * settings.height, -1.0f);
+    RTResult result = RT_SUCCESS;
+    std::thread renderThread([&]() { result = RTRender(scene, &settings, pixels.data(), 0); });
+    while (RTGetProgress(scene) < 1.0f)
+    {
+        cout << "Progress: " << int(100 * RTGetProgress(scene)) << "%\r" << flush;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    renderThread.join();
+    cout << "Progress: " << int(100 * RTGetProgress(scene)) << "%" << endl;
+    RTDestroyScene(scene);
     
-    world.AddHittable(make_shared<Sphere>(Vector3(1, 0, -1), 0.5, make_shared<Metal>(Vector3(0.8, 0.6, 0.2), 0.3)));
+    int badPixels = 0;
+    for (float value : pixels)
+    {
+        badPixels += !(value >= 0.0f && value < 1e6f);
+    }
     
-    // Dielectric
-    world.AddHittable(make_shared<Sphere>(Vector3(-1, 0, -1), 0.5, make_shared<Dielectric>(1.5)));
+    cout << "Render result " << result << ", " << badPixels << " unwritten or invalid values, invalid material "
+         << (bRejected ? "rejected" : "accepted") << endl;
+    cout << "Ray queries " << (bTraced ? "match" : "do not match") << " the scene, bake "
+         << (bBaked ? "matches" : "does not match") << " the expected occlusion" << endl;
+    return result == RT_SUCCESS && badPixels == 0 && bRejected && bTraced && bBaked ? 0 : 1;
+}
+
+int main(int argc, const char * argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--check-api") == 0)
+    {
+        return RunAPICheck();
+    }
     
-    world.AddHittable(make_shared<Sphere>(Vector3(-1, 0, -1), -0.45, make_shared<Dielectric>(1.5)));
+    if (argc > 1 && strcmp(argv[1], "--bench-occlusion") == 0)
+    {
+        int numRays = argc > 2 ? atoi(argv[2]) : 1000000;
+        RunOcclusionBenchmark(GetDemoScene(), numRays);
+        return 0;
+    }
     
-    Vector3 lookfrom(13, 2, 3);
-    Vector3 lookat(0, 0, 0);
-    Vector3 vup(0, 1, 0);
-    auto dist_to_focus = 10.0;
-    auto aperture = 0.1;
-    const auto aspect_ratio = double(image_width) / image_height;
+    if (argc > 1 && strcmp(argv[1], "--bench-packets") == 0)
+    {
+        RunPacketBenchmark(GetDemoScene());
+        return 0;
+    }
     
-    Camera camera(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus);
+    if (argc > 2 && strcmp(argv[1], "--stream-write") == 0)
+    {
+        int gridSize = argc > 3 ? atoi(argv[3]) : 64;
+        int spheresPerCell = argc > 4 ? atoi(argv[4]) : 256;
+        return WriteStreamedSphereSoup(argv[2], gridSize, spheresPerCell) ? 0 : 1;
+    }
     
-    outputImage << "P3\n" << image_width << " " << image_height << "\n255\n";
-    std::string pixelColorString;
+    if (argc > 2 && strcmp(argv[1], "--stream-render") == 0)
+    {
+        size_t residentMB = 256;
+        string imageFileName = "streamed.ppm";
+        int spp = samplesPerPixel;
+        for (int arg = 3; arg + 1 < argc; arg += 2)
+        {
+            if (strcmp(argv[arg], "--resident-mb") == 0)    residentMB = atoi(argv[arg + 1]);
+            else if (strcmp(argv[arg], "--output") == 0)    imageFileName = argv[arg + 1];
+            else if (strcmp(argv[arg], "--spp") == 0)       spp = atoi(argv[arg + 1]);
+        }
+        return RunStreamedRender(argv[2], residentMB, imageFileName, spp);
+    }
     
-    cout << "Creating image " << imageFileName << endl;
-#if USE_MULTITHREADED_SYSTEM
-    ThreadPool threadPool;
-#endif
-    for (int j = image_height - 1; j > -1; --j)
+    if (argc > 2 && strcmp(argv[1], "--batch") == 0)
     {
-        for (int i = 0; i < image_width; ++i)
+        int spp = samplesPerPixel;
+        for (int arg = 3; arg + 1 < argc; arg += 2)
+        {
+            if (strcmp(argv[arg], "--spp") == 0)            spp = atoi(argv[arg + 1]);
+        }
+        return RunBatchRender(argv[2], spp);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--profile") == 0)
+    {
+        string imageFileName = "profile.ppm";
+        int spp = 4;
+        for (int arg = 2; arg + 1 < argc; arg += 2)
+        {
+            if (strcmp(argv[arg], "--output") == 0)         imageFileName = argv[arg + 1];
+            else if (strcmp(argv[arg], "--spp") == 0)       spp = atoi(argv[arg + 1]);
+        }
+        return RunProfile(imageFileName, spp);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--bench-guiding") == 0)
+    {
+        int spp = argc > 2 ? atoi(argv[2]) : 64;
+        int referenceSpp = argc > 3 ? atoi(argv[3]) : 1024;
+        return RunGuidingBenchmark(spp, referenceSpp);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--bench-lights") == 0)
+    {
+        int spp = argc > 2 ? atoi(argv[2]) : 4;
+        int referenceSpp = argc > 3 ? atoi(argv[3]) : 1024;
+        return RunLightBenchmark(spp, referenceSpp);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--bench-convergence") == 0)
+    {
+        int referenceSpp = 1024;
+        double targetRMSE = 0.05;
+        string csvFileName;
+        for (int arg = 2; arg + 1 < argc; arg += 2)
+        {
+            if (strcmp(argv[arg], "--reference-spp") == 0)  referenceSpp = atoi(argv[arg + 1]);
+            else if (strcmp(argv[arg], "--target") == 0)    targetRMSE = atof(argv[arg + 1]);
+            else if (strcmp(argv[arg], "--csv") == 0)       csvFileName = argv[arg + 1];
+        }
+        return RunConvergenceBenchmark(referenceSpp, targetRMSE, csvFileName);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--bench-bdpt") == 0)
+    {
+        int referenceSpp = argc > 2 ? atoi(argv[2]) : 256;
+        double targetRMSE = argc > 3 ? atof(argv[3]) : 0.05;
+        return RunBidirectionalBenchmark(referenceSpp, targetRMSE);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--bench-interleaved") == 0)
+    {
+        int numSpheres = argc > 2 ? atoi(argv[2]) : 1000000;
+        int spp = argc > 3 ? atoi(argv[3]) : 2;
+        return RunInterleavedBenchmark(numSpheres, spp);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--bake") == 0)
+    {
+        string outputPrefix = argc > 2 ? argv[2] : "bake";
+        int samplesPerTexel = argc > 3 ? atoi(argv[3]) : 256;
+        return RunBake(outputPrefix, samplesPerTexel);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--bench-environment") == 0)
+    {
+        string mapFileName = argc > 2 ? argv[2] : "sun_sky.pfm";
+        int referenceSpp = argc > 3 ? atoi(argv[3]) : 256;
+        double targetRMSE = argc > 4 ? atof(argv[4]) : 0.5;
+        return RunEnvironmentBenchmark(mapFileName, referenceSpp, targetRMSE);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--check-framebuffer") == 0)
+    {
+        int width = argc > 2 ? atoi(argv[2]) : 64;
+        int passes = argc > 3 ? atoi(argv[3]) : 1024;
+        return RunFrameBufferCheck(width, passes);
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--check-allocations") == 0)
+    {
+        return RunAllocationCheck();
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "--preview") == 0)
+    {
+        PreviewSettings settings;
+        settings.m_width = image_width;
+        settings.m_height = image_height;
+        settings.m_targetSamplesPerPixel = samplesPerPixel;
+        settings.m_maxDepth = kMaxDepth;
+        if (argc > 2)
         {
+            settings.m_outputFile = argv[2];
+        }
+        
+        HittableList world = GetDemoScene();
+        ThreadPool threadPool;
+        PreviewServer server(world, &threadPool, CameraSettings(), settings);
+        server.Run(std::cin);
+        return 0;
+    }
+    
+    auto startTime = std::chrono::high_resolution_clock::now();
+    
+    string imageFileName(ASSETS_PATH);
 #if USE_MULTITHREADED_SYSTEM
-            threadPool.QueueJob(std::bind(&ComputeColor, i, j, world, camera));
+    imageFileName += "Basic_Image_6.ppm";
 #else
-            Vector3 color(0, 0, 0);
-            for (int s = 0; s < samplesPerPixel; ++s)
+    imageFileName += "Basic_Image_4.ppm";
+#endif
+    int spp = samplesPerPixel;
+    string textureFileName;
+    size_t textureBudgetMB = 64;
+    string numaMode;    // "pin" or "replicate"
+    double budgetMs = 0;
+    int guideIterations = 0;
+    string integratorName = "path";     // or "bdpt"
+    string environmentFileName;         // PFM lat-long map replacing the sky
+    string frameBufferFormatName = "float32";  // or "half" or "rgb9e5"
+    for (int arg = 1; arg + 1 < argc; arg += 2)
+    {
+        if (strcmp(argv[arg], "--output") == 0)                 imageFileName = argv[arg + 1];
+        else if (strcmp(argv[arg], "--spp") == 0)               spp = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "--texture") == 0)           textureFileName = argv[arg + 1];
+        else if (strcmp(argv[arg], "--texture-budget-mb") == 0) textureBudgetMB = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "--numa") == 0)              numaMode = argv[arg + 1];
+        else if (strcmp(argv[arg], "--budget-ms") == 0)         budgetMs = atof(argv[arg + 1]);
+        else if (strcmp(argv[arg], "--guide") == 0)             guideIterations = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "--integrator") == 0)        integratorName = argv[arg + 1];
+        else if (strcmp(argv[arg], "--environment") == 0)       environmentFileName = argv[arg + 1];
+        else if (strcmp(argv[arg], "--framebuffer") == 0)       frameBufferFormatName = argv[arg + 1];
+    }
+    
+    // PPM textures are converted to the tiled format next to the source.
+    TextureCache textureCache(textureBudgetMB * 1024 * 1024);
+    shared_ptr<Texture> texture;
+    if (!textureFileName.empty())
+    {
+        string tiledFileName = textureFileName;
+        if (tiledFileName.size() > 4 && tiledFileName.compare(tiledFileName.size() - 4, 4, ".ppm") == 0)
+        {
+            tiledFileName = textureFileName + ".rtt";
+            if (!TextureCache::ConvertPPM(textureFileName, tiledFileName))
             {
-                auto u = (i + RandomDouble()) / image_width;
-                auto v = (j + RandomDouble()) / image_height;
-                Ray r = camera.GetRay(u, v);
-                color += GetColor(r, world, kMaxDepth);
+                cout << "Could not convert texture " << textureFileName << endl;
+                return 1;
             }
-            color.WriteColor(pixelColorString, samplesPerPixel);
-#endif
         }
+        
+        int textureId = textureCache.Open(tiledFileName);
+        if (textureId < 0)
+        {
+            cout << "Could not open texture " << tiledFileName << endl;
+            return 1;
+        }
+        texture = make_shared<ImageTexture>(&textureCache, textureId);
     }
     
-#if USE_MULTITHREADED_SYSTEM
-    threadPool.WaitUntilDone();
+    CameraSettings cameraSettings;
+    cameraSettings.m_lookFrom = Vector3(13, 2, 3);
+    cameraSettings.m_lookAt = Vector3(0, 0, 0);
+    cameraSettings.m_vup = Vector3(0, 1, 0);
+    cameraSettings.m_focusDistance = 10.0;
+    cameraSettings.m_aperture = 0.1;
+    const auto aspect_ratio = double(image_width) / image_height;
     
-    //All Threads are done. Colate results.
+    Camera camera = cameraSettings.Build(aspect_ratio);
+    
+    RenderSettings settings;
+    settings.m_samplesPerPixel = spp;
+    settings.m_maxDepth = kMaxDepth;
+    if (integratorName == "bdpt")
+    {
+        settings.m_integrator = IntegratorType::Bidirectional;
+    }
+    else if (integratorName != "path")
+    {
+        cout << "Unknown integrator " << integratorName << ", expected path or bdpt" << endl;
+        return 1;
+    }
+    EnvironmentMap environment;
+    if (!environmentFileName.empty())
     {
-        std::unique_lock<std::mutex> mut(main_mutex);
-        for (int j = image_height-1; j >= 0; --j)
+        if (!environment.LoadPFM(environmentFileName))
         {
-            for (int i = 0; i < image_width; ++i)
+            cout << "Could not load environment map " << environmentFileName << endl;
+            return 1;
+        }
+        settings.m_environment = &environment;
+    }
+    FrameBuffer frameBuffer;
+    FrameBufferFormat frameBufferFormat;
+    if (!ParseFrameBufferFormat(frameBufferFormatName, frameBufferFormat))
+    {
+        cout << "Unknown frame buffer format " << frameBufferFormatName << ", expected float32, half or rgb9e5" << endl;
+        return 1;
+    }
+    frameBuffer.SetFormat(frameBufferFormat);
+    
+    cout << "Creating image " << imageFileName << endl;
+    NumaTopology topology;
+    if (!numaMode.empty())
+    {
+        topology = NumaTopology::Detect();
+        for (int node = 0; node < topology.GetNodeCount(); ++node)
+        {
+            cout << "NUMA node " << topology.GetNode(node).m_id << ": "
+                 << topology.GetNode(node).m_cpus.size() << " cpus" << endl;
+        }
+    }
+    unique_ptr<ThreadPool> threadPool;
+    Renderer renderer = MakeRenderer(threadPool, numaMode.empty() ? nullptr : &topology);
+    
+    // Every copy of the scene is built from the same seed, so replicas built
+    // on each node's own workers are identical to the shared one.
+    SeedRandom(0);
+    HittableList world = GetDemoScene(texture);
+    
+    // Light paths start on emitters; without any, bdpt would only trace
+    // camera paths.
+    LightTree lightTree;
+    if (settings.m_integrator == IntegratorType::Bidirectional)
+    {
+        lightTree.Build(LightTree::GatherLights(world.GetObjects()));
+        if (lightTree.IsEmpty())
+        {
+            cout << "The bdpt integrator needs emissive spheres to start light paths from, the scene has none" << endl;
+            return 1;
+        }
+        settings.m_lightTree = &lightTree;
+    }
+    
+    std::vector<unique_ptr<HittableList>> replicas;
+#if USE_MULTITHREADED_SYSTEM
+    if (numaMode == "replicate")
+    {
+        replicas.resize(threadPool->GetNodeCount());
+        for (int node = 0; node < threadPool->GetNodeCount(); ++node)
+        {
+            threadPool->QueueJob([&replicas, &texture, node]()
             {
-                pixelColor[i][j].WriteColor(pixelColorString, samplesPerPixel);
-            }
+                // Leave the worker's own sample sequence as it was.
+                std::mt19937 workerGenerator = GetRandomGenerator();
+                SeedRandom(0);
+                replicas[node].reset(new HittableList(GetDemoScene(texture)));
+                GetRandomGenerator() = workerGenerator;
+            }, node, true);
         }
+        threadPool->WaitUntilDone();
+        
+        std::vector<const Hittable*> replicaPointers;
+        for (auto& replica : replicas)
+        {
+            replicaPointers.push_back(replica.get());
+        }
+        renderer.SetSceneReplicas(replicaPointers);
     }
 #endif
-    outputImage << pixelColorString;
     
-    outputImage.close();
+    renderer.AllocateFrameBuffer(frameBuffer, image_width, image_height, settings.m_tileSize);
+    // Training passes of 1, 2, 4... spp teach the guide before the main
+    // pass; their samples are kept in the image.
+    PathGuide guide(PathGuide::GetSceneBounds(world.GetObjects()));
+    if (guideIterations > 0)
+    {
+        RenderSettings trainingSettings = settings;
+        trainingSettings.m_pathGuide = &guide;
+        for (int iteration = 0; iteration < guideIterations; ++iteration)
+        {
+            trainingSettings.m_samplesPerPixel = 1 << iteration;
+            renderer.RenderPass(world, camera, trainingSettings, frameBuffer);
+            guide.Update();
+        }
+        settings.m_pathGuide = &guide;
+        cout << "Path guide trained over " << guideIterations << " passes, " << guide.GetLeafCount() << " leaves" << endl;
+    }
+    
+    if (budgetMs > 0)
+    {
+        // --spp becomes the quality cap; the budget decides how much of it
+        // is reached.
+        DeadlineSettings deadlineSettings;
+        deadlineSettings.m_budgetSeconds = budgetMs / 1000.0;
+        deadlineSettings.m_maxSamplesPerPixel = spp;
+        DeadlineReport report = DeadlineRenderer(renderer).Render(world, camera, settings, frameBuffer, deadlineSettings);
+        cout << "Budget " << budgetMs << " ms: " << report.m_passes << " passes in " << report.m_seconds * 1000.0 << " ms, "
+             << report.m_completedSamplesPerPixel << " spp everywhere"
+             << (report.m_bHitDeadline ? ", stopped at deadline" : ", reached sample cap") << endl;
+        cout << "Samples per pixel by region:" << endl;
+        DeadlineRenderer::PrintSampleCounts(frameBuffer, 4, cout);
+    }
+    else
+    {
+        renderer.RenderPass(world, camera, settings, frameBuffer);
+    }
+    
+    if (!frameBuffer.WritePPM(imageFileName))
+    {
+        cout << "Could not write " << imageFileName << endl;
+    }
+    
+    if (texture)
+    {
+        textureCache.PrintStatistics(cout);
+    }
     
     auto endTime = std::chrono::high_resolution_clock::now();
     